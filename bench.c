@@ -0,0 +1,477 @@
+/*
+ * Microbenchmarks of the inner kernels of the patch engine.
+ *
+ * The kernels are static functions of fliki.c, so this program is
+ * built from fliki.c itself, included below, rather than linked
+ * against it; it is not part of the fliki binary.  Each kernel is run
+ * on inputs generated from a fixed seed, repeatedly for a minimum
+ * time, and the best of many such rounds, taken in turn with those of
+ * the other kernels, is reported as cycles (of the time stamp counter,
+ * where there is one, otherwise nanoseconds) per byte of input.
+ *
+ *   fliki-bench [--save=FILE] [--compare=FILE] [--tolerance=PCT] [KERNEL...]
+ *
+ * --save writes the results as a baseline; --compare reads one and
+ * fails if any kernel got more than PCT percent (default 10) slower.
+ * With names given, only those kernels are run.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "fliki.c"
+
+#define BENCH_SEED 0x9e3779b97f4a7c15ULL
+#define BENCH_BYTES (1 << 20)  // size of each generated input
+#define BENCH_ROUNDS 25        // the best of these is reported
+#define BENCH_ROUND_NS 5000000LL   // each round runs at least this long
+#define BENCH_TOLERANCE 10     // percent slower than the baseline that fails
+#define BENCH_SHOWS 1000       // hunk_show() calls per run
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BENCH_UNIT "cycles"
+static unsigned long long bench_ticks(void) {
+    return __builtin_ia32_rdtsc();
+}
+#else
+#define BENCH_UNIT "ns"
+static unsigned long long bench_ticks(void) {
+    return 0;
+}
+#endif
+
+static volatile long long sink;   // keeps the results of the kernels alive
+
+static unsigned long long rng_state = BENCH_SEED;
+
+// xorshift64*, so that the inputs are the same everywhere
+static unsigned long long rng(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static int rng_below(int n) {
+    return (int) (rng() % (unsigned long long) n);
+}
+
+/*
+ * The inputs.  Each is built in a buffer stream, which is kept open
+ * for its contents.
+ */
+typedef struct bench_input {
+    STREAM *stream;
+    const unsigned char *bytes;
+    size_t len;
+} BENCH_INPUT;
+
+static BENCH_INPUT text;          // lines of 0 to 79 printable characters
+static BENCH_INPUT expected;      // a copy of text, as the deleted lines of a diff
+static BENCH_INPUT numbers;       // numbers of 1 to 8 digits, each followed by a comma
+static BENCH_INPUT headers;       // one-line change hunks: mostly headers
+static BENCH_INPUT short_lines;   // one hunk of lines of 0 to 6 characters
+static BENCH_INPUT long_lines;    // one hunk of lines of 0 to 199 characters
+static long *line_starts;         // offsets of the lines of text, and of its end
+static long line_count;
+static FILE *devnull;
+
+static void input_done(BENCH_INPUT *ip) {
+    ip->bytes = stream_contents(ip->stream, &ip->len);
+}
+
+static void put_line(STREAM *s, const char *prefix, int length) {
+    while (*prefix != 0)
+        stream_putc(*(prefix++), s);
+    for (int i = 0; i < length; i++)
+        stream_putc('!' + rng_below(94), s);
+    stream_putc('\n', s);
+}
+
+static void put_number(STREAM *s, long n) {
+    char digits[24];
+    int len = snprintf(digits, sizeof(digits), "%ld", n);
+    stream_write(digits, len, s);
+}
+
+// a single change hunk of about BENCH_BYTES, with lines of up to max characters
+static void make_hunk(BENCH_INPUT *ip, int max) {
+    int count = BENCH_BYTES / (max + 6);
+    ip->stream = stream_open_buffer();
+    stream_write("1,", 2, ip->stream);
+    put_number(ip->stream, count);
+    stream_write("c1,", 3, ip->stream);
+    put_number(ip->stream, count);
+    stream_putc('\n', ip->stream);
+    for (int i = 0; i < count; i++)
+        put_line(ip->stream, "< ", rng_below(max + 1));
+    stream_write("---\n", 4, ip->stream);
+    for (int i = 0; i < count; i++)
+        put_line(ip->stream, "> ", rng_below(max + 1));
+    input_done(ip);
+}
+
+static int make_inputs(void) {
+    text.stream = stream_open_buffer();
+    line_count = 0;
+    while (text.stream->len < BENCH_BYTES){
+        put_line(text.stream, "", rng_below(80));
+        line_count++;
+    }
+    input_done(&text);
+    line_starts = malloc((line_count + 1) * sizeof(long));
+    expected.stream = stream_open_buffer();
+    stream_write(text.bytes, text.len, expected.stream);
+    input_done(&expected);
+    if (line_starts == NULL)
+        return -1;
+    long k = 0;
+    *line_starts = 0;
+    for (size_t i = 0; i < text.len; i++)
+        if (*(text.bytes + i) == '\n')
+            *(line_starts + ++k) = i + 1;
+
+    numbers.stream = stream_open_buffer();
+    while (numbers.stream->len < BENCH_BYTES){
+        put_number(numbers.stream, rng() % *(powers_of_ten + 1 + rng_below(8)));
+        stream_putc(',', numbers.stream);
+    }
+    input_done(&numbers);
+
+    headers.stream = stream_open_buffer();
+    for (long line = 1; headers.stream->len < BENCH_BYTES; line += 1 + rng_below(1000)){
+        put_number(headers.stream, line);
+        stream_putc('c', headers.stream);
+        put_number(headers.stream, line);
+        stream_putc('\n', headers.stream);
+        put_line(headers.stream, "< ", rng_below(4));
+        stream_write("---\n", 4, headers.stream);
+        put_line(headers.stream, "> ", rng_below(4));
+    }
+    input_done(&headers);
+
+    make_hunk(&short_lines, 6);
+    make_hunk(&long_lines, 199);
+    devnull = fopen("/dev/null", "w");
+    return text.stream->error || expected.stream->error || numbers.stream->error ||
+           headers.stream->error || short_lines.stream->error || long_lines.stream->error ||
+           devnull == NULL ? -1 : 0;
+}
+
+/*
+ * The kernels.  Each makes one pass over its input, returning the
+ * number of bytes it covered.
+ */
+
+// parse_num(): the numbers of hunk headers
+static long long bench_parse_num(void) {
+    const unsigned char *p = numbers.bytes;
+    const unsigned char *end = p + numbers.len;
+    int n;
+    long long sum = 0;
+    while (p < end && (p = parse_num(p, end, &n)) != NULL){
+        sum += n;
+        p++;
+    }
+    sink = sum;
+    return numbers.len;
+}
+
+// hunk_next_stream(): diffs made of small hunks are mostly headers
+static long long bench_headers(void) {
+    STREAM *s = stream_open_memory(headers.bytes, headers.len);
+    HUNK hunk;
+    hunk.serial = 0;
+    hunk.type = HUNK_NO_TYPE;
+    hunk_reset();
+    HUNK_SIZE size;
+    while (hunk_next_stream(&hunk, s) == 0)
+        hunk_skip(&hunk, s, &size);
+    sink = hunk.serial;
+    stream_close(s);
+    return headers.len;
+}
+
+// line_kind(): recognizing "< ", "> " and "---" at the start of each short line
+static long long bench_line_kind(void) {
+    STREAM *s = stream_open_memory(short_lines.bytes, short_lines.len);
+    HUNK hunk;
+    hunk.serial = 0;
+    hunk.type = HUNK_NO_TYPE;
+    hunk_reset();
+    HUNK_SIZE size;
+    if (hunk_next_stream(&hunk, s) == 0)
+        hunk_skip(&hunk, s, &size);
+    sink = hunk.serial;
+    stream_close(s);
+    return short_lines.len;
+}
+
+// hunk_getspan(): the data of a hunk, as the patch engine reads it
+static long long bench_getspan(void) {
+    STREAM *s = stream_open_memory(long_lines.bytes, long_lines.len);
+    HUNK hunk;
+    hunk.serial = 0;
+    hunk.type = HUNK_NO_TYPE;
+    hunk_reset();
+    long long sum = 0;
+    if (hunk_next_stream(&hunk, s) == 0){
+        const unsigned char *span;
+        long n;
+        while ((n = hunk_getspan(&hunk, s, &span)) != ERR)
+            sum += n;
+    }
+    sink = sum;
+    stream_close(s);
+    return long_lines.len;
+}
+
+// match_span(): deleted lines compared with the input, a line at a time
+static long long bench_match_span(void) {
+    STREAM *in = stream_open_memory(text.bytes, text.len);
+    input_file_new_line_flag = 0;
+    long long sum = 0;
+    for (long i = 0; i < line_count; i++){
+        long matched;
+        long start = *(line_starts + i);
+        match_span(in, expected.bytes + start, *(line_starts + i + 1) - start, &matched);
+        sum += matched;
+    }
+    sink = sum;
+    stream_close(in);
+    return text.len;
+}
+
+// match_span_loose(): the same, with --ignore-trailing-ws
+static long long bench_match_loose(void) {
+    STREAM *in = stream_open_memory(text.bytes, text.len);
+    input_file_new_line_flag = 0;
+    line_tail = 0;
+    long long sum = 0;
+    for (long i = 0; i < line_count; i++){
+        long matched;
+        long start = *(line_starts + i);
+        match_span_loose(in, expected.bytes + start, *(line_starts + i + 1) - start, &matched,
+                         IGNORE_TRAILING_WS_OPTION);
+        sum += matched;
+    }
+    sink = sum;
+    stream_close(in);
+    return text.len;
+}
+
+// copy_lines(): skipping over the lines the diff leaves alone, with -n
+static long long bench_skip_lines(void) {
+    STREAM *in = stream_open_memory(text.bytes, text.len);
+    old_file_line_count = new_file_line_count = 1;
+    copy_lines(in, NULL, line_count, NO_PATCH_OPTION);
+    sink = old_file_line_count;
+    stream_close(in);
+    return text.len;
+}
+
+// copy_lines(): copying them to the output
+static long long bench_copy_lines(void) {
+    STREAM *in = stream_open_memory(text.bytes, text.len);
+    STREAM *out = stream_open_writer(devnull, STREAM_PLAIN, 0, 0);
+    old_file_line_count = new_file_line_count = 1;
+    copy_lines(in, out, line_count, 0);
+    sink = old_file_line_count;
+    stream_close(out);
+    stream_close(in);
+    return text.len;
+}
+
+// hunk_show(): rendering a hunk whose buffers are full
+static long long bench_hunk_show(void) {
+    static long long shown = 0;
+    STREAM *s = stream_open_memory(long_lines.bytes, long_lines.len);
+    HUNK hunk;
+    hunk.serial = 0;
+    hunk.type = HUNK_NO_TYPE;
+    hunk_reset();
+    const unsigned char *span;
+    if (hunk_next_stream(&hunk, s) == 0)
+        while (hunk_getspan(&hunk, s, &span) != ERR)
+            ;
+    stream_close(s);
+    if (shown == 0){
+        FILE *f = tmpfile();
+        if (f != NULL){
+            hunk_show(&hunk, f);
+            shown = ftell(f);
+            fclose(f);
+        }
+    }
+    for (int i = 0; i < BENCH_SHOWS; i++)
+        hunk_show(&hunk, devnull);
+    return shown * BENCH_SHOWS;
+}
+
+typedef struct bench {
+    const char *name;
+    long long (*run)(void);
+    double per_byte;           // best BENCH_UNIT per byte
+    double ns_per_byte;        // in the same round
+} BENCH;
+
+static BENCH benches[] = {
+    { "parse_num", bench_parse_num, 0, 0 },
+    { "headers", bench_headers, 0, 0 },
+    { "line_kind", bench_line_kind, 0, 0 },
+    { "getspan", bench_getspan, 0, 0 },
+    { "match_span", bench_match_span, 0, 0 },
+    { "match_loose", bench_match_loose, 0, 0 },
+    { "skip_lines", bench_skip_lines, 0, 0 },
+    { "copy_lines", bench_copy_lines, 0, 0 },
+    { "hunk_show", bench_hunk_show, 0, 0 },
+};
+#define BENCH_COUNT ((int) (sizeof(benches) / sizeof(*benches)))
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// run one round of a kernel, keeping the result if it is the best so far
+static void measure(BENCH *bp) {
+    long long bytes = 0;
+    long long start = now_ns();
+    unsigned long long ticks = bench_ticks();
+    long long ns;
+    do {
+        bytes += bp->run();
+    } while ((ns = now_ns() - start) < BENCH_ROUND_NS);
+    ticks = bench_ticks() - ticks;
+    double per_byte = (ticks != 0 ? (double) ticks : (double) ns) / bytes;
+    if (bp->per_byte < 0 || per_byte < bp->per_byte){
+        bp->per_byte = per_byte;
+        bp->ns_per_byte = (double) ns / bytes;
+    }
+}
+
+static int same_string(const char *a, const char *b) {
+    while (*a != 0 && *a == *b){
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+// as in validargs.c: the value of "--name=value", or NULL if arg is not that option
+static char *match_option(char *arg, char *name) {
+    if (*arg != '-' || *(arg + 1) != '-')
+        return NULL;
+    arg += 2;
+    while (*name != 0){
+        if (*arg != *name)
+            return NULL;
+        arg++;
+        name++;
+    }
+    return *arg == '=' ? arg + 1 : NULL;
+}
+
+// the baseline figure for a kernel, or -1 if there is none
+static double baseline_of(FILE *baseline, const char *name) {
+    char line[256], kernel[64];
+    double value;
+    rewind(baseline);
+    while (fgets(line, sizeof(line), baseline) != NULL){
+        if (*line != '#' && sscanf(line, "%63s %lf", kernel, &value) == 2 && same_string(kernel, name))
+            return value;
+    }
+    return -1;
+}
+
+static int selected(const char *name, char **names, int count) {
+    for (int i = 0; i < count; i++)
+        if (same_string(name, *(names + i)))
+            return 1;
+    return count == 0;
+}
+
+int main(int argc, char **argv) {
+    char *save = NULL, *compare = NULL, *value;
+    int tolerance = BENCH_TOLERANCE;
+    char **names = argv + 1;
+    int count = 0;
+    for (int i = 1; i < argc; i++){
+        char *arg = *(argv + i);
+        if ((value = match_option(arg, "save")) != NULL)
+            save = value;
+        else if ((value = match_option(arg, "compare")) != NULL)
+            compare = value;
+        else if ((value = match_option(arg, "tolerance")) != NULL)
+            tolerance = atoi(value);
+        else if (*arg == '-'){
+            fprintf(stderr, "usage: %s [--save=FILE] [--compare=FILE] [--tolerance=PCT] [KERNEL...]\n",
+                    *argv);
+            return EXIT_FAILURE;
+        }
+        else
+            *(names + count++) = arg;
+    }
+
+    FILE *baseline = NULL;
+    if (compare != NULL && (baseline = fopen(compare, "r")) == NULL){
+        perror(compare);
+        return EXIT_FAILURE;
+    }
+    if (make_inputs()){
+        fprintf(stderr, "cannot make the inputs\n");
+        return EXIT_FAILURE;
+    }
+
+    // the rounds of the kernels take turns, so that a spell of interference
+    // from the rest of the machine does not fall on the rounds of just one
+    for (int i = 0; i < BENCH_COUNT; i++){
+        (benches + i)->per_byte = -1;
+        if (selected((benches + i)->name, names, count))
+            (benches + i)->run();
+    }
+    for (int round = 0; round < BENCH_ROUNDS; round++)
+        for (int i = 0; i < BENCH_COUNT; i++)
+            if (selected((benches + i)->name, names, count))
+                measure(benches + i);
+
+    int slower = 0;
+    printf("%-12s %12s %10s %10s", "kernel", BENCH_UNIT "/byte", "ns/byte", "MB/s");
+    printf(baseline != NULL ? " %12s %8s\n" : "\n", "baseline", "change");
+    for (int i = 0; i < BENCH_COUNT; i++){
+        BENCH *bp = benches + i;
+        if (!selected(bp->name, names, count))
+            continue;
+        printf("%-12s %12.3f %10.3f %10.1f", bp->name, bp->per_byte, bp->ns_per_byte,
+               1000 / bp->ns_per_byte);
+        double base = baseline != NULL ? baseline_of(baseline, bp->name) : -1;
+        if (base > 0){
+            double change = 100 * (bp->per_byte - base) / base;
+            printf(" %12.3f %+7.1f%%%s", base, change, change > tolerance ? "  SLOWER" : "");
+            slower += change > tolerance;
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+    if (baseline != NULL)
+        fclose(baseline);
+
+    if (save != NULL){
+        FILE *f = fopen(save, "w");
+        if (f == NULL){
+            perror(save);
+            return EXIT_FAILURE;
+        }
+        fprintf(f, "# fliki-bench baseline: kernel, " BENCH_UNIT " per byte\n");
+        for (int i = 0; i < BENCH_COUNT; i++)
+            if (selected((benches + i)->name, names, count))
+                fprintf(f, "%s %.3f\n", (benches + i)->name, (benches + i)->per_byte);
+        if (fclose(f)){
+            perror(save);
+            return EXIT_FAILURE;
+        }
+    }
+    return slower ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,110 @@
+#include <stdlib.h>
+
+#include "budget.h"
+
+/*
+ * The memory budget.  See budget.h.  Each block starts with a header
+ * recording its size, so that freeing it can give the size back.
+ */
+
+static long long limit = 0;    // 0 for no limit
+static long long used = 0;
+static long long peak = 0;
+static long refusals = 0;
+
+/**
+ * @brief  Set the number of bytes the engine may have allocated at once.
+ * @details  This should be done before anything is allocated.
+ *
+ * @param bytes  The limit, or 0 for none.
+ */
+void budget_set(long long bytes) {
+    limit = bytes;
+}
+
+// reserve n more bytes, returning 0 if they fit in the budget
+static int charge(long long n) {
+    long long now = __atomic_add_fetch(&used, n, __ATOMIC_RELAXED);
+    if (limit > 0 && n > 0 && now > limit){
+        __atomic_sub_fetch(&used, n, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&refusals, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    long long high = __atomic_load_n(&peak, __ATOMIC_RELAXED);
+    while (now > high && !__atomic_compare_exchange_n(&peak, &high, now, 0, __ATOMIC_RELAXED,
+                                                      __ATOMIC_RELAXED))
+        ;
+    return 0;
+}
+
+static size_t size_of(void *p) {
+    return *(size_t *) ((char *) p - BUDGET_HEADER);
+}
+
+void *budget_malloc(size_t n) {
+    if (charge(n + BUDGET_HEADER))
+        return NULL;
+    char *block = malloc(n + BUDGET_HEADER);
+    if (block == NULL){
+        charge(-(long long) (n + BUDGET_HEADER));
+        return NULL;
+    }
+    *(size_t *) block = n;
+    return block + BUDGET_HEADER;
+}
+
+void *budget_calloc(size_t count, size_t size) {
+    if (size != 0 && count > ((size_t) -1 - BUDGET_HEADER) / size)
+        return NULL;
+    char *p = budget_malloc(count * size);
+    if (p != NULL)
+        for (size_t i = 0; i < count * size; i++)
+            *(p + i) = 0;
+    return p;
+}
+
+/**
+ * @brief  Resize a block, as realloc() does.
+ * @details  If the larger size does not fit in the budget, the block
+ * is left as it was and NULL is returned.
+ */
+void *budget_realloc(void *p, size_t n) {
+    if (p == NULL)
+        return budget_malloc(n);
+    size_t old = size_of(p);
+    long long more = (long long) n - (long long) old;
+    if (more > 0 && charge(more))
+        return NULL;
+    char *block = realloc((char *) p - BUDGET_HEADER, n + BUDGET_HEADER);
+    if (block == NULL){
+        if (more > 0)
+            charge(-more);
+        return NULL;
+    }
+    if (more < 0)
+        charge(more);
+    *(size_t *) block = n;
+    return block + BUDGET_HEADER;
+}
+
+void budget_free(void *p) {
+    if (p == NULL)
+        return;
+    charge(-(long long) (size_of(p) + BUDGET_HEADER));
+    free((char *) p - BUDGET_HEADER);
+}
+
+// bytes allocated now
+long long budget_used(void) {
+    return __atomic_load_n(&used, __ATOMIC_RELAXED);
+}
+
+// the most bytes allocated at any one time
+long long budget_peak(void) {
+    return __atomic_load_n(&peak, __ATOMIC_RELAXED);
+}
+
+// the number of allocations refused so far for lack of budget
+long budget_refusals(void) {
+    return __atomic_load_n(&refusals, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,30 @@
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include <stddef.h>
+
+/*
+ * Memory budget of the patch engine.
+ *
+ * The engine's buffers, arenas and indexes are allocated with the
+ * functions below in place of malloc() and friends, and charged
+ * against one budget shared by all threads.  An allocation that
+ * would take the total over the limit fails as if memory had run
+ * out, and the engine then makes do with less: smaller I/O blocks,
+ * no line index, or intermediate results spilled to temporary files.
+ * Only memory obtained from these functions is counted; stacks,
+ * stdio buffers and the program itself are not.
+ */
+
+#define BUDGET_HEADER 16       // bytes in front of each block, keeping it aligned
+
+void budget_set(long long limit);
+void *budget_malloc(size_t n);
+void *budget_calloc(size_t count, size_t size);
+void *budget_realloc(void *p, size_t n);
+void budget_free(void *p);
+long long budget_used(void);
+long long budget_peak(void);
+long budget_refusals(void);
+
+#endif
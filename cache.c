@@ -0,0 +1,403 @@
+#define _GNU_SOURCE            // copy_file_range()
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+
+#include "fliki.h"
+#include "global.h"
+#include "debug.h"
+#include "options.h"
+#include "stream.h"
+#include "hash.h"
+#include "cache.h"
+
+/*
+ * The result cache.  See cache.h.
+ */
+
+typedef struct sum_record {
+    long long magic;
+    long long dev;
+    long long ino;
+    long long size;
+    long long mtime_sec;
+    long long mtime_nsec;
+    long long ctime_sec;       // changes on any write, even one that restores the mtime
+    long long ctime_nsec;
+    unsigned char digest[HASH_SIZE];
+} SUM_RECORD;
+
+static size_t text_length(const char *s) {
+    size_t n = 0;
+    while (*(s + n) != 0)
+        n++;
+    return n;
+}
+
+// the hash record of a file, or with temp set, a temporary file to write it in
+static char *sum_path(const char *dir, struct stat *st, int temp) {
+    static int writes = 0;
+    size_t size = text_length(dir) + 96;
+    char *path = malloc(size);
+    if (path == NULL)
+        return NULL;
+    int n = snprintf(path, size, "%s/%s%llx-%llx.sum", dir, temp ? CACHE_TEMP_PREFIX : "",
+                     (unsigned long long) st->st_dev, (unsigned long long) st->st_ino);
+    // a process id and a count of writes keep concurrent writers apart
+    if (temp)
+        snprintf(path + n, size - n, ".%d.%d", (int) getpid(),
+                 __atomic_fetch_add(&writes, 1, __ATOMIC_RELAXED));
+    return path;
+}
+
+// the entry for an input and diff, applied with the given IGNORE_OPTIONS
+static char *entry_path(const char *dir, unsigned char *in_digest, unsigned char *diff_digest,
+                        long ignore) {
+    static const char hex[] = "0123456789abcdef";
+    size_t n = text_length(dir);
+    char *path = malloc(n + 4 * HASH_SIZE + 32);
+    if (path == NULL)
+        return NULL;
+    char *p = path;
+    for (size_t i = 0; i < n; i++)
+        *(p++) = *(dir + i);
+    *(p++) = '/';
+    for (int i = 0; i < 2 * HASH_SIZE; i++){
+        unsigned char b = i < HASH_SIZE ? *(in_digest + i) : *(diff_digest + i - HASH_SIZE);
+        if (i == HASH_SIZE)
+            *(p++) = '-';
+        *(p++) = *(hex + b / 16);
+        *(p++) = *(hex + b % 16);
+    }
+    // a diff that applies only leniently must not be found by an exact patch
+    if (ignore)
+        snprintf(p, 24, "-%lx.out", ignore);
+    else
+        snprintf(p, 5, ".out");
+    return path;
+}
+
+static void record_of(SUM_RECORD *r, struct stat *st) {
+    r->magic = CACHE_SUM_MAGIC;
+    r->dev = st->st_dev;
+    r->ino = st->st_ino;
+    r->size = st->st_size;
+    r->mtime_sec = st->st_mtim.tv_sec;
+    r->mtime_nsec = st->st_mtim.tv_nsec;
+    r->ctime_sec = st->st_ctim.tv_sec;
+    r->ctime_nsec = st->st_ctim.tv_nsec;
+}
+
+// whether two records are of the same file in the same state
+static int same_record(SUM_RECORD *a, SUM_RECORD *b) {
+    return a->magic == b->magic && a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+           a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec &&
+           a->ctime_sec == b->ctime_sec && a->ctime_nsec == b->ctime_nsec;
+}
+
+/*
+ * Whether a time stamp is so recent that the file could still change
+ * within the same tick without the stamp changing: a file in that
+ * state cannot be told apart from its next version, so its hash is
+ * not remembered (git calls such a file "racily clean").
+ */
+static int racy(struct timespec *stamp, struct timespec *now) {
+    long long diff = (long long) (now->tv_sec - stamp->tv_sec) * 1000000000LL +
+                     (now->tv_nsec - stamp->tv_nsec);
+    return diff < CACHE_TICK_NSEC;
+}
+
+// the remembered hash of a file, which must not have changed since; returns 0 if known
+static int sum_read(const char *dir, struct stat *st, unsigned char *digest) {
+    char *path = sum_path(dir, st, 0);
+    if (path == NULL)
+        return -1;
+    FILE *f = fopen(path, "r");
+    free(path);
+    if (f == NULL)
+        return -1;
+    SUM_RECORD want, r;
+    record_of(&want, st);
+    int result = -1;
+    if (fread(&r, sizeof(r), 1, f) == 1 && same_record(&r, &want)){
+        for (int i = 0; i < HASH_SIZE; i++)
+            *(digest + i) = *(r.digest + i);
+        // the record was used, so it is kept as long as the entries are
+        futimens(fileno(f), NULL);
+        result = 0;
+    }
+    fclose(f);
+    return result;
+}
+
+// remember the hash of a file, if it did not change while it was read and is not racily clean
+static void sum_write(const char *dir, int fd, struct stat *before, unsigned char *digest) {
+    struct stat st;
+    struct timespec now;
+    if (fstat(fd, &st) || clock_gettime(CLOCK_REALTIME, &now) ||
+        racy(&st.st_mtim, &now) || racy(&st.st_ctim, &now))
+        return;
+    SUM_RECORD was, is;
+    record_of(&was, before);
+    record_of(&is, &st);
+    if (!same_record(&is, &was))
+        return;
+    char *path = sum_path(dir, &st, 0);
+    char *tmp = sum_path(dir, &st, 1);
+    if (path != NULL && tmp != NULL){
+        SUM_RECORD r;
+        record_of(&r, &st);
+        for (int i = 0; i < HASH_SIZE; i++)
+            *(r.digest + i) = *(digest + i);
+        FILE *f = fopen(tmp, "w");
+        if (f != NULL){
+            int ok = fwrite(&r, sizeof(r), 1, f) == 1;
+            if (fclose(f) || !ok || rename(tmp, path))
+                unlink(tmp);
+        }
+    }
+    free(path);
+    free(tmp);
+}
+
+/*
+ * Send size bytes of the file from to the output, by the cheapest
+ * means the two files allow: sharing the blocks outright (reflink)
+ * when the output is an empty regular file, copying inside the kernel
+ * otherwise, and through memory only as a last resort.
+ */
+static int send_entry(int from, long long size, FILE *out) {
+    if (fflush(out))
+        return -1;
+    int to = fileno(out);
+    struct stat st;
+#ifdef FICLONE
+    if (fstat(to, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == 0 &&
+        lseek(to, 0, SEEK_CUR) == 0 && ioctl(to, FICLONE, from) == 0)
+        return lseek(to, size, SEEK_SET) == size ? 0 : -1;
+#endif
+    (void) st;
+
+    off_t at = 0;
+    while (at < size && copy_file_range(from, &at, to, NULL, size - at, 0) > 0)
+        ;
+    while (at < size && sendfile(to, from, &at, size - at) > 0)
+        ;
+    char buf[STREAM_BUFSIZE];
+    while (at < size){
+        ssize_t n = pread(from, buf, sizeof(buf), at);
+        if (n <= 0)
+            return -1;
+        for (ssize_t done = 0; done < n; ){
+            ssize_t k = write(to, buf + done, n - done);
+            if (k <= 0)
+                return -1;
+            done += k;
+        }
+        at += n;
+    }
+    return 0;
+}
+
+// look up a result by the remembered hashes of the input and diff; returns 0 if it was sent
+static int cache_hit(const char *dir, int in_fd, struct stat *in_st, int diff_fd,
+                     struct stat *diff_st, FILE *out) {
+    unsigned char in_digest[HASH_SIZE], diff_digest[HASH_SIZE];
+    if (!S_ISREG(in_st->st_mode) || !S_ISREG(diff_st->st_mode) ||
+        lseek(in_fd, 0, SEEK_CUR) != 0 || lseek(diff_fd, 0, SEEK_CUR) != 0 ||
+        sum_read(dir, in_st, in_digest) || sum_read(dir, diff_st, diff_digest))
+        return -1;
+    char *path = entry_path(dir, in_digest, diff_digest, global_options & IGNORE_OPTIONS);
+    if (path == NULL)
+        return -1;
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    int result = -1;
+    if (fstat(fd, &st) == 0){
+        // the entry is now the most recently used
+        futimens(fd, NULL);
+        result = send_entry(fd, st.st_size, out) ? 1 : 0;
+    }
+    close(fd);
+    return result;
+}
+
+typedef struct entry {
+    char *name;
+    long long size;
+    long long mtime;
+} ENTRY;
+
+static int older(const void *a, const void *b) {
+    const ENTRY *x = a, *y = b;
+    return x->mtime < y->mtime ? -1 : x->mtime > y->mtime;
+}
+
+static int has_prefix(const char *name, const char *prefix) {
+    while (*prefix != 0 && *name == *prefix){
+        name++;
+        prefix++;
+    }
+    return *prefix == 0;
+}
+
+static int has_suffix(const char *name, const char *suffix) {
+    size_t n = text_length(name), k = text_length(suffix);
+    if (n < k)
+        return 0;
+    for (size_t i = 0; i < k; i++)
+        if (*(name + n - k + i) != *(suffix + i))
+            return 0;
+    return 1;
+}
+
+// remove least recently used entries and hash records until the rest fit in limit bytes
+static void cache_evict(const char *dir, long long limit) {
+    DIR *d = opendir(dir);
+    if (d == NULL)
+        return;
+    ENTRY *entries = NULL;
+    size_t count = 0, capacity = 0;
+    long long total = 0;
+    time_t now = time(NULL);
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL){
+        struct stat st;
+        int is_tmp = has_prefix(de->d_name, CACHE_TEMP_PREFIX);
+        int is_entry = !is_tmp && (has_suffix(de->d_name, ".out") || has_suffix(de->d_name, ".sum"));
+        if ((!is_entry && !is_tmp) || fstatat(dirfd(d), de->d_name, &st, 0) || !S_ISREG(st.st_mode))
+            continue;
+        if (is_tmp){
+            // left behind by a process that died before renaming it
+            if (now - st.st_mtim.tv_sec > CACHE_STALE_SECONDS)
+                unlinkat(dirfd(d), de->d_name, 0);
+            continue;
+        }
+        if (count == capacity){
+            size_t more = capacity ? 2 * capacity : 64;
+            ENTRY *p = realloc(entries, more * sizeof(ENTRY));
+            if (p == NULL)
+                break;
+            entries = p;
+            capacity = more;
+        }
+        size_t n = text_length(de->d_name) + 1;
+        char *name = malloc(n);
+        if (name == NULL)
+            break;
+        for (size_t i = 0; i < n; i++)
+            *(name + i) = *(de->d_name + i);
+        (entries + count)->name = name;
+        (entries + count)->size = st.st_size;
+        (entries + count)->mtime = st.st_mtim.tv_sec;
+        count++;
+        total += st.st_size;
+    }
+
+    if (total > limit){
+        qsort(entries, count, sizeof(ENTRY), older);
+        for (size_t i = 0; i < count && total > limit; i++){
+            unlinkat(dirfd(d), (entries + i)->name, 0);
+            total -= (entries + i)->size;
+        }
+    }
+    for (size_t i = 0; i < count; i++)
+        free((entries + i)->name);
+    free(entries);
+    closedir(d);
+}
+
+/**
+ * @brief  Patch a file, using and filling a cache of earlier results.
+ * @details  This behaves like patch(), except that a result found in
+ * the cache directory is sent to the output instead of being computed,
+ * and a result that is computed is added to the cache.  Problems with
+ * the cache itself only cost the chance to use it.
+ *
+ * @param dir  Cache directory, which must exist.
+ * @param limit  Bytes the cached results may take up in all.
+ * @return  0 in case processing completes without any errors, and -1
+ * if there were errors, as for patch().
+ */
+int patch_cached(FILE *in, FILE *out, FILE *diff, const char *dir, long long limit) {
+    if (in == NULL || out == NULL || diff == NULL)
+        return -1;
+    if (output_codec != STREAM_PLAIN || (global_options & NO_PATCH_OPTION))
+        return patch(in, out, diff);
+
+    struct stat in_st, diff_st;
+    int in_fd = fileno(in), diff_fd = fileno(diff);
+    if (fstat(in_fd, &in_st) || fstat(diff_fd, &diff_st))
+        return patch(in, out, diff);
+    int hit = cache_hit(dir, in_fd, &in_st, diff_fd, &diff_st, out);
+    if (hit >= 0)
+        return hit ? -1 : 0;
+
+    // a miss: patch, hashing the input and diff and keeping a copy of the output
+    size_t n = text_length(dir) + 16;
+    char *tmp = malloc(n);
+    if (tmp == NULL)
+        return patch(in, out, diff);
+    snprintf(tmp, n, "%s/" CACHE_TEMP_PREFIX "XXXXXX", dir);
+    int tmp_fd = mkstemp(tmp);
+    FILE *tee = tmp_fd < 0 ? NULL : fdopen(tmp_fd, "w");
+    if (tee == NULL){
+        if (tmp_fd >= 0){
+            close(tmp_fd);
+            unlink(tmp);
+        }
+        free(tmp);
+        return patch(in, out, diff);
+    }
+
+    HASH in_hash, diff_hash;
+    hash_init(&in_hash);
+    hash_init(&diff_hash);
+    STREAM *in_stream = stream_open_reader(in);
+    STREAM *diff_stream = stream_open_reader(diff);
+    STREAM *out_stream = stream_open_writer(out, STREAM_PLAIN, 0, 0);
+    int result = -1;
+    if (in_stream != NULL && diff_stream != NULL && out_stream != NULL &&
+        stream_hash(in_stream, &in_hash) == 0 && stream_hash(diff_stream, &diff_hash) == 0){
+        out_stream->tee = tee;
+        result = patch_stream(in_stream, out_stream, diff_stream, global_options);
+    }
+    if (stream_close(out_stream) || in_stream == NULL || in_stream->error ||
+        diff_stream == NULL || diff_stream->error)
+        result = -1;
+    stream_close(in_stream);
+    stream_close(diff_stream);
+
+    int keep = result == 0 && !ferror(tee);
+    if (fclose(tee))
+        keep = 0;
+    char *path = NULL;
+    if (keep){
+        unsigned char in_digest[HASH_SIZE], diff_digest[HASH_SIZE];
+        hash_final(&in_hash, in_digest);
+        hash_final(&diff_hash, diff_digest);
+        path = entry_path(dir, in_digest, diff_digest, global_options & IGNORE_OPTIONS);
+        if (S_ISREG(in_st.st_mode))
+            sum_write(dir, in_fd, &in_st, in_digest);
+        if (S_ISREG(diff_st.st_mode))
+            sum_write(dir, diff_fd, &diff_st, diff_digest);
+    }
+    if (path == NULL || rename(tmp, path))
+        unlink(tmp);
+    else
+        cache_evict(dir, limit);
+    free(path);
+    free(tmp);
+    return result;
+}
@@ -0,0 +1,40 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdio.h>
+
+/*
+ * Content-addressed cache of patch results.
+ *
+ * The output of a successful patch is stored in the cache directory
+ * under the SHA-256 hashes of its input and its diff, as
+ * "<input hash>-<diff hash>.out".  The hashes are computed as the
+ * input and diff stream through the patch engine, so a miss reads
+ * nothing twice.  The hash of each regular file read is remembered in
+ * "<dev>-<ino>.sum", valid while the file's size, modification time
+ * and status change time stay the same; it is only remembered once
+ * both times are at least CACHE_TICK_NSEC old, so that a rewrite within
+ * the same tick cannot go unnoticed.  When both hashes are known that
+ * way, a cached result is sent to the output by the kernel (reflink,
+ * copy_file_range or sendfile) without the patch being run at all.
+ *
+ * Entries and hash records are written to a temporary file, named
+ * with CACHE_TEMP_PREFIX, and renamed into place, so readers never
+ * see a partial one.  A hit updates the modification time of its entry
+ * and of the hash records used, and after each insertion the least
+ * recently used entries and records are removed until together they
+ * fit in the size limit.  Temporary files left behind by a process
+ * that died are removed once they are CACHE_STALE_SECONDS old.
+ *
+ * Only uncompressed output of a single diff is cached, and nothing is
+ * cached with -n.
+ */
+
+#define CACHE_SUM_MAGIC 0x324d555331464c46LL    // "FLF1SUM2" stored little-endian
+#define CACHE_STALE_SECONDS 3600                 // age at which a leftover temporary file is removed
+#define CACHE_TICK_NSEC 1000000000LL             // coarsest file time stamp assumed, in nanoseconds
+#define CACHE_TEMP_PREFIX "tmp"                  // start of the name of every temporary file
+
+int patch_cached(FILE *in, FILE *out, FILE *diff, const char *dir, long long limit);
+
+#endif
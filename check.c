@@ -0,0 +1,312 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+
+#include "fliki.h"
+#include "global.h"
+#include "debug.h"
+#include "options.h"
+#include "stream.h"
+#include "reference.h"
+#include "check.h"
+
+/*
+ * Running the patch engine and the reference implementation side by
+ * side.  See check.h.
+ */
+
+static int same_bytes(const unsigned char *a, size_t a_len, const unsigned char *b, size_t b_len) {
+    if (a_len != b_len)
+        return 0;
+    for (size_t i = 0; i < a_len; i++)
+        if (*(a + i) != *(b + i))
+            return 0;
+    return 1;
+}
+
+static int same_header(HUNK *a, HUNK *b) {
+    return a->type == b->type && a->serial == b->serial &&
+           a->old_start == b->old_start && a->old_end == b->old_end &&
+           a->new_start == b->new_start && a->new_end == b->new_end;
+}
+
+/**
+ * @brief  Check that the engine reads a diff as the reference does.
+ * @details  The diff is read with hunk_next() and hunk_getspan() on
+ * one side, and a character at a time by the reference on the other.
+ *
+ * @return  0 if they agree throughout, -1 if not or if memory could
+ * not be allocated.
+ */
+int check_diff(const unsigned char *diff, size_t diff_len) {
+    STREAM *s = stream_open_memory(diff, diff_len);
+    if (s == NULL)
+        return -1;
+    REFERENCE r;
+    reference_init(&r, diff, diff_len);
+    HUNK engine, ref;
+    engine.serial = ref.serial = 0;
+    engine.type = ref.type = HUNK_NO_TYPE;
+    hunk_reset();
+
+    int agree = 1;
+    while (agree){
+        int e = hunk_next_stream(&engine, s);
+        int f = reference_hunk_next(&r, &ref);
+        agree = e == f && (e != 0 || same_header(&engine, &ref));
+        if (e != 0)
+            break;
+        long n = 0;
+        while (agree && n != ERR){
+            const unsigned char *span;
+            n = hunk_getspan(&engine, s, &span);
+            if (n < 0)
+                agree = reference_hunk_getc(&r, &ref) == n;
+            for (long i = 0; i < n && agree; i++)
+                agree = reference_hunk_getc(&r, &ref) == *(span + i);
+        }
+    }
+    stream_close(s);
+    hunk_reset();
+    return agree ? 0 : -1;
+}
+
+/**
+ * @brief  Check that the engine patches an input as the reference does.
+ * @details  The two must agree on whether the diff applies and, if it
+ * does, on the output.  The engine's output is not compared when the
+ * diff does not apply, as it is then incomplete.
+ *
+ * @param options  Options for the engine, as in global_options.
+ * @param resultp  Where to store the result of patch_stream(), if the
+ * two agree.
+ * @param out  Stream to which the patched output is written if the
+ * two agree and the diff applies, or NULL.  Nothing is written with
+ * NO_PATCH_OPTION.
+ * @return  0 if they agree, -1 if not or if memory could not be
+ * allocated.
+ */
+int check_patch(const unsigned char *in, size_t in_len, const unsigned char *diff,
+                size_t diff_len, long options, int *resultp, STREAM *out) {
+    STREAM *in_stream = stream_open_memory(in, in_len);
+    STREAM *diff_stream = stream_open_memory(diff, diff_len);
+    STREAM *engine_out = stream_open_buffer();
+    STREAM *ref_out = stream_open_buffer();
+    int agree = 0;
+    if (in_stream != NULL && diff_stream != NULL && engine_out != NULL && ref_out != NULL){
+        // the output is needed for the comparison even if it is not wanted
+        int e = patch_stream(in_stream, engine_out, diff_stream, options & ~NO_PATCH_OPTION);
+        int f = reference_patch(in, in_len, diff, diff_len, ref_out);
+        size_t e_len, f_len;
+        unsigned char *e_bytes = stream_contents(engine_out, &e_len);
+        unsigned char *f_bytes = stream_contents(ref_out, &f_len);
+        agree = e == f && !engine_out->error && !ref_out->error &&
+                (e != 0 || same_bytes(e_bytes, e_len, f_bytes, f_len));
+        if (agree){
+            *resultp = e;
+            if (e == 0 && out != NULL && !(options & NO_PATCH_OPTION))
+                stream_write(e_bytes, e_len, out);
+        }
+    }
+    stream_close(in_stream);
+    stream_close(diff_stream);
+    stream_close(engine_out);
+    stream_close(ref_out);
+    hunk_reset();
+    return agree ? 0 : -1;
+}
+
+/**
+ * @brief  Run every check on one block of fuzzer input.
+ * @details  The first two bytes, as a little-endian number modulo the
+ * number of bytes that follow plus one, give the length of the input
+ * to be patched; the remaining bytes are the diff.  The diff is also
+ * checked on its own.
+ *
+ * @return  0 if the engine and the reference agree, -1 if not.
+ */
+int check_fuzz_input(const unsigned char *data, size_t size) {
+    if (size < 2)
+        return check_diff(data, size);
+    size_t rest = size - 2;
+    size_t in_len = (*data | *(data + 1) << 8) % (rest + 1);
+    const unsigned char *in = data + 2;
+    const unsigned char *diff = in + in_len;
+    int result;
+    if (check_diff(diff, rest - in_len) ||
+        check_patch(in, in_len, diff, rest - in_len, QUIET_OPTION, &result, NULL))
+        return -1;
+    return 0;
+}
+
+#ifdef FLIKI_FUZZ
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size) {
+    if (check_fuzz_input(data, size))
+        abort();
+    return 0;
+}
+#endif
+
+#ifdef FLIKI_CHECK
+#include <dirent.h>
+
+// read the whole of a file, or NULL with *lenp 0 if it cannot be read
+static unsigned char *read_file(const char *path, size_t *lenp) {
+    *lenp = 0;
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return NULL;
+    size_t size = 4096, len = 0;
+    unsigned char *buf = malloc(size);
+    while (buf != NULL){
+        len += fread(buf + len, 1, size - len, f);
+        if (len < size || ferror(f))
+            break;
+        unsigned char *bigger = realloc(buf, size * 2);
+        if (bigger == NULL)
+            free(buf);
+        buf = bigger;
+        size *= 2;
+    }
+    if (buf != NULL && ferror(f)){
+        free(buf);
+        buf = NULL;
+    }
+    fclose(f);
+    if (buf != NULL)
+        *lenp = len;
+    return buf;
+}
+
+// whether a file name ends in ".diff", with something before it
+static int is_diff_name(const char *name) {
+    const char *suffix = ".diff";
+    size_t n = 0;
+    while (*(name + n) != 0)
+        n++;
+    if (n <= 5)
+        return 0;
+    for (size_t i = 0; i < 5; i++)
+        if (*(name + n - 5 + i) != *(suffix + i))
+            return 0;
+    return 1;
+}
+
+/*
+ * Check one pair of the corpus: NAME.diff, applied to NAME.in (or to
+ * empty input if there is no such file).  The pair is laid out the way
+ * check_fuzz_input() expects it.  Returns 0 if the engine and the
+ * reference agree, -1 if not or if the pair cannot be read.
+ */
+static int check_pair(const char *dir, const char *diff_name) {
+    char path[PATH_MAX];
+    size_t name_len = 0;
+    while (*(diff_name + name_len) != 0)
+        name_len++;
+    name_len -= 5;     // ".diff"
+    size_t diff_len, in_len;
+    if ((size_t) snprintf(path, sizeof(path), "%s/%s", dir, diff_name) >= sizeof(path))
+        return -1;
+    unsigned char *diff = read_file(path, &diff_len);
+    if ((size_t) snprintf(path, sizeof(path), "%s/%.*s.in", dir, (int) name_len, diff_name) >= sizeof(path)){
+        free(diff);
+        return -1;
+    }
+    unsigned char *in = read_file(path, &in_len);
+    unsigned char *data = malloc(2 + in_len + diff_len);
+    // the length of the input takes two bytes
+    int result = -1;
+    if (diff != NULL && data != NULL && in_len <= 0xffff){
+        *data = in_len & 0xff;
+        *(data + 1) = in_len >> 8;
+        for (size_t i = 0; i < in_len; i++)
+            *(data + 2 + i) = *(in + i);
+        for (size_t i = 0; i < diff_len; i++)
+            *(data + 2 + in_len + i) = *(diff + i);
+        result = check_fuzz_input(data, 2 + in_len + diff_len);
+    }
+    free(diff);
+    free(in);
+    free(data);
+    return result;
+}
+
+/*
+ * Differential check of a corpus, for use without a fuzzer: every
+ * NAME.diff in the directory given (by default "corpus") is checked
+ * with check_pair(), and the exit status is a failure if any pair
+ * mismatched or none was found.
+ */
+int main(int argc, char **argv) {
+    const char *dir = argc > 1 ? *(argv + 1) : "corpus";
+    DIR *d = opendir(dir);
+    if (d == NULL){
+        perror(dir);
+        return EXIT_FAILURE;
+    }
+    int checked = 0, failed = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL){
+        const char *name = de->d_name;
+        if (!is_diff_name(name))
+            continue;
+        checked++;
+        if (check_pair(dir, name)){
+            fprintf(stderr, "%s/%s: the engine and the reference disagree\n", dir, name);
+            failed++;
+        }
+    }
+    closedir(d);
+    printf("%d pairs checked, %d mismatched\n", checked, failed);
+    return failed || checked == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#endif
+
+// read the whole of a file into a memory stream, decompressing it if need be
+static STREAM *slurp(FILE *file) {
+    STREAM *in = stream_open_reader(file);
+    STREAM *buf = stream_open_buffer();
+    if (in != NULL && buf != NULL){
+        // the copy ends at the end of the file
+        stream_copy(in, buf, LLONG_MAX);
+    }
+    if (in == NULL || buf == NULL || in->error || buf->error){
+        stream_close(buf);
+        buf = NULL;
+    }
+    stream_close(in);
+    return buf;
+}
+
+/**
+ * @brief  Patch a file, checking the result against the reference.
+ * @details  The input and the diff are read into memory and patched by
+ * both the engine and the reference implementation.  The output is
+ * written only if they agree.  Options are taken from global_options
+ * and options.h, as for patch().
+ *
+ * @return  0 if the diff applies and the two agree, -1 otherwise.
+ */
+int patch_verify(FILE *in, FILE *out, FILE *diff) {
+    if (in == NULL || out == NULL || diff == NULL)
+        return -1;
+    STREAM *in_buf = slurp(in);
+    STREAM *diff_buf = slurp(diff);
+    STREAM *out_stream = stream_open_writer(out, output_codec, output_level, output_threads);
+    int result = -1;
+    if (in_buf != NULL && diff_buf != NULL && out_stream != NULL){
+        size_t in_len, diff_len;
+        unsigned char *in_bytes = stream_contents(in_buf, &in_len);
+        unsigned char *diff_bytes = stream_contents(diff_buf, &diff_len);
+        if (check_patch(in_bytes, in_len, diff_bytes, diff_len, global_options, &result, out_stream)){
+            if (!(global_options & QUIET_OPTION))
+                fprintf(stderr, "the patch engine and the reference implementation disagree\n");
+            result = -1;
+        }
+    }
+    if (stream_close(out_stream))
+        result = -1;
+    stream_close(in_buf);
+    stream_close(diff_buf);
+    return result;
+}
@@ -0,0 +1,32 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#include "stream.h"
+
+/*
+ * Differential checking of the patch engine against the reference
+ * implementation in reference.c.  Both are run in the same process on
+ * the same bytes, and must agree on every hunk header, every character
+ * of hunk data, whether the diff applies, and the patched output.
+ *
+ * check_fuzz_input() has the shape of a fuzzer entry point: it takes
+ * one block of bytes, runs both checks on it, and leaves nothing
+ * behind that could affect the next call.  Compiling check.c with
+ * -DFLIKI_FUZZ adds LLVMFuzzerTestOneInput(), which aborts on any
+ * disagreement; link it with libFuzzer (-fsanitize=fuzzer) or an
+ * AFL driver in place of main.c.  Compiling it with -DFLIKI_CHECK
+ * instead adds a main() that runs check_fuzz_input() over the seed
+ * corpus in corpus/, pairs of NAME.diff and NAME.in, and fails if
+ * any pair mismatches.
+ */
+
+int check_diff(const unsigned char *diff, size_t diff_len);
+int check_patch(const unsigned char *in, size_t in_len, const unsigned char *diff,
+                size_t diff_len, long options, int *resultp, STREAM *out);
+int check_fuzz_input(const unsigned char *data, size_t size);
+int patch_verify(FILE *in, FILE *out, FILE *diff);
+
+#endif
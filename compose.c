@@ -0,0 +1,507 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "fliki.h"
+#include "global.h"
+#include "debug.h"
+#include "options.h"
+#include "compose.h"
+#include "budget.h"
+
+/*
+ * While a chain of diffs is composed, the file produced so far is
+ * described as a list of pieces.  A piece is either a run of lines
+ * copied from the original file (the input of the first diff), or
+ * a run of lines inserted by one of the diffs.  The list starts out
+ * as a single piece copying the whole original file, whose length
+ * need not be known, and each diff edits the list in one pass over
+ * its hunks.  Lines of the original file that get deleted are
+ * remembered, because their text is needed for the deletions
+ * section of the composed diff.
+ */
+
+#define PIECE_REST (1L << 40)   // length of the piece reaching the end of the original
+
+typedef struct piece {
+    int inserted;      // 0: copied from the original, 1: inserted by a diff
+    long start;        // first original line, or first line in the work text
+    long count;
+} PIECE;
+
+typedef struct pieces {
+    PIECE *v;
+    int count;
+    int size;
+} PIECES;
+
+// a run of original lines deleted by some diff, and their text
+typedef struct deleted {
+    long old_line;
+    long count;
+    int line;          // first line in the work text
+} DELETED;
+
+typedef struct composer {
+    PIECES current;
+    DIFF work;         // text of all inserted and deleted lines
+    DELETED *deleted;
+    int deleted_count;
+    int deleted_size;
+} COMPOSER;
+
+static int pieces_add(PIECES *pp, int inserted, long start, long count) {
+    if (count == 0)
+        return 0;
+    if (pp->count > 0){
+        PIECE *last = pp->v + pp->count - 1;
+        if (last->inserted == inserted && last->start + last->count == start){
+            last->count += count;
+            return 0;
+        }
+    }
+    if (pp->count == pp->size){
+        int size = pp->size ? pp->size * 2 : 64;
+        PIECE *v = budget_realloc(pp->v, size * sizeof(PIECE));
+        if (v == NULL)
+            return -1;
+        pp->v = v;
+        pp->size = size;
+    }
+    PIECE *p = pp->v + pp->count++;
+    p->inserted = inserted;
+    p->start = start;
+    p->count = count;
+    return 0;
+}
+
+static int deleted_add(COMPOSER *cp, long old_line, long count, int line) {
+    if (cp->deleted_count == cp->deleted_size){
+        int size = cp->deleted_size ? cp->deleted_size * 2 : 64;
+        DELETED *v = budget_realloc(cp->deleted, size * sizeof(DELETED));
+        if (v == NULL)
+            return -1;
+        cp->deleted = v;
+        cp->deleted_size = size;
+    }
+    DELETED *dp = cp->deleted + cp->deleted_count++;
+    dp->old_line = old_line;
+    dp->count = count;
+    dp->line = line;
+    return 0;
+}
+
+static int same_line(DIFF *a, int i, DIFF *b, int j) {
+    size_t n = DIFF_LINE_LENGTH(a, i);
+    if (n != DIFF_LINE_LENGTH(b, j))
+        return 0;
+    char *p = DIFF_LINE_TEXT(a, i);
+    char *q = DIFF_LINE_TEXT(b, j);
+    for (size_t k = 0; k < n; k++)
+        if (*(p + k) != *(q + k))
+            return 0;
+    return 1;
+}
+
+// position in the current piece list
+typedef struct cursor {
+    int piece;
+    long offset;
+} CURSOR;
+
+// move n lines from the current piece list to next
+static int keep_lines(COMPOSER *cp, CURSOR *cur, long n, PIECES *next) {
+    while (n > 0){
+        PIECE *p = cp->current.v + cur->piece;
+        long k = p->count - cur->offset < n ? p->count - cur->offset : n;
+        if (pieces_add(next, p->inserted, p->start + cur->offset, k))
+            return ERR;
+        cur->offset += k;
+        n -= k;
+        if (cur->offset == p->count){
+            cur->piece++;
+            cur->offset = 0;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Delete n lines from the current piece list, which the diff says are
+ * the lines starting at index line in its text.  Inserted lines are
+ * checked against the text; original lines have it recorded.
+ */
+static int delete_lines(COMPOSER *cp, CURSOR *cur, long n, DIFF *dp, int line) {
+    while (n > 0){
+        PIECE *p = cp->current.v + cur->piece;
+        long k = p->count - cur->offset < n ? p->count - cur->offset : n;
+        if (p->inserted){
+            for (long i = 0; i < k; i++)
+                if (!same_line(&cp->work, p->start + cur->offset + i, dp, line + i))
+                    return ERR;
+        }
+        else{
+            int first = cp->work.line_count;
+            for (long i = 0; i < k; i++)
+                if (diff_add_line(&cp->work, DIFF_LINE_TEXT(dp, line + i),
+                                  DIFF_LINE_LENGTH(dp, line + i)) < 0)
+                    return ERR;
+            if (deleted_add(cp, p->start + cur->offset, k, first))
+                return ERR;
+        }
+        line += k;
+        cur->offset += k;
+        n -= k;
+        if (cur->offset == p->count){
+            cur->piece++;
+            cur->offset = 0;
+        }
+    }
+    return 0;
+}
+
+// apply one diff to the current piece list, returning 0 or the serial of the bad hunk
+static int compose_one(COMPOSER *cp, DIFF *dp) {
+    PIECES next = { NULL, 0, 0 };
+    CURSOR cur = { 0, 0 };
+    long line = 1;      // number of the line at the cursor
+    long delta = 0;     // lines added minus lines deleted so far
+
+    for (int h = 0; h < dp->hunk_count; h++){
+        DIFF_HUNK *hp = dp->hunks + h;
+        HUNK *hdr = &hp->header;
+        long from = hdr->type == HUNK_APPEND_TYPE ? hdr->old_start + 1L : hdr->old_start;
+        long new_start = from + delta - (hdr->type == HUNK_DELETE_TYPE ? 1 : 0);
+
+        if (from < line || from < 1 || hdr->new_start != new_start ||
+            keep_lines(cp, &cur, from - line, &next) ||
+            delete_lines(cp, &cur, hp->deletion_count, dp, hp->deletions)){
+            budget_free(next.v);
+            return hdr->serial;
+        }
+
+        int first = cp->work.line_count;
+        for (int i = 0; i < hp->addition_count; i++){
+            if (diff_add_line(&cp->work, DIFF_LINE_TEXT(dp, hp->additions + i),
+                              DIFF_LINE_LENGTH(dp, hp->additions + i)) < 0){
+                budget_free(next.v);
+                return hdr->serial;
+            }
+        }
+        if (pieces_add(&next, 1, first, hp->addition_count)){
+            budget_free(next.v);
+            return hdr->serial;
+        }
+        line = from + hp->deletion_count;
+        delta += hp->addition_count - hp->deletion_count;
+    }
+
+    // the rest of the file, up to the end of the piece reaching the end of the original
+    for (; cur.piece < cp->current.count; cur.piece++, cur.offset = 0){
+        PIECE *p = cp->current.v + cur.piece;
+        if (pieces_add(&next, p->inserted, p->start + cur.offset, p->count - cur.offset)){
+            budget_free(next.v);
+            return dp->hunk_count > 0 ? dp->hunk_count : 1;
+        }
+    }
+    budget_free(cp->current.v);
+    cp->current = next;
+    return 0;
+}
+
+static int compare_deleted(const void *a, const void *b) {
+    long x = ((const DELETED *) a)->old_line;
+    long y = ((const DELETED *) b)->old_line;
+    return x < y ? -1 : x > y;
+}
+
+// copy the text of the deleted original lines [from, to) into result
+static int emit_deleted(COMPOSER *cp, int *dj, long from, long to, DIFF *result) {
+    while (from < to){
+        while (*dj < cp->deleted_count &&
+               (cp->deleted + *dj)->old_line + (cp->deleted + *dj)->count <= from)
+            (*dj)++;
+        DELETED *dp = cp->deleted + *dj;
+        if (*dj == cp->deleted_count || dp->old_line > from)
+            return ERR;
+        long end = dp->old_line + dp->count < to ? dp->old_line + dp->count : to;
+        for (long l = from; l < end; l++){
+            int i = dp->line + (l - dp->old_line);
+            if (diff_add_line(result, DIFF_LINE_TEXT(&cp->work, i), DIFF_LINE_LENGTH(&cp->work, i)) < 0)
+                return ERR;
+        }
+        from = end;
+    }
+    return 0;
+}
+
+// turn the final piece list into hunks relative to the original
+static int emit_hunks(COMPOSER *cp, DIFF *result) {
+    if (cp->deleted_count > 0)
+        qsort(cp->deleted, cp->deleted_count, sizeof(DELETED), compare_deleted);
+    int dj = 0;
+    long old_next = 1;     // first original line not yet accounted for
+    long new_line = 0;     // lines of the composed output so far
+    int pending = 0;       // first inserted piece not yet emitted
+
+    for (int i = 0; i < cp->current.count; i++){
+        PIECE *p = cp->current.v + i;
+        if (p->inserted)
+            continue;
+
+        long deletions = p->start - old_next;
+        long additions = 0;
+        for (int j = pending; j < i; j++)
+            additions += (cp->current.v + j)->count;
+
+        if (deletions > 0 || additions > 0){
+            DIFF_HUNK *hp = diff_add_hunk(result);
+            if (hp == NULL || emit_deleted(cp, &dj, old_next, p->start, result))
+                return ERR;
+            hp->deletions = result->line_count - deletions;
+            hp->deletion_count = deletions;
+            hp->additions = result->line_count;
+            for (int j = pending; j < i; j++){
+                PIECE *q = cp->current.v + j;
+                for (long l = q->start; l < q->start + q->count; l++)
+                    if (diff_add_line(result, DIFF_LINE_TEXT(&cp->work, l),
+                                      DIFF_LINE_LENGTH(&cp->work, l)) < 0)
+                        return ERR;
+            }
+            hp->addition_count = additions;
+
+            HUNK *hdr = &hp->header;
+            if (deletions > 0){
+                hdr->type = additions > 0 ? HUNK_CHANGE_TYPE : HUNK_DELETE_TYPE;
+                hdr->old_start = old_next;
+                hdr->old_end = p->start - 1;
+            }
+            else{
+                hdr->type = HUNK_APPEND_TYPE;
+                hdr->old_start = hdr->old_end = old_next - 1;
+            }
+            if (additions > 0){
+                hdr->new_start = new_line + 1;
+                hdr->new_end = new_line + additions;
+            }
+            else{
+                hdr->new_start = hdr->new_end = new_line;
+            }
+        }
+
+        new_line += additions + p->count;
+        old_next = p->start + p->count;
+        pending = i + 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief  Compose a chain of diffs held in memory.
+ * @details  Each diff is taken to apply to the output of the one
+ * before it.  The hunks of each diff are checked against the line
+ * numbers of the file produced by the diffs before it, and lines it
+ * deletes that were inserted by an earlier diff are checked against
+ * the text that was inserted.  Lines of the original file cannot be
+ * checked here; they are checked when the composed diff is applied.
+ *
+ * @param diffs  The diffs, in the order in which they apply.
+ * @param count  Number of diffs.
+ * @param result  An initialized DIFF, to which the hunks of the
+ * composed diff are added.
+ * @return  0 on success.  Otherwise the diff that could not be
+ * composed, numbered from 1, times 65536 plus the serial number of
+ * its offending hunk, or ERR if memory ran out.
+ */
+int compose_diffs(DIFF *diffs, int count, DIFF *result) {
+    COMPOSER c;
+    c.current.v = NULL;
+    c.current.count = c.current.size = 0;
+    diff_init(&c.work);
+    c.deleted = NULL;
+    c.deleted_count = c.deleted_size = 0;
+
+    int err = pieces_add(&c.current, 0, 1, PIECE_REST) ? ERR : 0;
+    for (int k = 0; k < count && err == 0; k++){
+        int serial = compose_one(&c, diffs + k);
+        if (serial)
+            err = (k + 1) * 65536 + serial;
+    }
+    if (err == 0)
+        err = emit_hunks(&c, result);
+
+    budget_free(c.current.v);
+    budget_free(c.deleted);
+    diff_free(&c.work);
+    return err;
+}
+
+/*
+ * Read and compose diffs from files, reporting any error.  Returns 0,
+ * -1 on an error, or ERR without a report if memory ran short.
+ */
+static int compose_files(FILE **diffs, int count, DIFF *result) {
+    long refused = budget_refusals();
+    DIFF *parsed = budget_calloc(count, sizeof(DIFF));
+    if (parsed == NULL)
+        return ERR;
+
+    int err = 0;
+    for (int k = 0; k < count && !err; k++){
+        diff_init(parsed + k);
+        STREAM *s = stream_open_reader(*(diffs + k));
+        if (s == NULL || diff_read(parsed + k, s) || s->error){
+            if (budget_refusals() != refused){
+                err = ERR;
+                stream_close(s);
+                break;
+            }
+            long long offset;
+            const char *why = hunk_error(&offset);
+            if (!(global_options & QUIET_OPTION)){
+                if (why != NULL)
+                    fprintf(stderr, "diff %d is ill-formed at byte %lld: %s\n", k + 1, offset, why);
+                else
+                    fprintf(stderr, "diff %d is ill-formed at hunk %d\n", k + 1,
+                            (parsed + k)->hunk_count);
+            }
+            err = -1;
+        }
+        stream_close(s);
+    }
+    if (!err){
+        int r = compose_diffs(parsed, count, result);
+        if (r == ERR || (r != 0 && budget_refusals() != refused)){
+            err = ERR;
+        }
+        else if (r != 0){
+            if (!(global_options & QUIET_OPTION))
+                fprintf(stderr, "hunk %d of diff %d does not apply to the result of the diffs before it\n",
+                        r % 65536, r / 65536);
+            err = -1;
+        }
+    }
+
+    for (int k = 0; k < count; k++)
+        diff_free(parsed + k);
+    budget_free(parsed);
+    return err;
+}
+
+/**
+ * @brief  Compose a chain of diffs into a single diff.
+ * @details  The diffs are read from the given files, and the
+ * composed diff is written to out in the traditional format.
+ *
+ * @return  0 on success, -1 if a diff could not be read or the diffs
+ * do not form a chain, in which case a report is printed to stderr
+ * unless quiet mode is in effect.
+ */
+int compose(FILE **diffs, int count, FILE *out) {
+    DIFF result;
+    diff_init(&result);
+    int err = compose_files(diffs, count, &result);
+    if (err == ERR && !(global_options & QUIET_OPTION))
+        fprintf(stderr, "out of memory while composing diffs\n");
+    if (!err){
+        STREAM *s = stream_open_writer(out, output_codec, output_level, output_threads);
+        if (s == NULL || diff_write(&result, s) || stream_close(s))
+            err = -1;
+    }
+    diff_free(&result);
+    return err;
+}
+
+/*
+ * Apply a chain of diffs one at a time, spilling each intermediate
+ * result to a temporary file.  Every intermediate result is read in
+ * full, but only the memory of a single patch() is needed.  The diffs
+ * are read again from their start.
+ */
+static int patch_sequence(FILE *in, FILE *out, FILE **diffs, int count) {
+    FILE *from = in;
+    int result = 0;
+    for (int k = 0; k < count && result == 0; k++){
+        int last = k == count - 1;
+        FILE *to = last ? out : tmpfile();
+        STREAM *in_stream = stream_open_reader(from);
+        STREAM *diff_stream = fseeko(*(diffs + k), 0, SEEK_SET) ? NULL : stream_open_reader(*(diffs + k));
+        STREAM *out_stream = last ? stream_open_writer(to, output_codec, output_level, output_threads)
+                                  : stream_open_writer(to, STREAM_PLAIN, 0, 0);
+        result = -1;
+        if (in_stream != NULL && diff_stream != NULL && out_stream != NULL){
+            // only the final result is left out with -n, or held back
+            long options = last ? global_options
+                                : global_options & ~(NO_PATCH_OPTION | TRANSACTION_OPTIONS);
+            result = patch_stream(in_stream, out_stream, diff_stream, options);
+        }
+        if (stream_close(out_stream) || in_stream == NULL || in_stream->error ||
+            diff_stream == NULL || diff_stream->error)
+            result = -1;
+        stream_close(in_stream);
+        stream_close(diff_stream);
+        if (from != in)
+            fclose(from);
+        from = to;
+        if (to != NULL && !last && fseeko(to, 0, SEEK_SET))
+            result = -1;
+    }
+    if (from != NULL && from != in && from != out)
+        fclose(from);
+    return result;
+}
+
+/**
+ * @brief  Patch a file with a chain of diffs in a single pass.
+ * @details  The diffs are composed in memory and the composed diff is
+ * applied to the input with patch(), so the input is read only once
+ * however many diffs there are.  If the composed diff does not fit in
+ * the memory budget, the diffs are applied one at a time instead.
+ *
+ * @return  0 on success, -1 if there were errors.
+ */
+int patch_chain(FILE *in, FILE *out, FILE **diffs, int count) {
+    if (count == 1)
+        return patch(in, out, *diffs);
+    if (in == NULL || out == NULL)
+        return -1;
+    for (int k = 0; k < count; k++)
+        if (*(diffs + k) == NULL)
+            return -1;
+
+    DIFF composed;
+    diff_init(&composed);
+    long refused = budget_refusals();
+    int result = compose_files(diffs, count, &composed);
+
+    STREAM *text = NULL;
+    if (result == 0){
+        STREAM *buffer = stream_open_buffer();
+        if (buffer != NULL && diff_write(&composed, buffer) == 0){
+            size_t len;
+            unsigned char *data = stream_contents(buffer, &len);
+            text = stream_open_memory(data, len);
+        }
+        stream_close(buffer);
+        if (text == NULL && budget_refusals() != refused)
+            result = ERR;
+    }
+    diff_free(&composed);
+    if (result == ERR)
+        return patch_sequence(in, out, diffs, count);
+    if (result != 0 || text == NULL){
+        stream_close(text);
+        return -1;
+    }
+
+    STREAM *in_stream = stream_open_reader(in);
+    STREAM *out_stream = stream_open_writer(out, output_codec, output_level, output_threads);
+    result = -1;
+    if (in_stream != NULL && out_stream != NULL){
+        result = patch_stream(in_stream, out_stream, text, global_options);
+    }
+    if (stream_close(out_stream) || in_stream == NULL || in_stream->error)
+        result = -1;
+    stream_close(in_stream);
+    stream_close(text);
+    return result;
+}
@@ -0,0 +1,18 @@
+#ifndef COMPOSE_H
+#define COMPOSE_H
+
+#include <stdio.h>
+
+#include "diff.h"
+
+/*
+ * Composition of a chain of diffs D1..Dn, where each Dk transforms
+ * the output of D(k-1), into a single diff that transforms the input
+ * of D1 directly into the output of Dn.
+ */
+
+int compose_diffs(DIFF *diffs, int count, DIFF *result);
+int compose(FILE **diffs, int count, FILE *out);
+int patch_chain(FILE *in, FILE *out, FILE **diffs, int count);
+
+#endif
@@ -0,0 +1,570 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "fliki.h"
+#include "global.h"
+#include "debug.h"
+#include "daemon.h"
+#include "stream.h"
+#include "options.h"
+#include "budget.h"
+#include "output.h"
+
+/*
+ * The main thread accepts connections and polls the ones that are
+ * idle; when a client has sent something, its connection is queued,
+ * and one of a fixed pool of worker threads takes it off the queue,
+ * serves a single request and hands the connection back to be polled
+ * again.  A worker is thus only ever busy with a request, never with
+ * a client that is merely connected.  The parser and patch state in
+ * fliki.c is per thread, so each worker keeps and reuses its own,
+ * along with its own buffers for hunk_show() and its own streams,
+ * which are attached to the files of each request in turn.
+ */
+
+#define DAEMON_FDS_MAX 3          // descriptors accepted with one request
+#define DAEMON_BACKOFF_MS 100     // pause in accepting when descriptors run out
+
+typedef struct conn {
+    int fd;
+    char buf[DAEMON_REQUEST_MAX];  // bytes received and not yet handled
+    size_t len;
+    int fds[DAEMON_FDS_MAX];       // descriptors received, for the next request
+    int nfds;
+    struct conn *next;             // on the list handed back to the main thread
+} CONN;
+
+/*
+ * Each open connection is in exactly one place: polled by the main
+ * thread, on the queue, or with a worker.  The queue can therefore
+ * hold every connection, and putting one on it never waits.
+ */
+static CONN *queue[DAEMON_CONNECTIONS_MAX];
+static int queue_head = 0;
+static int queue_count = 0;
+static CONN *handed_back = NULL;   // to be polled again
+static int open_count = 0;         // connections open
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_nonempty = PTHREAD_COND_INITIALIZER;
+static int wake_pipe[2];           // tells the main thread to look at handed_back
+
+static struct {
+    long connections;
+    long requests;
+    long succeeded;
+    long failed;
+    long active;
+} stats;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static time_t start_time;
+static int worker_count;
+
+static void count(long *counter, long n) {
+    pthread_mutex_lock(&stats_lock);
+    *counter += n;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void queue_put(CONN *c) {
+    pthread_mutex_lock(&queue_lock);
+    *(queue + (queue_head + queue_count++) % DAEMON_CONNECTIONS_MAX) = c;
+    pthread_cond_signal(&queue_nonempty);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+static CONN *queue_get(void) {
+    pthread_mutex_lock(&queue_lock);
+    while (queue_count == 0)
+        pthread_cond_wait(&queue_nonempty, &queue_lock);
+    CONN *c = *(queue + queue_head);
+    queue_head = (queue_head + 1) % DAEMON_CONNECTIONS_MAX;
+    queue_count--;
+    pthread_mutex_unlock(&queue_lock);
+    return c;
+}
+
+/*
+ * Give a connection back to the main thread to be polled, or with c
+ * NULL, tell it that a connection has been closed.
+ */
+static void hand_back(CONN *c) {
+    pthread_mutex_lock(&queue_lock);
+    if (c != NULL){
+        c->next = handed_back;
+        handed_back = c;
+    }
+    else{
+        open_count--;
+    }
+    pthread_mutex_unlock(&queue_lock);
+    // a full pipe already wakes the main thread
+    char byte = 0;
+    if (write(*(wake_pipe + 1), &byte, 1) < 0){
+        // nothing to do
+    }
+}
+
+static int same_word(const char *a, const char *b) {
+    while (*a != 0 && *a == *b){
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+static void respond(int fd, const char *text) {
+    size_t n = 0;
+    while (*(text + n) != 0)
+        n++;
+    while (n > 0){
+        ssize_t k = write(fd, text, n);
+        if (k <= 0)
+            return;
+        text += k;
+        n -= k;
+    }
+}
+
+// split a request line into words in place, returning the number of words
+static int split_words(char *line, char **words, int max) {
+    int n = 0;
+    while (*line != 0){
+        while (*line == ' ' || *line == '\t' || *line == '\r')
+            *(line++) = 0;
+        if (*line == 0 || n == max)
+            break;
+        *(words + n++) = line;
+        while (*line != 0 && *line != ' ' && *line != '\t' && *line != '\r')
+            line++;
+    }
+    return n;
+}
+
+/*
+ * What a worker keeps from one request to the next: the streams the
+ * input, diff and output are read and written through, attached to
+ * the files of each request in turn, so that serving a request
+ * allocates no stream blocks.
+ */
+typedef struct worker_state {
+    STREAM *in;
+    STREAM *diff;
+    STREAM *out;
+} WORKER;
+
+// allocate those of a worker's streams it does not have yet; returns 0 if it has them all
+static int worker_streams(WORKER *wp) {
+    if (wp->in == NULL)
+        wp->in = stream_open_unbound(0);
+    if (wp->diff == NULL)
+        wp->diff = stream_open_unbound(0);
+    if (wp->out == NULL)
+        wp->out = stream_open_unbound(1);
+    return wp->in == NULL || wp->diff == NULL || wp->out == NULL ? -1 : 0;
+}
+
+/*
+ * Apply one patch on the calling worker, through its streams, closing
+ * the files.  If op is not NULL, out is its file, which replaces the
+ * target on success.
+ */
+static int run_patch(WORKER *wp, FILE *in, FILE *diff, FILE *out, OUTPUT *op, long options, int codec) {
+    int result = -1;
+    if (in != NULL && diff != NULL && out != NULL && worker_streams(wp) == 0){
+        int bound = stream_rebind(wp->in, in, STREAM_PLAIN, 0, 0) == 0 &&
+                    stream_rebind(wp->diff, diff, STREAM_PLAIN, 0, 0) == 0 &&
+                    stream_rebind(wp->out, out, codec, 0, 0) == 0;
+        if (bound)
+            result = patch_stream(wp->in, wp->out, wp->diff, options);
+        // detaching flushes the output, and reports an error at any point while attached
+        int failed = !bound;
+        failed |= stream_detach(wp->out) != 0;
+        failed |= stream_detach(wp->in) != 0;
+        failed |= stream_detach(wp->diff) != 0;
+        if (failed)
+            result = -1;
+    }
+    if (in != NULL)
+        fclose(in);
+    if (diff != NULL)
+        fclose(diff);
+    if (op != NULL){
+        if (result == 0 && !(options & NO_PATCH_OPTION))
+            result = output_publish(op);
+        else
+            output_discard(op);
+    }
+    else if (out != NULL && fclose(out)){
+        result = -1;
+    }
+    return result;
+}
+
+/*
+ * Handle one request.  fds holds the descriptors received since the
+ * last request; those used are taken out, and the rest closed.
+ */
+static void handle_request(WORKER *wp, int conn, char *line, int *fds, int *nfds) {
+    char *words[16];
+    int n = split_words(line, words, 16);
+    char reply[256];
+
+    if (n == 1 && same_word(*words, "HEALTH")){
+        respond(conn, "OK\n");
+    }
+    else if (n == 1 && same_word(*words, "STATS")){
+        pthread_mutex_lock(&stats_lock);
+        snprintf(reply, sizeof(reply),
+                 "OK connections=%ld requests=%ld succeeded=%ld failed=%ld active=%ld workers=%d uptime=%ld"
+                 " mem_used=%lld mem_peak=%lld\n",
+                 stats.connections, stats.requests, stats.succeeded, stats.failed,
+                 stats.active, worker_count, (long) (time(NULL) - start_time),
+                 budget_used(), budget_peak());
+        pthread_mutex_unlock(&stats_lock);
+        respond(conn, reply);
+    }
+    else if (n >= 1 && (same_word(*words, "PATCH") || same_word(*words, "PATCHFD"))){
+        int by_fd = same_word(*words, "PATCHFD");
+        long options = 0;
+        int codec = STREAM_PLAIN;
+        int i = 1;
+        int bad = 0;
+        for (; i < n && **(words + i) == '-'; i++){
+            char *w = *(words + i);
+            if (same_word(w, "-n"))
+                options |= NO_PATCH_OPTION;
+            else if (same_word(w, "-q"))
+                options |= QUIET_OPTION;
+            else if (same_word(w, "--ignore-cr"))
+                options |= IGNORE_CR_OPTION;
+            else if (same_word(w, "--ignore-trailing-ws"))
+                options |= IGNORE_TRAILING_WS_OPTION;
+            else if (same_word(w, "--ignore-all-ws"))
+                options |= IGNORE_ALL_WS_OPTION;
+            else if (same_word(w, "--compress=gzip"))
+                codec = STREAM_GZIP;
+            else if (same_word(w, "--compress=zstd"))
+                codec = STREAM_ZSTD;
+            else if (same_word(w, "--compress=none"))
+                codec = STREAM_PLAIN;
+            else
+                bad = 1;
+        }
+
+        FILE *in = NULL, *diff = NULL, *out = NULL;
+        OUTPUT output, *op = NULL;
+        if (bad || n - i != (by_fd ? 0 : 3) || (by_fd && *nfds != 3)){
+            respond(conn, "ERR bad request\n");
+        }
+        else{
+            if (by_fd){
+                in = fdopen(*fds, "r");
+                diff = fdopen(*(fds + 1), "r");
+                out = fdopen(*(fds + 2), "w");
+                // descriptors not taken over by a FILE are closed below
+                *fds = in == NULL ? *fds : -1;
+                *(fds + 1) = diff == NULL ? *(fds + 1) : -1;
+                *(fds + 2) = out == NULL ? *(fds + 2) : -1;
+            }
+            else{
+                in = fopen(*(words + i), "r");
+                diff = fopen(*(words + i + 1), "r");
+                long long size = in != NULL && diff != NULL && codec == STREAM_PLAIN
+                                 ? output_estimate(in, diff) : 0;
+                if (output_open(&output, *(words + i + 2), size) == 0){
+                    op = &output;
+                    out = output.file;
+                }
+            }
+            count(&stats.requests, 1);
+            count(&stats.active, 1);
+            int result = run_patch(wp, in, diff, out, op, options, codec);
+            count(&stats.active, -1);
+            count(result == 0 ? &stats.succeeded : &stats.failed, 1);
+            respond(conn, result == 0 ? "OK\n" : "ERR patch failed\n");
+        }
+    }
+    else{
+        respond(conn, "ERR unknown request\n");
+    }
+
+    for (int k = 0; k < *nfds; k++)
+        if (*(fds + k) >= 0)
+            close(*(fds + k));
+    *nfds = 0;
+}
+
+// the offset of the newline ending the first request line buffered, or len if there is none
+static size_t line_end(CONN *c) {
+    size_t i = 0;
+    while (i < c->len && *(c->buf + i) != '\n')
+        i++;
+    return i;
+}
+
+/*
+ * Read what the client has sent, without waiting.  Any descriptors
+ * passed with the data are kept for the request whose line is
+ * completed next.  Returns -1 once the client has closed the
+ * connection or it has failed.
+ */
+static int receive(CONN *c) {
+    union {
+        struct cmsghdr align;
+        char space[CMSG_SPACE(DAEMON_FDS_MAX * sizeof(int))];
+    } control;
+    struct iovec iov = { c->buf + c->len, sizeof(c->buf) - c->len };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.space;
+    msg.msg_controllen = sizeof(control.space);
+
+    ssize_t got = recvmsg(c->fd, &msg, MSG_DONTWAIT);
+    if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 0;
+    if (got <= 0)
+        return -1;
+
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)){
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+            continue;
+        int *p = (int *) CMSG_DATA(cm);
+        int k = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int j = 0; j < k; j++){
+            if (c->nfds < DAEMON_FDS_MAX)
+                *(c->fds + c->nfds++) = *(p + j);
+            else
+                close(*(p + j));
+        }
+    }
+    c->len += got;
+    return 0;
+}
+
+/*
+ * Serve the next request on a connection, reading from the client
+ * first if no complete request line is buffered.  Returns -1 once the
+ * connection should be closed.
+ */
+static int serve_request(WORKER *wp, CONN *c) {
+    size_t end = line_end(c);
+    if (end == c->len){
+        if (receive(c))
+            return -1;
+        end = line_end(c);
+    }
+    if (end == c->len){
+        if (c->len == sizeof(c->buf)){
+            respond(c->fd, "ERR request too long\n");
+            return -1;
+        }
+        return 0;
+    }
+    *(c->buf + end) = 0;
+    handle_request(wp, c->fd, c->buf, c->fds, &c->nfds);
+    for (size_t i = end + 1; i < c->len; i++)
+        *(c->buf + i - end - 1) = *(c->buf + i);
+    c->len -= end + 1;
+    return 0;
+}
+
+static void close_connection(CONN *c) {
+    for (int k = 0; k < c->nfds; k++)
+        close(*(c->fds + k));
+    close(c->fd);
+    free(c);
+}
+
+static void *worker(void *arg) {
+    char deletions[512];
+    char additions[512];
+    (void) arg;
+    hunk_use_buffers(deletions, additions);
+    // allocated once here; a stream that cannot be is tried again by the request that needs it
+    WORKER self = { NULL, NULL, NULL };
+    worker_streams(&self);
+    while (1){
+        CONN *c = queue_get();
+        if (serve_request(&self, c)){
+            close_connection(c);
+            hand_back(NULL);
+        }
+        else if (line_end(c) < c->len){
+            // further requests already received wait their turn behind other clients
+            queue_put(c);
+        }
+        else{
+            hand_back(c);
+        }
+    }
+    return NULL;
+}
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    return flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) ? -1 : 0;
+}
+
+/**
+ * @brief  Serve patch requests on a Unix domain socket.
+ * @details  Any existing file at socket_path is removed first.  This
+ * function only returns if the service could not be started, or if
+ * accepting or polling connections fails for a reason that waiting
+ * will not cure.  When descriptors run out, accepting new connections
+ * pauses for a moment while the open ones are still served.
+ *
+ * @param socket_path  Path at which to create the socket.
+ * @param workers  Number of worker threads, or 0 for DAEMON_WORKERS.
+ * @return  -1, after printing a message to stderr.
+ */
+int daemon_run(const char *socket_path, int workers) {
+    struct sockaddr_un addr = { 0 };
+    addr.sun_family = AF_UNIX;
+    size_t n = 0;
+    while (*(socket_path + n) != 0){
+        if (n == sizeof(addr.sun_path) - 1){
+            fprintf(stderr, "socket path too long: %s\n", socket_path);
+            return -1;
+        }
+        *(addr.sun_path + n) = *(socket_path + n);
+        n++;
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0){
+        perror("socket");
+        return -1;
+    }
+    unlink(socket_path);
+    if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) || listen(sock, DAEMON_QUEUE_SIZE) ||
+        set_nonblocking(sock)){
+        perror(socket_path);
+        close(sock);
+        return -1;
+    }
+    if (pipe(wake_pipe) || set_nonblocking(*wake_pipe) || set_nonblocking(*(wake_pipe + 1))){
+        perror("pipe");
+        close(sock);
+        return -1;
+    }
+
+    // the connections being polled, and one entry each for the wake pipe and the socket
+    CONN **idle = malloc(DAEMON_CONNECTIONS_MAX * sizeof(CONN *));
+    struct pollfd *polled = malloc((DAEMON_CONNECTIONS_MAX + 2) * sizeof(struct pollfd));
+    if (idle == NULL || polled == NULL){
+        fprintf(stderr, "out of memory\n");
+        close(sock);
+        return -1;
+    }
+    int idle_count = 0;
+
+    // a client going away must not take the service down with it
+    signal(SIGPIPE, SIG_IGN);
+    start_time = time(NULL);
+    worker_count = workers > 0 ? workers : DAEMON_WORKERS;
+    for (int i = 0; i < worker_count; i++){
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, worker, NULL)){
+            fprintf(stderr, "cannot start worker thread\n");
+            close(sock);
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+
+    long long resume = 0;      // when accepting starts again, after descriptors ran out
+    while (1){
+        char drain[64];
+        while (read(*wake_pipe, drain, sizeof(drain)) > 0)
+            ;
+        pthread_mutex_lock(&queue_lock);
+        while (handed_back != NULL){
+            *(idle + idle_count++) = handed_back;
+            handed_back = handed_back->next;
+        }
+        int room = open_count < DAEMON_CONNECTIONS_MAX;
+        pthread_mutex_unlock(&queue_lock);
+
+        long long now = now_ms();
+        int accepting = room && now >= resume;
+        int timeout = room && !accepting ? (int) (resume - now) : -1;
+        int np = 0;
+        (polled + np)->fd = *wake_pipe;
+        (polled + np++)->events = POLLIN;
+        if (accepting){
+            (polled + np)->fd = sock;
+            (polled + np++)->events = POLLIN;
+        }
+        int first = np;
+        for (int i = 0; i < idle_count; i++){
+            (polled + np)->fd = (*(idle + i))->fd;
+            (polled + np++)->events = POLLIN;
+        }
+
+        if (poll(polled, np, timeout) < 0){
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            perror("poll");
+            close(sock);
+            return -1;
+        }
+
+        // the connections with something to read go to the workers, the rest stay
+        int kept = 0;
+        for (int i = 0; i < idle_count; i++){
+            if ((polled + first + i)->revents != 0)
+                queue_put(*(idle + i));
+            else
+                *(idle + kept++) = *(idle + i);
+        }
+        idle_count = kept;
+
+        if (!accepting || (polled + 1)->revents == 0)
+            continue;
+        int fd = accept(sock, NULL, NULL);
+        if (fd < 0){
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM){
+                resume = now_ms() + DAEMON_BACKOFF_MS;
+            }
+            else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+                     errno != ECONNABORTED && errno != EPROTO){
+                perror("accept");
+                close(sock);
+                return -1;
+            }
+            continue;
+        }
+        CONN *c = malloc(sizeof(CONN));
+        if (c == NULL){
+            close(fd);
+            resume = now_ms() + DAEMON_BACKOFF_MS;
+            continue;
+        }
+        c->fd = fd;
+        c->len = 0;
+        c->nfds = 0;
+        c->next = NULL;
+        pthread_mutex_lock(&queue_lock);
+        open_count++;
+        pthread_mutex_unlock(&queue_lock);
+        count(&stats.connections, 1);
+        *(idle + idle_count++) = c;
+    }
+    return -1;
+}
@@ -0,0 +1,39 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+/*
+ * Long-running patch service on a Unix domain socket.
+ *
+ * A client connects to the socket and sends requests, one per line,
+ * on the same connection; each request gets a one-line response that
+ * starts with "OK" or "ERR".  Requests are handed to the worker
+ * threads one at a time, so clients that stay connected without
+ * sending anything do not hold up the others.  The requests are:
+ *
+ *   PATCH [options] INPUT DIFF OUTPUT
+ *       Patch the file INPUT with the diff in DIFF, writing OUTPUT.
+ *       OUTPUT is replaced atomically, and only if the patch succeeds
+ *       (see output.h); the results of requests served at the same
+ *       time are written back to disk as one batch.
+ *   PATCHFD [options]
+ *       The same, but with the input, diff and output passed as three
+ *       open file descriptors, in that order, in an SCM_RIGHTS control
+ *       message sent along with the request.
+ *   HEALTH
+ *       Check that the service is running.
+ *   STATS
+ *       Report request counters and memory use as name=value pairs.
+ *
+ * The options are -n, -q, --ignore-cr, --ignore-trailing-ws,
+ * --ignore-all-ws and --compress=gzip|zstd|none, with the same
+ * meanings as on the command line.
+ */
+
+#define DAEMON_REQUEST_MAX 4096   // longest request line
+#define DAEMON_QUEUE_SIZE 64      // connections waiting to be accepted
+#define DAEMON_CONNECTIONS_MAX 1024  // connections open at once
+#define DAEMON_WORKERS 4          // default number of worker threads
+
+int daemon_run(const char *socket_path, int workers);
+
+#endif
@@ -0,0 +1,238 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "fliki.h"
+#include "global.h"
+#include "debug.h"
+#include "diff.h"
+#include "budget.h"
+
+/*
+ * Reading, building and writing diffs held in memory.  See diff.h for
+ * the representation.
+ */
+
+void diff_init(DIFF *dp) {
+    dp->hunks = NULL;
+    dp->hunk_count = dp->hunk_size = 0;
+    dp->lines = NULL;
+    dp->line_count = dp->line_size = 0;
+    dp->text = NULL;
+    dp->text_len = dp->text_size = 0;
+}
+
+void diff_free(DIFF *dp) {
+    budget_free(dp->hunks);
+    budget_free(dp->lines);
+    budget_free(dp->text);
+    diff_init(dp);
+}
+
+// make room for n more bytes of text, returning -1 if out of memory
+static int text_reserve(DIFF *dp, size_t n) {
+    if (dp->text_len + n <= dp->text_size)
+        return 0;
+    size_t size = dp->text_size ? dp->text_size : 4096;
+    while (size < dp->text_len + n)
+        size *= 2;
+    char *p = budget_realloc(dp->text, size);
+    if (p == NULL)
+        return -1;
+    dp->text = p;
+    dp->text_size = size;
+    return 0;
+}
+
+// record the text from offset to the end of the arena as a line
+static int line_end(DIFF *dp, size_t offset) {
+    if (dp->line_count == dp->line_size){
+        int size = dp->line_size ? dp->line_size * 2 : 256;
+        DIFF_LINE *p = budget_realloc(dp->lines, size * sizeof(DIFF_LINE));
+        if (p == NULL)
+            return -1;
+        dp->lines = p;
+        dp->line_size = size;
+    }
+    DIFF_LINE *lp = dp->lines + dp->line_count;
+    lp->offset = offset;
+    lp->length = dp->text_len - offset;
+    return dp->line_count++;
+}
+
+/**
+ * @brief  Add a line to the text of a diff.
+ *
+ * @param text  The line, including its newline.
+ * @param length  Number of bytes in the line.
+ * @return  The index of the new line, or -1 if out of memory.
+ */
+int diff_add_line(DIFF *dp, const char *text, size_t length) {
+    if (text_reserve(dp, length))
+        return -1;
+    size_t offset = dp->text_len;
+    for (size_t i = 0; i < length; i++)
+        *(dp->text + dp->text_len++) = *(text + i);
+    return line_end(dp, offset);
+}
+
+/**
+ * @brief  Add an empty hunk to the end of a diff.
+ * @return  The new hunk, to be filled in by the caller, or NULL if
+ * out of memory.
+ */
+DIFF_HUNK *diff_add_hunk(DIFF *dp) {
+    if (dp->hunk_count == dp->hunk_size){
+        int size = dp->hunk_size ? dp->hunk_size * 2 : 64;
+        DIFF_HUNK *p = budget_realloc(dp->hunks, size * sizeof(DIFF_HUNK));
+        if (p == NULL)
+            return NULL;
+        dp->hunks = p;
+        dp->hunk_size = size;
+    }
+    DIFF_HUNK *hp = dp->hunks + dp->hunk_count++;
+    hp->header.type = HUNK_NO_TYPE;
+    hp->header.serial = dp->hunk_count;
+    hp->header.old_start = hp->header.old_end = 0;
+    hp->header.new_start = hp->header.new_end = 0;
+    hp->deletions = hp->additions = dp->line_count;
+    hp->deletion_count = hp->addition_count = 0;
+    return hp;
+}
+
+/**
+ * @brief  Read an entire diff into memory.
+ * @details  The diff is parsed with hunk_next() and hunk_getc(), and
+ * is checked for the same errors that patch() would report without
+ * looking at the file being patched: ill-formed hunks, and numbers of
+ * deleted and added lines that do not agree with the hunk headers.
+ *
+ * @param dp  An initialized DIFF, to which the hunks are added.
+ * @param in  The stream from which the diff is read.
+ * @return  0 if the whole diff was read, ERR if it is ill-formed or
+ * memory ran out.  On error, the serial number of the offending hunk
+ * is that of the last hunk in dp.
+ */
+int diff_read(DIFF *dp, STREAM *in) {
+    HUNK hunk;
+    hunk.serial = 0;
+    hunk.type = HUNK_NO_TYPE;
+    hunk_reset();
+
+    int result;
+    while ((result = hunk_next_stream(&hunk, in)) == 0){
+        DIFF_HUNK *hp = diff_add_hunk(dp);
+        if (hp == NULL)
+            return ERR;
+        hp->header = hunk;
+
+        int eos_count = 0;
+        size_t line_start = dp->text_len;
+        const unsigned char *span;
+        long n;
+        while ((n = hunk_getspan(&hunk, in, &span)) != ERR){
+            if (n == EOS){
+                eos_count++;
+                continue;
+            }
+            if (text_reserve(dp, n))
+                return ERR;
+            for (long i = 0; i < n; i++)
+                *(dp->text + dp->text_len++) = *(span + i);
+            // a run ends either at the end of a line or part way through one
+            if (*(span + n - 1) != '\n')
+                continue;
+            if (line_end(dp, line_start) < 0)
+                return ERR;
+            line_start = dp->text_len;
+            // for a change hunk, the additions follow the first EOS
+            if (hunk.type == HUNK_APPEND_TYPE || eos_count > 0)
+                hp->addition_count++;
+            else
+                hp->deletion_count++;
+        }
+        hp->additions = dp->line_count - hp->addition_count;
+        hp->deletions = hp->additions - hp->deletion_count;
+
+        int deletions = hunk.type == HUNK_APPEND_TYPE ? 0 : hunk.old_end - hunk.old_start + 1;
+        int additions = hunk.type == HUNK_DELETE_TYPE ? 0 : hunk.new_end - hunk.new_start + 1;
+        if (eos_count == 0 || line_start != dp->text_len ||
+            hp->deletion_count != deletions || hp->addition_count != additions ||
+            (hunk.type == HUNK_APPEND_TYPE && hunk.old_start != hunk.old_end) ||
+            (hunk.type == HUNK_DELETE_TYPE && hunk.new_start != hunk.new_end))
+            return ERR;
+    }
+    if (result != EOF){
+        // make the serial number of the ill-formed hunk available to the caller
+        DIFF_HUNK *hp = diff_add_hunk(dp);
+        if (hp != NULL)
+            hp->header = hunk;
+        return ERR;
+    }
+    return 0;
+}
+
+static void put_num(int n, STREAM *out) {
+    char digits[12];
+    int i = 0;
+    do {
+        *(digits + i++) = '0' + n % 10;
+        n /= 10;
+    } while (n > 0);
+    while (i > 0)
+        stream_putc(*(digits + --i), out);
+}
+
+static void put_range(int start, int end, STREAM *out) {
+    put_num(start, out);
+    if (start != end){
+        stream_putc(',', out);
+        put_num(end, out);
+    }
+}
+
+static void put_lines(DIFF *dp, int first, int count, char marker, STREAM *out) {
+    for (int i = first; i < first + count; i++){
+        stream_putc(marker, out);
+        stream_putc(' ', out);
+        stream_write(DIFF_LINE_TEXT(dp, i), DIFF_LINE_LENGTH(dp, i), out);
+    }
+}
+
+/**
+ * @brief  Write a hunk header, such as "3,4c3", without its newline.
+ */
+void diff_write_header(HUNK *hp, STREAM *out) {
+    put_range(hp->old_start, hp->old_end, out);
+    switch (hp->type){
+        case HUNK_APPEND_TYPE:
+            stream_putc('a', out);
+            break;
+        case HUNK_DELETE_TYPE:
+            stream_putc('d', out);
+            break;
+        case HUNK_CHANGE_TYPE:
+            stream_putc('c', out);
+            break;
+        default:
+            break;
+    }
+    put_range(hp->new_start, hp->new_end, out);
+}
+
+/**
+ * @brief  Write a diff in the traditional format read by hunk_next().
+ *
+ * @return  0 on success, EOF if there was an error writing.
+ */
+int diff_write(DIFF *dp, STREAM *out) {
+    for (int i = 0; i < dp->hunk_count; i++){
+        DIFF_HUNK *hp = dp->hunks + i;
+        diff_write_header(&hp->header, out);
+        stream_putc('\n', out);
+        put_lines(dp, hp->deletions, hp->deletion_count, '<', out);
+        if (hp->header.type == HUNK_CHANGE_TYPE)
+            stream_write("---\n", 4, out);
+        put_lines(dp, hp->additions, hp->addition_count, '>', out);
+    }
+    return out->error ? EOF : 0;
+}
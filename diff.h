@@ -0,0 +1,55 @@
+#ifndef DIFF_H
+#define DIFF_H
+
+#include <stddef.h>
+
+#include "fliki.h"
+#include "stream.h"
+#include "report.h"
+
+/*
+ * A diff held entirely in memory: the hunk headers, and the text of
+ * the lines each hunk deletes and adds.  Line text is stored without
+ * the "< " or "> " prefix and includes its terminating newline.
+ */
+
+typedef struct diff_line {
+    size_t offset;             // position of the line in the text arena
+    size_t length;             // including the newline
+} DIFF_LINE;
+
+typedef struct diff_hunk {
+    HUNK header;
+    int deletions;             // index of the first deleted line in lines
+    int deletion_count;
+    int additions;             // index of the first added line in lines
+    int addition_count;
+} DIFF_HUNK;
+
+typedef struct diff {
+    DIFF_HUNK *hunks;
+    int hunk_count;
+    int hunk_size;
+    DIFF_LINE *lines;
+    int line_count;
+    int line_size;
+    char *text;
+    size_t text_len;
+    size_t text_size;
+} DIFF;
+
+#define DIFF_LINE_TEXT(dp, i) ((dp)->text + ((dp)->lines + (i))->offset)
+#define DIFF_LINE_LENGTH(dp, i) (((dp)->lines + (i))->length)
+
+void diff_init(DIFF *dp);
+void diff_free(DIFF *dp);
+int diff_read(DIFF *dp, STREAM *in);
+int diff_write(DIFF *dp, STREAM *out);
+void diff_write_header(HUNK *hp, STREAM *out);
+int diff_add_line(DIFF *dp, const char *text, size_t length);
+DIFF_HUNK *diff_add_hunk(DIFF *dp);
+
+// in fliki.c
+int patch_hunks(STREAM *in, STREAM *out, DIFF *dp, long options, HUNK_FAILURE *failure);
+
+#endif
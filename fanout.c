@@ -0,0 +1,315 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "fliki.h"
+#include "global.h"
+#include "debug.h"
+#include "options.h"
+#include "stream.h"
+#include "diff.h"
+#include "report.h"
+#include "output.h"
+#include "fanout.h"
+
+/*
+ * One diff applied to many files.  See fanout.h.
+ */
+
+typedef struct fanout {
+    DIFF diff;                 // shared by all the workers, and not changed
+    long long delta;           // bytes the diff adds, less those it deletes
+    char **targets;
+    int count;
+    const char *dir;           // where the results go, or NULL to replace the targets
+    HUNK_FAILURE *results;     // one for each target
+    int next;                  // the next target to be taken, counted atomically
+} FANOUT;
+
+// the path of the result for a target: the target itself, or its last component in dir
+static const char *result_path(FANOUT *fp, const char *target, char *path, size_t size) {
+    if (fp->dir == NULL)
+        return target;
+    const char *name = target;
+    for (const char *p = target; *p != 0; p++)
+        if (*p == '/')
+            name = p + 1;
+    if ((size_t) snprintf(path, size, "%s/%s", fp->dir, name) >= size)
+        return NULL;
+    return path;
+}
+
+/*
+ * Two targets whose results would go to the same file cannot both be
+ * patched: the result published last would silently replace the
+ * other.  With a directory, that is two targets with the same last
+ * component; otherwise, two paths to the same file.
+ */
+typedef struct result_key {
+    const char *target;
+    const char *name;          // last component of the target, or NULL
+    dev_t dev;                 // the target itself, when name is NULL
+    ino_t ino;
+} RESULT_KEY;
+
+static int compare_names(const char *a, const char *b) {
+    while (*a != 0 && *a == *b){
+        a++;
+        b++;
+    }
+    return (unsigned char) *a - (unsigned char) *b;
+}
+
+static int compare_keys(const void *a, const void *b) {
+    const RESULT_KEY *ka = a;
+    const RESULT_KEY *kb = b;
+    if (ka->name != NULL)
+        return compare_names(ka->name, kb->name);
+    if (ka->dev != kb->dev)
+        return ka->dev < kb->dev ? -1 : 1;
+    if (ka->ino != kb->ino)
+        return ka->ino < kb->ino ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Find two targets whose results would be the same file.  Targets that
+ * do not exist are left to fail on their own.  Returns 1 and sets *ap
+ * and *bp if there are any, 0 if not, or -1 if memory ran out.
+ */
+static int shared_result(FANOUT *fp, const char **ap, const char **bp) {
+    RESULT_KEY *keys = malloc(fp->count * sizeof(RESULT_KEY));
+    if (keys == NULL)
+        return -1;
+    int n = 0;
+    for (int i = 0; i < fp->count; i++){
+        RESULT_KEY *k = keys + n;
+        k->target = *(fp->targets + i);
+        k->name = NULL;
+        k->dev = 0;
+        k->ino = 0;
+        if (fp->dir != NULL){
+            k->name = k->target;
+            for (const char *p = k->target; *p != 0; p++)
+                if (*p == '/')
+                    k->name = p + 1;
+        }
+        else {
+            struct stat st;
+            if (stat(k->target, &st))
+                continue;
+            k->dev = st.st_dev;
+            k->ino = st.st_ino;
+        }
+        n++;
+    }
+    qsort(keys, n, sizeof(RESULT_KEY), compare_keys);
+    int found = 0;
+    for (int i = 1; i < n && !found; i++){
+        if (compare_keys(keys + i - 1, keys + i) == 0){
+            *ap = (keys + i - 1)->target;
+            *bp = (keys + i)->target;
+            found = 1;
+        }
+    }
+    free(keys);
+    return found;
+}
+
+static void io_failure(HUNK_FAILURE *f, const char *message) {
+    if (f->error == NULL){
+        f->error = "io_error";
+        f->message = message;
+    }
+}
+
+// patch one target, recording how it went in its result
+static void patch_target(FANOUT *fp, int i) {
+    const char *target = *(fp->targets + i);
+    HUNK_FAILURE *f = fp->results + i;
+    report_init(f);
+    f->target = target;
+    int writing = !(global_options & NO_PATCH_OPTION);
+
+    FILE *in = fopen(target, "r");
+    if (in == NULL){
+        io_failure(f, "the target could not be read");
+        return;
+    }
+    OUTPUT output;
+    if (writing){
+        char buf[OUTPUT_PATH_MAX];
+        const char *path = result_path(fp, target, buf, sizeof(buf));
+        // the result is the size of the target, give or take the bytes the diff changes
+        struct stat st;
+        long long size = 0;
+        if (output_codec == STREAM_PLAIN && fstat(fileno(in), &st) == 0 && S_ISREG(st.st_mode) &&
+            st.st_size + fp->delta > 0)
+            size = st.st_size + fp->delta;
+        if (path == NULL || output_open(&output, path, size)){
+            io_failure(f, "the result could not be written");
+            fclose(in);
+            return;
+        }
+    }
+
+    STREAM *in_stream = stream_open_reader(in);
+    STREAM *out_stream = writing ? stream_open_writer(output.file, output_codec, output_level,
+                                                      output_threads) : NULL;
+    int result = -1;
+    if (in_stream != NULL && (out_stream != NULL || !writing))
+        result = patch_hunks(in_stream, out_stream, &fp->diff, global_options, f);
+    if (in_stream == NULL || in_stream->error){
+        io_failure(f, "the target could not be read");
+        result = -1;
+    }
+    if (stream_close(out_stream) || (writing && out_stream == NULL)){
+        io_failure(f, "the result could not be written");
+        result = -1;
+    }
+    stream_close(in_stream);
+    fclose(in);
+
+    if (writing){
+        if (result == 0 && output_publish(&output)){
+            io_failure(f, "the result could not be written");
+        }
+        else if (result != 0){
+            output_discard(&output);
+        }
+    }
+}
+
+static void *worker(void *arg) {
+    FANOUT *fp = arg;
+    int i;
+    while ((i = __atomic_fetch_add(&fp->next, 1, __ATOMIC_RELAXED)) < fp->count)
+        patch_target(fp, i);
+    return NULL;
+}
+
+// the line of text for a target's result
+static void show_result(HUNK_FAILURE *f, FILE *out) {
+    if (f->error == NULL){
+        fprintf(out, "%s: ok\n", f->target);
+        return;
+    }
+    if (!f->has_hunk){
+        fprintf(out, "%s: %s\n", f->target, f->message);
+        return;
+    }
+    char header[HUNK_HEADER_MAX];
+    size_t len = 0;
+    STREAM *s = stream_open_buffer();
+    if (s != NULL){
+        diff_write_header(&f->hunk, s);
+        unsigned char *bytes = stream_contents(s, &len);
+        if (len >= sizeof(header))
+            len = sizeof(header) - 1;
+        for (size_t i = 0; i < len; i++)
+            *(header + i) = *(bytes + i);
+    }
+    *(header + len) = 0;
+    stream_close(s);
+    fprintf(out, "%s: hunk %d (%s) failed at line %lld: %s\n", f->target, f->hunk.serial, header,
+            f->line, f->message);
+}
+
+/**
+ * @brief  Patch each of a number of files with the same diff.
+ * @details  See fanout.h.  The diff is read into memory first; if it
+ * is ill-formed, or two of the results would be the same file, nothing
+ * is patched.  In quiet mode, only the files that could not be patched
+ * are listed.
+ *
+ * @param diff  The diff, applied to every target.
+ * @param targets  The paths of the files to be patched.
+ * @param dir  Directory in which to write each result, under the last
+ * component of its target's path, or NULL to replace the targets.
+ * @param workers  Number of threads patching files, or 0 for one per
+ * processor.
+ * @return  0 if every target was patched, -1 otherwise.
+ */
+int fan_out(FILE *diff, char **targets, int count, const char *dir, int workers) {
+    if (diff == NULL)
+        return -1;
+    FANOUT fanout;
+    diff_init(&fanout.diff);
+    fanout.targets = targets;
+    fanout.count = count;
+    fanout.dir = dir;
+    fanout.next = 0;
+    fanout.results = malloc(count * sizeof(HUNK_FAILURE));
+    if (fanout.results == NULL)
+        return -1;
+
+    // nothing is patched if any result would be overwritten by another
+    const char *a, *b;
+    int shared = shared_result(&fanout, &a, &b);
+    if (shared){
+        if (shared > 0 && !(global_options & QUIET_OPTION))
+            fprintf(stderr, "%s and %s would both be written to the same file\n", a, b);
+        free(fanout.results);
+        return -1;
+    }
+
+    STREAM *s = stream_open_reader(diff);
+    if (s == NULL || diff_read(&fanout.diff, s) || s->error){
+        if (!(global_options & QUIET_OPTION)){
+            long long offset;
+            const char *why = hunk_error(&offset);
+            if (why != NULL)
+                fprintf(stderr, "diff is ill-formed at byte %lld: %s\n", offset, why);
+            else
+                fprintf(stderr, "diff is ill-formed at hunk %d\n", fanout.diff.hunk_count);
+        }
+        stream_close(s);
+        diff_free(&fanout.diff);
+        free(fanout.results);
+        return -1;
+    }
+    stream_close(s);
+    fanout.delta = 0;
+    for (int i = 0; i < fanout.diff.hunk_count; i++){
+        DIFF_HUNK *hp = fanout.diff.hunks + i;
+        for (int k = hp->additions; k < hp->additions + hp->addition_count; k++)
+            fanout.delta += DIFF_LINE_LENGTH(&fanout.diff, k);
+        for (int k = hp->deletions; k < hp->deletions + hp->deletion_count; k++)
+            fanout.delta -= DIFF_LINE_LENGTH(&fanout.diff, k);
+    }
+
+    if (workers <= 0){
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cpus > 0 ? cpus : 1;
+    }
+    if (workers > count)
+        workers = count;
+    // the calling thread is one of the workers
+    pthread_t *tids = malloc(workers * sizeof(pthread_t));
+    int started = 0;
+    while (tids != NULL && started < workers - 1 &&
+           pthread_create(tids + started, NULL, worker, &fanout) == 0)
+        started++;
+    worker(&fanout);
+    for (int i = 0; i < started; i++)
+        pthread_join(*(tids + i), NULL);
+    free(tids);
+
+    int failed = 0;
+    for (int i = 0; i < count; i++){
+        HUNK_FAILURE *f = fanout.results + i;
+        if (f->error != NULL)
+            failed++;
+        else if (global_options & QUIET_OPTION)
+            continue;
+        if (error_format == ERROR_FORMAT_JSON)
+            report_write(f, stdout);
+        else
+            show_result(f, stdout);
+    }
+    diff_free(&fanout.diff);
+    free(fanout.results);
+    return failed || fflush(stdout) ? -1 : 0;
+}
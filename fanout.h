@@ -0,0 +1,30 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <stdio.h>
+
+/*
+ * Applying one diff to many files at once.
+ *
+ * The diff is parsed a single time, into memory (see diff.h), and the
+ * parsed hunks are then shared, read-only, by worker threads that
+ * each take the next file in turn and patch it with patch_hunks().
+ * Each result replaces its target atomically (see output.h), and the
+ * results finished at the same time are written back to disk as one
+ * batch, with their shared directory flushed once.  A file that cannot be patched is left as it was, and the
+ * others are patched all the same.  Results that would be written to
+ * the same file, such as a/x and b/x with a directory for the results,
+ * are refused before anything is patched.
+ *
+ * Once all the files are done, one line is written for each, in the
+ * order given: in text form
+ *
+ *   replica/a.conf: ok
+ *   replica/b.conf: hunk 2 (7c7) failed at line 7: a line to be deleted does not match the input
+ *
+ * or with --error-format=json, a report as described in report.h.
+ */
+
+int fan_out(FILE *diff, char **targets, int count, const char *dir, int workers);
+
+#endif
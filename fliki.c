@@ -1,9 +1,26 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
 
 #include "fliki.h"
 #include "global.h"
 #include "debug.h"
+#include "options.h"
+#include "stream.h"
+#include "lineindex.h"
+#include "diff.h"
+#include "report.h"
+#include "stat.h"
+
+/*
+ * The state of the parser and of patch() is kept per thread, so that
+ * separate threads can apply separate diffs at the same time.  The
+ * main thread shows hunks from the hunk_deletions_buffer and
+ * hunk_additions_buffer arrays; other threads supply their own
+ * buffers with hunk_use_buffers().
+ */
+static _Thread_local char *deletions_buffer = hunk_deletions_buffer;
+static _Thread_local char *additions_buffer = hunk_additions_buffer;
 
 
 /**
@@ -24,49 +41,171 @@
 
 static void clear_buffer(){
     for (int i = 0; i < 512; i++){
-        *(hunk_deletions_buffer + i) = 0;
-        *(hunk_additions_buffer + i) = 0;
+        *(deletions_buffer + i) = 0;
+        *(additions_buffer + i) = 0;
     }
 }
 
-static int isDigit(char c) {
+static int isDigit(int c) {
     return c >= '0' && c <= '9';
 }
 
+// hunk headers are parsed in place in the stream buffer
 
-// return a number or -1 if invalid
-static int get_num(FILE *in) {
-    int num = 0;
-    char c;
-    int isValid = 0;
-    while(1){
-        c = fgetc(in);
-        // printf("get_num: %c\n", c);
-        if (!isDigit(c)){
-            ungetc(c, in);
-            // printf("not a digit\n");
-            break;
+// why and where the last header could not be parsed
+static _Thread_local const char *header_error = NULL;
+static _Thread_local long long header_error_offset = 0;
+
+static const unsigned long long powers_of_ten[9] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000
+};
+
+/*
+ * Parse up to eight digits at p, of which there must be at least eight
+ * bytes, all at once.  Returns the number of leading digits and stores
+ * their value.
+ */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+// the digits need not be aligned
+typedef unsigned long long __attribute__((may_alias, aligned(1))) DIGIT_WORD;
+
+static int parse_digits8(const unsigned char *p, unsigned long long *valuep) {
+    unsigned long long w = *(const DIGIT_WORD *) p;
+    // a byte is a digit if its high nibble is 3, and still is 3 after adding 6
+    unsigned long long non_digits = ((w & 0xf0f0f0f0f0f0f0f0ULL) ^ 0x3030303030303030ULL) |
+                                    (((w + 0x0606060606060606ULL) & 0xf0f0f0f0f0f0f0f0ULL) ^
+                                     0x3030303030303030ULL);
+    int n = non_digits == 0 ? 8 : __builtin_ctzll(non_digits) >> 3;
+    if (n == 0)
+        return 0;
+    // move the digits to the top, so that the bytes below them count as leading zeros
+    unsigned long long v = (w - 0x3030303030303030ULL) << (8 * (8 - n));
+    v = ((v & 0x0f0f0f0f0f0f0f0fULL) * 2561) >> 8;
+    v = ((v & 0x00ff00ff00ff00ffULL) * 6553601) >> 16;
+    v = ((v & 0x0000ffff0000ffffULL) * 42949672960001ULL) >> 32;
+    *valuep = v;
+    return n;
+}
+#endif
+
+/*
+ * Parse a number at p, eight digits at a time where there are eight
+ * bytes to look at.  Returns the end of its digits, which is p if
+ * there are none, or NULL if the number does not fit in an int.
+ */
+static const unsigned char *parse_num(const unsigned char *p, const unsigned char *end, int *nump) {
+    unsigned long long num = 0;
+    int n = 8;
+    while (n == 8){
+        unsigned long long value = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        if (end - p >= 8){
+            n = parse_digits8(p, &value);
         }
-        num = num * 10 + (c - '0');
-        isValid = 1;
-    };
-    if (!isValid){
-        if (c - EOF == 0){
-            return EOF;
+        else
+#endif
+        {
+            n = 0;
+            while (n < 8 && p + n < end && isDigit(*(p + n))){
+                value = value * 10 + (*(p + n) - '0');
+                n++;
+            }
         }
-        return ERR;
-    };
-    return num;
+        num = num * *(powers_of_ten + n) + value;
+        if (num > INT_MAX){
+            return NULL;
+        }
+        p += n;
+    }
+    *nump = num;
+    return p;
+}
+
+/*
+ * Record why the header being parsed is ill-formed, at the byte at p,
+ * and leave the stream taken bytes further on.  Returns ERR, or EOF if
+ * the diff ended before the header did.
+ */
+static int header_fail(STREAM *in, const unsigned char *p, int taken, int at_eof, const char *why) {
+    in->pos = p + taken - in->buf;
+    if (at_eof){
+        return EOF;
+    }
+    header_error = why;
+    header_error_offset = in->offset + (p - in->buf);
+    return ERR;
+}
+
+// parse one number of a header, returning 0 or the result of header_fail()
+static int header_num(STREAM *in, const unsigned char **pp, const unsigned char *end, int eof, int *nump) {
+    const unsigned char *p = *pp;
+    const unsigned char *q = parse_num(p, end, nump);
+    if (q == NULL){
+        return header_fail(in, p, 0, 0, "line number too large");
+    }
+    if (q == p){
+        return header_fail(in, p, 0, eof && p == end,
+                           p == end ? "header line too long" : "expected a line number");
+    }
+    *pp = q;
+    return 0;
+}
+
+// parse a range "n" or "n,m" of a header, returning 0 or the result of header_fail()
+static int parse_range(STREAM *in, const unsigned char **pp, const unsigned char *end, int eof,
+                       int *startp, int *endp) {
+    int result = header_num(in, pp, end, eof, startp);
+    if (result){
+        return result;
+    }
+    *endp = *startp;
+    if (*pp < end && **pp == ','){
+        (*pp)++;
+        return header_num(in, pp, end, eof, endp);
+    }
+    return 0;
+}
+
+/**
+ * @brief  Describe the last ill-formed hunk header met by hunk_next().
+ *
+ * @param offsetp  Where to store the byte offset in the diff at which
+ * the header went wrong.
+ * @return  A description of what was wrong, or NULL if the last call
+ * to hunk_next() did not fail on a header.
+ */
+const char *hunk_error(long long *offsetp) {
+    *offsetp = header_error_offset;
+    return header_error;
 }
 
 
 // if hunk_next_flag = 1 means hunk_next() function was just called
-static int hunk_next_flag_getc_helper = 0;
-static int hunk_next_flag_getc = 0;
-static int BOF = 1;
-static int change_type_flag = 0; // if current hunk has a change type then the flag is 1, otherwise it is 0.
+static _Thread_local int hunk_next_flag_getc_helper = 0;
+static _Thread_local int hunk_next_flag_getc = 0;
+static _Thread_local int BOF = 1;
+static _Thread_local int change_type_flag = 0; // if current hunk has a change type then the flag is 1, otherwise it is 0.
+
+// stream wrapped around the FILE most recently passed to hunk_next() or hunk_getc()
+static _Thread_local STREAM *bound_stream = NULL;
+
+static STREAM *bind_stream(FILE *in) {
+    if (bound_stream == NULL || bound_stream->file != in){
+        stream_close(bound_stream);
+        bound_stream = stream_open_reader(in);
+    }
+    return bound_stream;
+}
 
 int hunk_next(HUNK *hp, FILE *in) {
+    STREAM *s = bind_stream(in);
+    if (s == NULL){
+        return EOF;
+    }
+    return hunk_next_stream(hp, s);
+}
+
+int hunk_next_stream(HUNK *hp, STREAM *in) {
 
     // printf("enter hunk next function body\n");
     // update the hunk_next_flag for looping
@@ -77,11 +216,11 @@ int hunk_next(HUNK *hp, FILE *in) {
     }
 
     // loop to next hunk head
-    char c = hunk_getc(hp, in);
+    int c = hunk_getc_stream(hp, in);
     // printf("char c: %c, %d\n", c, c);
     while (c - ERR != 0){
         // printf("looping:\t\t%c\t\t%d\n", c, c);
-        c = hunk_getc(hp, in);
+        c = hunk_getc_stream(hp, in);
     }
 
     // printf("\n\n\nHUNK SHOW:\n");
@@ -95,41 +234,25 @@ int hunk_next(HUNK *hp, FILE *in) {
 
     // parse the head
     (*hp).serial ++;
-    // old start
-    int num = get_num(in);
-    if (num == ERR){
-        // printf("hunk_next ERR1\n");
-        return ERR;
-    }
-    if (num == EOF){
-        // printf("hunk_next EOF1\n");
-        return EOF;
-    }
-    (*hp).old_start = num;
-
-    // old end
-    c = fgetc(in);
-    if (c != ','){
-        ungetc(c, in);
-        (*hp).old_end = num;
-    }
-    else{
-        num = get_num(in);
-        if (num == ERR){
-            // printf("hunk_next ERR2\n");
-            return ERR;
-        }
-        if (num == EOF){
-            // printf("hunk_next EOF2\n");
-            return EOF;
-        }
-        (*hp).old_end = num;
+    header_error = NULL;
+    long avail = stream_peek(in, HUNK_HEADER_MAX);
+    const unsigned char *start = in->buf + in->pos;
+    const unsigned char *p = start;
+    const unsigned char *end = p + avail;
+    // the end of the window is the end of the diff if it is not full
+    int eof = avail < HUNK_HEADER_MAX;
+
+    // old start, and old end if there is one
+    int result = parse_range(in, &p, end, eof, &(*hp).old_start, &(*hp).old_end);
+    if (result){
+        return result;
     }
 
     // type
-    c = fgetc(in);
-    // printf("type: %c\n", c);
-    switch(c){
+    if (p == end){
+        return header_fail(in, p, 0, eof, "header line too long");
+    }
+    switch(*p){
         case 'a':
             (*hp).type = HUNK_APPEND_TYPE;
             change_type_flag = 0;
@@ -143,61 +266,30 @@ int hunk_next(HUNK *hp, FILE *in) {
             change_type_flag = 1;
             break;
         default:
-            if (c - EOF == 0){
-                return EOF;
-            }
-            // printf("hunk_next ERR3\n");
-            return ERR;
-    }
-
-    // new start
-    num = get_num(in);
-    if (num == ERR){
-        // printf("hunk_next ERR4\n");
-        return ERR;
-    }
-    if (num == EOF){
-        // printf("hunk_next EOF4\n");
-        return EOF;
+            return header_fail(in, p, 1, 0, "expected 'a', 'c' or 'd'");
     }
-    (*hp).new_start = num;
-
-    // new end
-    c = fgetc(in);
-    if (c != ','){
-        ungetc(c, in);
-        (*hp).new_end = num;
-    }
-    else{
-        num = get_num(in);
-        if (num == ERR){
-            // printf("hunk_next ERR5\n");
-           return ERR;
-        }
-        if (num == EOF){
-            // printf("hunk_next EOF5\n");
-            return EOF;
-        }
+    p++;
 
-        (*hp).new_end = num;
+    // new start, and new end if there is one
+    result = parse_range(in, &p, end, eof, &(*hp).new_start, &(*hp).new_end);
+    if (result){
+        return result;
     }
 
     // check for new line
-    c = fgetc(in);
-    if (c != '\n'){
-        // printf("hunk_next ERR6\n");
-        return ERR;
+    if (p == end){
+        return header_fail(in, p, 0, 0, eof ? "expected end of line" : "header line too long");
     }
-
-
-
+    if (*p != '\n'){
+        return header_fail(in, p, 1, 0, "expected end of line");
+    }
+    in->pos = p + 1 - in->buf;
 
     // check for possible errors
 
     // 1. old_end <= old_start || new_end <= new_start
     if ((*hp).old_end < (*hp).old_start || (*hp).new_end < (*hp).new_start){
-        // printf("hunk_next ERR7\n");
-        return ERR;
+        return header_fail(in, start, p + 1 - start, 0, "range ends before it starts");
     }
     return 0;
 }
@@ -237,23 +329,81 @@ int hunk_next(HUNK *hp, FILE *in) {
  */
 
 // beginning of a line flag
-static int BOL = 0;
+static _Thread_local int BOL = 0;
 // CAT => Current Action Type ('a', 'd', 'n') => return EOS
-static char CAT = 'n';
+static _Thread_local char CAT = 'n';
 // check syntax error
-static char expected_type = 'n';
-static char last_hunk_getc_result;
-static char last_hunk_getc_result_used = 0;
-static int return_EOS = 0;
+static _Thread_local char expected_type = 'n';
+static _Thread_local int last_hunk_getc_result;
+static _Thread_local char last_hunk_getc_result_used = 0;
+static _Thread_local int return_EOS = 0;
+
+/*
+ * Each line of the data portion of a hunk is recognized by its first
+ * few bytes, which are run through a small DFA.  The states before a
+ * decision is made come first; the rest are the kinds of line.  Bytes
+ * past the end of the input are taken to be of class B_OTHER.
+ */
+enum { B_OTHER, B_LT, B_GT, B_DASH, B_SPACE, B_NL, B_COUNT };
+
+enum {
+    P_START, P_LT, P_GT, P_DASH1, P_DASH2, P_DASH3,
+    LINE_DELETION,      // "< "
+    LINE_ADDITION,      // "> "
+    LINE_SEPARATOR,     // "---\n"
+    LINE_BAD_LT,        // '<' not followed by ' '
+    LINE_BAD_GT,        // '>' not followed by ' '
+    LINE_BAD_DASH,      // '-' not followed by "--\n"
+    LINE_OTHER          // anything else ends the hunk
+};
+#define LINE_KINDS LINE_DELETION   // states below this are undecided
+
+static const unsigned char byte_class[256] = {
+    ['<'] = B_LT, ['>'] = B_GT, ['-'] = B_DASH, [' '] = B_SPACE, ['\n'] = B_NL
+};
+
+static const unsigned char prefix_dfa[LINE_KINDS][B_COUNT] = {
+    [P_START] = { LINE_OTHER, P_LT, P_GT, P_DASH1, LINE_OTHER, LINE_OTHER },
+    [P_LT] = { LINE_BAD_LT, LINE_BAD_LT, LINE_BAD_LT, LINE_BAD_LT, LINE_DELETION, LINE_BAD_LT },
+    [P_GT] = { LINE_BAD_GT, LINE_BAD_GT, LINE_BAD_GT, LINE_BAD_GT, LINE_ADDITION, LINE_BAD_GT },
+    [P_DASH1] = { LINE_BAD_DASH, LINE_BAD_DASH, LINE_BAD_DASH, P_DASH2, LINE_BAD_DASH, LINE_BAD_DASH },
+    [P_DASH2] = { LINE_BAD_DASH, LINE_BAD_DASH, LINE_BAD_DASH, P_DASH3, LINE_BAD_DASH, LINE_BAD_DASH },
+    [P_DASH3] = { LINE_BAD_DASH, LINE_BAD_DASH, LINE_BAD_DASH, LINE_BAD_DASH, LINE_BAD_DASH, LINE_SEPARATOR }
+};
+
+// classify the line starting at the next byte of the stream, without taking any of it
+static int line_kind(STREAM *in) {
+    long avail = stream_peek(in, 4);
+    const unsigned char *p = in->buf + in->pos;
+    int state = P_START;
+    for (long i = 0; state < LINE_KINDS; i++){
+        state = *(*(prefix_dfa + state) + (i < avail ? *(byte_class + *(p + i)) : B_OTHER));
+    }
+    return state;
+}
+
+// take up to n bytes of the line prefix just classified
+static void skip_prefix(STREAM *in, size_t n) {
+    in->pos += in->len - in->pos < n ? in->len - in->pos : n;
+}
+
+/*
+ * Get the next run of data characters of the current hunk, without
+ * storing them: at most max characters, and never past the end of a
+ * line or of the data buffered in the stream.  Returns the number of
+ * characters, or EOS or ERR.  The line prefixes "< ", "> " and
+ * "---\n" are taken from the stream as they are met, and a newline is
+ * made up for a diff that does not end in one.
+ */
+static long hunk_run(HUNK *hp, STREAM *in, long max, const unsigned char **runp) {
+    static const unsigned char newline = '\n';
 
-int hunk_getc_helper(HUNK *hp, FILE *in) {
     // if the hunk_next function was just being called
     if (hunk_next_flag_getc_helper){
         hunk_next_flag_getc_helper = 0;
         BOL = 1;
         expected_type = 'n';
         CAT = 'n';
-
     }
 
     if (expected_type == 'n'){
@@ -268,221 +418,131 @@ int hunk_getc_helper(HUNK *hp, FILE *in) {
             expected_type = 'd';
             break;
         default:
-            // printf("getc error 8\n");
             return ERR;
         }
     }
 
-    // if BOL, then do pattern-matching
-    if (BOL){
-        // change the BOL flag
+    // a separator line is followed by another line start, hence the loop
+    while (BOL){
         BOL = 0;
-
-        char c1 = fgetc(in);
-
-        // printf("c1: %c\t\t%d\n", c1, c1);
-        char c2 = fgetc(in);
-        // printf("c2: %c\t\t%d\n", c2, c2);
-
-        // match the first char in the current line
-        switch(c1){
-        case '<':
-            // "< " pattern matched
-            if (c2 == ' '){
-
-                // check for syntax error
-                if (expected_type != 'd'){
-                    // printf("return 2\n");
-                    return ERR;
-                }
-
-                // if current action type == 'n', then modify its value
-                if (CAT == 'n'){
-                    CAT = 'd';
-                }
-                // if current action type does not match, then return 'EOS'
-                else if (CAT != 'd'){
-                    CAT = 'd';
-                    // printf("return 1\n");
-                    return EOS;
-                }
-
-                // return the next char by calling hunk_getc recursively
-                // printf("return 3\n");
-                return hunk_getc_helper(hp, in);
-            }
-            // invalid pattern
-            else{
-                // push all the chars back to the file
-                ungetc(c2, in);
-                ungetc(c1, in);
-
-                // printf("getc error 1\n");
+        int kind = line_kind(in);
+        switch(kind){
+        case LINE_DELETION:
+            skip_prefix(in, 2);
+            // check for syntax error
+            if (expected_type != 'd'){
                 return ERR;
             }
-        case '>':
-             // check for syntax error
+            // if current action type does not match, then return EOS
+            if (CAT != 'n' && CAT != 'd'){
+                CAT = 'd';
+                return EOS;
+            }
+            CAT = 'd';
+            break;
+        case LINE_ADDITION:
+        case LINE_BAD_GT:
+            // check for syntax error; the prefix is taken either way
             if (expected_type != 'a'){
-                // printf("getc error 5\n");
+                skip_prefix(in, 2);
                 return ERR;
             }
-
-            // "> " pattern matched
-            if (c2 == ' '){
-                // printf("CAT: %c\n", CAT);
-                // if current action type == 'n', then modify its value
-                if (CAT == 'n'){
-                    CAT = 'a';
-                }
-                // if current action type does not match, then return 'EOS'
-                else if (CAT != 'a'){
-                    CAT = 'a';
-                    // printf("456\n");
-                    return EOS;
-                }
-
-
-                // return the next char by calling hunk_getc recursively
-                return hunk_getc_helper(hp, in);
-            }
-            // invalid pattern
-            else{
-                // push all the chars back to the file
-                ungetc(c2, in);
-                ungetc(c1, in);
-
-                // printf("getc error 2\n");
+            if (kind == LINE_BAD_GT){
                 return ERR;
             }
-        case '-':
-            char c3 = fgetc(in);
-            char c4 = fgetc(in);
-            // "---\n" pattern matched
-            if (c2 == '-' && c3 == '-' && c4 == '\n'){
-
-                // if the action type of the current hunk is not C, then return an err
-                if ((*hp).type != HUNK_CHANGE_TYPE){
-                    return ERR;
-                }
-                // change expected type
-                else{
-                    expected_type = 'a';
-                }
-                BOL = 1;
-                // return the next char by calling hunk_getc recursively
-                return hunk_getc_helper(hp, in);
+            skip_prefix(in, 2);
+            if (CAT != 'n' && CAT != 'a'){
+                CAT = 'a';
+                return EOS;
             }
-            else{
-                // push all the chars back to the file
-                ungetc(c4, in);
-                ungetc(c3, in);
-                ungetc(c2, in);
-                ungetc(c1, in);
-
-                // printf("getc error 3\n");
+            CAT = 'a';
+            break;
+        case LINE_SEPARATOR:
+            skip_prefix(in, 4);
+            // only a change hunk has a separator
+            if ((*hp).type != HUNK_CHANGE_TYPE){
                 return ERR;
             }
+            expected_type = 'a';
+            BOL = 1;
+            break;
+        case LINE_BAD_LT:
+        case LINE_BAD_DASH:
+            return ERR;
         default:
-            // implies error or end of the hunk
-            // push all the chars back to the file
-            ungetc(c2, in);
-            ungetc(c1, in);
-
-            // cannot proceed and thus turn the flag back on
+            // implies error or end of the hunk; the line is left for hunk_next()
             BOL = 1;
-
             if (CAT != 'n'){
                 CAT = 'n';
-                // printf("789\n");
                 return EOS;
             }
-
-            // printf("getc error 4\n");
             return ERR;
         }
     }
-    // not BOL
-    else{
 
-        char c1 = fgetc(in);
-        if (c1 - EOF == 0){
-            // printf("getc error 7\n");
-            if (last_hunk_getc_result != '\n' && last_hunk_getc_result_used == 0){
-                last_hunk_getc_result_used = 1;
-                last_hunk_getc_result = '\n';
-                return_EOS = 1;
-                return '\n';
-            }
-            if (return_EOS){
-                return_EOS = 0;
-                return EOS;
-            }
-            return ERR;
+    if (stream_getc(in) == EOF){
+        if (last_hunk_getc_result != '\n' && last_hunk_getc_result_used == 0){
+            last_hunk_getc_result_used = 1;
+            return_EOS = 1;
+            *runp = &newline;
+            return 1;
         }
-        else if (c1 == '\n'){
-            BOL = 1;
+        if (return_EOS){
+            return_EOS = 0;
+            return EOS;
         }
-        // printf("c1: %c\n", c1);
-        return c1;
+        return ERR;
     }
-
-}
-
-
-static int new_line_flag = 1;
-static char* hunk_deletions_buffer_iter = hunk_deletions_buffer;
-static char* deletions_count_char = hunk_deletions_buffer;
-static char* hunk_additions_buffer_iter = hunk_additions_buffer;
-static char* additions_count_char = hunk_additions_buffer;
-static int char_count = 0;
-
-
-int hunk_getc(HUNK *hp, FILE *in) {
-    char c = hunk_getc_helper(hp, in);
-    // printf("c: %c, d: %d", c, c);
-
-
-    if (hunk_next_flag_getc){
-        hunk_deletions_buffer_iter = hunk_deletions_buffer;
-        deletions_count_char = hunk_deletions_buffer;
-        hunk_additions_buffer_iter = hunk_additions_buffer;
-        additions_count_char = hunk_additions_buffer;
-
-        *hunk_deletions_buffer_iter = 0;
-        *(hunk_deletions_buffer_iter+1) = 0;
-        *hunk_additions_buffer_iter = 0;
-        *(hunk_additions_buffer_iter+1) = 0;
-
-        char_count = 0;
-
-        hunk_next_flag_getc = 0;
+    in->pos--;
+
+    // the run ends after a newline, or where the buffered data or max runs out
+    const unsigned char *start = in->buf + in->pos;
+    const unsigned char *end = in->len - in->pos < (size_t) max ? in->buf + in->len : start + max;
+    const unsigned char *p = stream_scan(start, end);
+    if (p < end){
+        p++;
+        BOL = 1;
     }
+    in->pos = p - in->buf;
+    *runp = start;
+    return p - start;
+}
 
-    // skip EOS
-    if (c - EOS == 0){
-        last_hunk_getc_result = c;
-        return c;
-    }
 
-    if (c - ERR == 0){
-        last_hunk_getc_result = c;
-        return ERR;
-    }
+static _Thread_local int new_line_flag = 1;
+static _Thread_local char* hunk_deletions_buffer_iter = hunk_deletions_buffer;
+static _Thread_local char* deletions_count_char = hunk_deletions_buffer;
+static _Thread_local char* hunk_additions_buffer_iter = hunk_additions_buffer;
+static _Thread_local char* additions_count_char = hunk_additions_buffer;
+static _Thread_local int char_count = 0;
 
+/*
+ * Keep as much of the data of the current hunk as fits in the
+ * hunk_deletions_buffer and hunk_additions_buffer arrays, for use by
+ * hunk_show().  Each line is stored as a two-byte length followed by
+ * its characters; a line that does not fit is truncated, and once a
+ * buffer is full nothing more is stored in it.
+ */
+static void store_char(int c) {
     // add c to the buffer according to CAT
     // printf("CHAR: %c, %d, CAT: %c\n", c, c, CAT);
     switch(CAT){
         case 'a':
             if (new_line_flag){
+                new_line_flag = 0;
+                if (hunk_additions_buffer_iter - additions_buffer + 2 >= 510){
+                    // no room for another line
+                    hunk_additions_buffer_iter = additions_buffer + 510;
+                    break;
+                }
                 char_count = 0;
                 additions_count_char = hunk_additions_buffer_iter;
                 *additions_count_char = 0;
                 hunk_additions_buffer_iter += 2;
-                new_line_flag = 0;
                 // printf("+2\n");
             }
 
-            if (hunk_additions_buffer_iter - hunk_additions_buffer < 510){
+            if (hunk_additions_buffer_iter - additions_buffer < 510){
                 *(hunk_additions_buffer_iter++) = c;
                 if (++char_count <= 255){
                     *additions_count_char = char_count;
@@ -496,15 +556,20 @@ int hunk_getc(HUNK *hp, FILE *in) {
             break;
         case 'd':
             if (new_line_flag){
+                new_line_flag = 0;
+                if (hunk_deletions_buffer_iter - deletions_buffer + 2 >= 510){
+                    // no room for another line
+                    hunk_deletions_buffer_iter = deletions_buffer + 510;
+                    break;
+                }
                 char_count = 0;
                 deletions_count_char = hunk_deletions_buffer_iter;
                 *deletions_count_char = 0;
                 hunk_deletions_buffer_iter += 2;
-                new_line_flag = 0;
                 // printf("+2\n");
             }
 
-            if (hunk_deletions_buffer_iter - hunk_deletions_buffer < 510){
+            if (hunk_deletions_buffer_iter - deletions_buffer < 510){
                 *(hunk_deletions_buffer_iter++) = c;
 
                 if (++char_count <= 255){
@@ -523,21 +588,172 @@ int hunk_getc(HUNK *hp, FILE *in) {
     if (c == '\n'){
         new_line_flag = 1;
     }
+}
 
-    // printf("--------------\n");
-    // for (int i = 0; i < 100; i++){
-    //         char c_ = *(hunk_deletions_buffer + i);
-    //         if (c_ == '\n'){
-    //             printf("idx:%d\t\tchar:\t\tnum val:%u\n", i, c_);
-    //         }
-    //         else{
-    //             printf("idx:%d\t\tchar:%c\t\tnum val:%d\n", i, c_, c_);
-    //         }
-    //     }
-    // hunk_show(hp, stdout);
+// store a run of characters, stopping early once the buffer is full
+static void store_span(const unsigned char *p, long n) {
+    char *iter = CAT == 'a' ? hunk_additions_buffer_iter : hunk_deletions_buffer_iter;
+    char *base = CAT == 'a' ? additions_buffer : deletions_buffer;
+    long room = 510 - (iter - base);
+    long i = 0;
+    for (; i < n && i < room; i++){
+        store_char(*(p + i));
+    }
+    if (i < n && *(p + n - 1) == '\n'){
+        new_line_flag = 1;
+    }
+}
+
+/**
+ * @brief  Set the buffers in which the calling thread keeps the data
+ * of the current hunk for hunk_show().
+ * @details  Each buffer must hold 512 bytes and stay valid for as long
+ * as the thread reads hunks.
+ */
+void hunk_use_buffers(char *deletions, char *additions) {
+    deletions_buffer = deletions;
+    additions_buffer = additions;
+    hunk_reset();
+}
+
+/**
+ * @brief  Forget the state left behind by a previous diff.
+ * @details  hunk_next() and hunk_getc() keep track of their position
+ * within the diff they are reading.  This function must be called
+ * before reading a diff other than the first one read by the program.
+ */
+void hunk_reset(void) {
+    clear_buffer();
+    BOF = 1;
+    hunk_next_flag_getc_helper = 0;
+    hunk_next_flag_getc = 0;
+    change_type_flag = 0;
+    BOL = 0;
+    CAT = 'n';
+    expected_type = 'n';
+    last_hunk_getc_result = 0;
+    last_hunk_getc_result_used = 0;
+    return_EOS = 0;
+    new_line_flag = 1;
+    hunk_deletions_buffer_iter = deletions_buffer;
+    deletions_count_char = deletions_buffer;
+    hunk_additions_buffer_iter = additions_buffer;
+    additions_count_char = additions_buffer;
+    char_count = 0;
+}
+
+
+int hunk_getc(HUNK *hp, FILE *in) {
+    STREAM *s = bind_stream(in);
+    if (s == NULL){
+        return ERR;
+    }
+    return hunk_getc_stream(hp, s);
+}
+
+// get the next run of data characters and keep them for hunk_show()
+static long take_run(HUNK *hp, STREAM *in, long max, const unsigned char **runp) {
+    long n = hunk_run(hp, in, max, runp);
+
+    if (hunk_next_flag_getc){
+        hunk_deletions_buffer_iter = deletions_buffer;
+        deletions_count_char = deletions_buffer;
+        hunk_additions_buffer_iter = additions_buffer;
+        additions_count_char = additions_buffer;
+
+        *hunk_deletions_buffer_iter = 0;
+        *(hunk_deletions_buffer_iter+1) = 0;
+        *hunk_additions_buffer_iter = 0;
+        *(hunk_additions_buffer_iter+1) = 0;
+
+        char_count = 0;
+
+        hunk_next_flag_getc = 0;
+    }
+
+    // EOS or ERR
+    if (n < 0){
+        last_hunk_getc_result = n;
+        return n;
+    }
+
+    store_span(*runp, n);
+    last_hunk_getc_result = *(*runp + n - 1);
+    return n;
+}
+
+int hunk_getc_stream(HUNK *hp, STREAM *in) {
+    const unsigned char *run;
+    long n = take_run(hp, in, 1, &run);
+    return n < 0 ? (int) n : *run;
+}
 
-    last_hunk_getc_result = c;
-    return c;
+/**
+ * @brief  Get the next run of characters from the data portion of the hunk.
+ * @details  This function returns the same characters as repeated calls
+ * to hunk_getc() would, but as many at a time as possible: the run
+ * extends to the end of the current line (including its newline), or
+ * to the end of the data currently buffered in the stream, whichever
+ * comes first.  Lines of any length and containing any byte values
+ * are thus handled in bounded memory, without a call per character.
+ *
+ * @param hp  Data structure containing the header of the current hunk.
+ * @param in  The stream from which hunks are being read.
+ * @param spanp  Where to store a pointer to the characters.  They
+ * remain valid only until the next read from the stream.
+ * @return  The number of characters in the run, which is at least 1,
+ * or EOS or ERR under the same conditions as for hunk_getc().
+ */
+long hunk_getspan(HUNK *hp, STREAM *in, const unsigned char **spanp) {
+    return take_run(hp, in, LONG_MAX, spanp);
+}
+
+/**
+ * @brief  Skip the data portion of the current hunk, measuring it.
+ * @details  The hunk is read in the same runs as with hunk_getspan(),
+ * but the runs are only measured, and are not kept for hunk_show().
+ * The hunk is checked as diff_read() checks it: the numbers of lines
+ * in its sections must agree with its header.
+ *
+ * @param hp  Data structure containing the header of the current hunk.
+ * @param in  The stream from which hunks are being read.
+ * @param sp  Where to store the numbers of lines and bytes the hunk
+ * deletes and adds.
+ * @return  0 if the hunk is well-formed, otherwise ERR.
+ */
+int hunk_skip(HUNK *hp, STREAM *in, HUNK_SIZE *sp) {
+    sp->deleted_lines = sp->deleted_bytes = 0;
+    sp->added_lines = sp->added_bytes = 0;
+    int eos_count = 0;
+    int in_line = 0;
+    const unsigned char *run;
+    long n;
+    while ((n = hunk_run(hp, in, LONG_MAX, &run)) != ERR){
+        if (n == EOS){
+            eos_count++;
+            continue;
+        }
+        last_hunk_getc_result = *(run + n - 1);
+        // a run ends either at the end of a line or part way through one
+        in_line = last_hunk_getc_result != '\n';
+        if (CAT == 'a'){
+            sp->added_bytes += n;
+            sp->added_lines += !in_line;
+        }
+        else{
+            sp->deleted_bytes += n;
+            sp->deleted_lines += !in_line;
+        }
+    }
+    last_hunk_getc_result = ERR;
+
+    long long deletions = (*hp).type == HUNK_APPEND_TYPE ? 0 : (*hp).old_end - (*hp).old_start + 1;
+    long long additions = (*hp).type == HUNK_DELETE_TYPE ? 0 : (*hp).new_end - (*hp).new_start + 1;
+    if (eos_count == 0 || in_line || sp->deleted_lines != deletions || sp->added_lines != additions ||
+        ((*hp).type == HUNK_APPEND_TYPE && (*hp).old_start != (*hp).old_end) ||
+        ((*hp).type == HUNK_DELETE_TYPE && (*hp).new_start != (*hp).new_end))
+        return ERR;
+    return 0;
 }
 
 /**
@@ -572,53 +788,31 @@ int hunk_getc(HUNK *hp, FILE *in) {
  */
 
 void hunk_show(HUNK *hp, FILE *out) {
-    // header
-    fprintf(out, "%d", (*hp).old_start);
-    if((*hp).old_start != (*hp).old_end)
-        fprintf(out, ",%d", (*hp).old_end);
-
-    switch((*hp).type){
-        case  HUNK_APPEND_TYPE:
-            fprintf(out, "a");
-            break;
-        case HUNK_DELETE_TYPE:
-            fprintf(out, "d");
-            break;
-        case HUNK_CHANGE_TYPE:
-            fprintf(out, "c");
-            break;
-        default:
-            break;
+    // the hunk is put together in memory and written all at once
+    STREAM *s = stream_open_buffer();
+    if (s == NULL){
+        return;
     }
 
-    fprintf(out, "%d", (*hp).new_start);
-    if((*hp).new_start != (*hp).new_end)
-        fprintf(out, ",%d", (*hp).new_end);
-
-    fprintf(out, "\n");
+    // header
+    diff_write_header(hp, s);
+    stream_putc('\n', s);
 
     // body content
     int new_line_d = 0;
     if (hp->type == HUNK_DELETE_TYPE || hp->type == HUNK_CHANGE_TYPE){
-        fprintf(out, "< ");
-        int line_char_count_d = (unsigned char) *hunk_deletions_buffer + *(hunk_deletions_buffer + 1) * 256;
-        // fprintf(out, "\n\n%d\n\n", line_char_count_d);
-        char *ptr_d = hunk_deletions_buffer + 2;
+        stream_write("< ", 2, s);
+        int line_char_count_d = (unsigned char) *deletions_buffer + *(deletions_buffer + 1) * 256;
+        char *ptr_d = deletions_buffer + 2;
 
         while(line_char_count_d != 0){
             for (int i = 0; i < line_char_count_d; i++){
 
                 if (new_line_d){
-                    fprintf(out, "< ");
+                    stream_write("< ", 2, s);
                 }
-                fprintf(out,"%c", *ptr_d);
-                if (*ptr_d == '\n'){
-                    new_line_d = 1;
-                }
-                else{
-                    new_line_d = 0;
-                }
-                // printf("%c, %d \n", *ptr_d, *ptr_d);
+                stream_putc(*ptr_d, s);
+                new_line_d = *ptr_d == '\n';
                 ptr_d++; // increment the ptr
 
             }
@@ -629,8 +823,8 @@ void hunk_show(HUNK *hp, FILE *out) {
         }
 
         // overflow case
-        if (ptr_d > hunk_deletions_buffer + 256){
-            fprintf(out, "...\n");
+        if (ptr_d > deletions_buffer + 256){
+            stream_write("...\n", 4, s);
         }
     }
 
@@ -642,32 +836,24 @@ void hunk_show(HUNK *hp, FILE *out) {
 
     if (hp->type == HUNK_APPEND_TYPE || hp->type == HUNK_CHANGE_TYPE){
         if (!change_type_separator){
-            fprintf(out, "> ");
+            stream_write("> ", 2, s);
 
         }
 
-        int line_char_count_a = (unsigned char) *hunk_additions_buffer + *(hunk_additions_buffer + 1) * 256;
-        // fprintf(out, "\n\n%d\n\n", line_char_count_d);
-        char *ptr_a = hunk_additions_buffer + 2;
+        int line_char_count_a = (unsigned char) *additions_buffer + *(additions_buffer + 1) * 256;
+        char *ptr_a = additions_buffer + 2;
 
         while(line_char_count_a != 0){
             if (change_type_separator){
                 change_type_separator = 0;
-                fprintf(out, "---\n> ");
+                stream_write("---\n> ", 6, s);
             }
             for (int i = 0; i < line_char_count_a; i++){
                 if (new_line_a){
-                    fprintf(out, "> ");
-                }
-                fprintf(out,"%c", *ptr_a);
-                // printf("\n%c,%d\n", *ptr_a, *ptr_a);
-                if (*ptr_a == '\n'){
-                    new_line_a = 1;
-                }
-                else{
-                    new_line_a = 0;
+                    stream_write("> ", 2, s);
                 }
-                // printf("%c, %d \n", *ptr_d, *ptr_d);
+                stream_putc(*ptr_a, s);
+                new_line_a = *ptr_a == '\n';
                 ptr_a++; // increment the ptr
 
             }
@@ -678,11 +864,18 @@ void hunk_show(HUNK *hp, FILE *out) {
         }
 
         // overflow case
-        if (ptr_a > hunk_additions_buffer + 256){
-            fprintf(out, "...\n");
+        if (ptr_a > additions_buffer + 256){
+            stream_write("...\n", 4, s);
         }
     }
 
+    size_t len;
+    unsigned char *bytes = stream_contents(s, &len);
+    if (!s->error){
+        fwrite(bytes, 1, len, out);
+    }
+    stream_close(s);
+
     // int count_A = 0;
     // char *charCountPtr_A = hunk_additions_buffer;
     // int lineCharCount_A = (unsigned char) *charCountPtr_A + *(charCountPtr_A + 1) * 256;
@@ -736,7 +929,11 @@ void hunk_show(HUNK *hp, FILE *out) {
  * This mode of operation implies that in general when an error is
  * detected, some amount of output might already have been produced.
  * In case of a fatal error, processing may terminate prematurely,
- * having produced only a truncated version of the result.
+ * having produced only a truncated version of the result.  With
+ * TRANSACTION_HUNK_OPTION, the output is held back until the hunk it
+ * leads up to has applied, so it stops at the end of the last hunk
+ * that did; with TRANSACTION_ALL_OPTION, there is none unless the
+ * whole diff applied.
  * In case the diff file is empty, then the output should be an
  * unchanged copy of the input.
  *
@@ -775,23 +972,320 @@ void hunk_show(HUNK *hp, FILE *out) {
 
 
 
-static void copy_line(FILE *in, FILE *out){
-    char c;
+static _Thread_local int input_file_new_line_flag = 0;
+static _Thread_local long patch_options = 0;  // global_options, or those of the current request
+
+/*
+ * The functions that copy and match the input a character or a span at
+ * a time are given the options they test as an argument, and are
+ * always inlined, so that in each kernel instantiated by PATCH_KERNEL
+ * below the argument is a constant and the tests are compiled away.
+ * The options given are only -n and one of the whitespace options;
+ * options that make no difference to the byte loops, such as -q, do
+ * not get kernels of their own.
+ */
+#define PATCH_INLINE static inline __attribute__((always_inline))
+
+// returns 0, or EOF if the input ended before the end of the line
+PATCH_INLINE int copy_line(STREAM *in, STREAM *out, long mode){
     // printf("copying ");
-    do{
-        c = getc(in);
-        // printf("%c",c);
-        if (!(global_options == 2 || global_options == 6)){
-            fprintf(out, "%c", c);
+    // stream_getc() refills the buffer when it runs out; the rest of the
+    // line is then looked for in what is buffered
+    while (stream_getc(in) != EOF){
+        const unsigned char *start = in->buf + in->pos - 1;
+        const unsigned char *end = in->buf + in->len;
+        const unsigned char *p = stream_scan(start, end);
+        int eol = p < end;
+        if (eol){
+            p++;
+        }
+        in->pos = p - in->buf;
+        if (!(mode & NO_PATCH_OPTION)){
+            stream_write(start, p - start, out);
         }
-    }while (c != '\n');
+        if (eol){
+            input_file_new_line_flag = 1;
+            return 0;
+        }
+    }
     // printf("\n");
+    return EOF;
 }
 
-static int old_file_line_count = 1;
-static int new_file_line_count = 1;
-static int hunk_err = 0;
-static int input_file_new_line_flag = 0;
+// a word that may be loaded from any address
+typedef unsigned long long __attribute__((may_alias, aligned(1))) MATCH_WORD;
+
+// the number of leading bytes p and q have in common, out of n, compared a word at a time
+static long common_prefix(const unsigned char *p, const unsigned char *q, long n){
+    long i = 0;
+    while (n - i >= (long) sizeof(MATCH_WORD)){
+        unsigned long long x = *(const MATCH_WORD *) (p + i) ^ *(const MATCH_WORD *) (q + i);
+        if (x != 0){
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            return i + (__builtin_clzll(x) >> 3);
+#else
+            return i + (__builtin_ctzll(x) >> 3);
+#endif
+        }
+        i += sizeof(MATCH_WORD);
+    }
+    while (i < n && *(p + i) == *(q + i)){
+        i++;
+    }
+    return i;
+}
+
+/*
+ * Match a run of characters to be deleted against the input.
+ * Returns 0 if the input contains them, 1 if a character differs
+ * (the input is then just past it), or EOF if the input ended first;
+ * *matchedp is set to the number of characters that matched.  An
+ * input that lacks a final newline matches the newline it would have
+ * had.
+ */
+static int match_span(STREAM *in, const unsigned char *p, long n, long *matchedp){
+    *matchedp = 0;
+    while (n > 0){
+        if (stream_getc(in) == EOF){
+            if (n == 1 && *p == '\n' && !input_file_new_line_flag){
+                input_file_new_line_flag = 1;
+                *matchedp += 1;
+                return 0;
+            }
+            return EOF;
+        }
+        in->pos--;
+        const unsigned char *q = in->buf + in->pos;
+        long k = (long) (in->len - in->pos) < n ? (long) (in->len - in->pos) : n;
+        long same = common_prefix(p, q, k);
+        if (same < k){
+            in->pos += same + 1;
+            *matchedp += same;
+            return 1;
+        }
+        input_file_new_line_flag = *(q + k - 1) == '\n';
+        in->pos += k;
+        *matchedp += k;
+        p += k;
+        n -= k;
+    }
+    return 0;
+}
+
+static _Thread_local int line_tail = 0;  // only ignorable characters may be left in the line
+
+// whether a character that differs may be passed over
+PATCH_INLINE int ignorable(int c, long mode){
+    if (mode & (IGNORE_TRAILING_WS_OPTION | IGNORE_ALL_WS_OPTION)){
+        return c == ' ' || c == '\t' || c == '\r';
+    }
+    return c == '\r';
+}
+
+// the next character of the input without taking it, a made-up final newline, or EOF
+static int peek_input(STREAM *in){
+    if (stream_getc(in) != EOF){
+        return *(in->buf + --in->pos);
+    }
+    return input_file_new_line_flag ? EOF : '\n';
+}
+
+// take the character that peek_input() returned
+static void take_input(STREAM *in, int c){
+    if (in->pos < in->len){
+        in->pos++;
+    }
+    input_file_new_line_flag = c == '\n';
+}
+
+/*
+ * match_span() for the IGNORE_OPTIONS, with the same results.  The
+ * two sides are compared in lockstep, in bulk while they agree; where
+ * they first differ, ignorable characters are passed over on either
+ * side: anywhere with IGNORE_ALL_WS_OPTION, and otherwise only if the
+ * rest of the line on both sides is ignorable.  Nothing is copied or
+ * changed, and a line split across runs is matched all the same.
+ */
+PATCH_INLINE int match_span_loose(STREAM *in, const unsigned char *p, long n, long *matchedp,
+                                  long mode){
+    long i = 0;
+    int result = 0;
+    while (i < n){
+        int e = *(p + i);
+        if (line_tail){
+            if (e != '\n'){
+                if (!ignorable(e, mode)){
+                    result = 1;
+                    break;
+                }
+                i++;
+                continue;
+            }
+            // the input's line must end the same way
+            int a;
+            while ((a = peek_input(in)) != '\n' && a != EOF && ignorable(a, mode)){
+                take_input(in, a);
+            }
+            if (a != '\n'){
+                result = a == EOF ? EOF : 1;
+                break;
+            }
+            take_input(in, a);
+            line_tail = 0;
+            i++;
+            continue;
+        }
+
+        if (stream_getc(in) != EOF){
+            in->pos--;
+            long k = (long) (in->len - in->pos) < n - i ? (long) (in->len - in->pos) : n - i;
+            long same = common_prefix(p + i, in->buf + in->pos, k);
+            if (same > 0){
+                input_file_new_line_flag = *(in->buf + in->pos + same - 1) == '\n';
+                in->pos += same;
+                i += same;
+                continue;
+            }
+        }
+        int a = peek_input(in);
+        if (a == e){
+            // only a made-up final newline gets here
+            take_input(in, a);
+            i++;
+        }
+        else if (mode & IGNORE_ALL_WS_OPTION){
+            if (ignorable(e, mode)){
+                i++;
+            }
+            else if (a != EOF && a != '\n' && ignorable(a, mode)){
+                take_input(in, a);
+            }
+            else{
+                result = a == EOF ? EOF : 1;
+                break;
+            }
+        }
+        else if ((e == '\n' || ignorable(e, mode)) && (a == '\n' || ignorable(a, mode))){
+            line_tail = 1;
+        }
+        else{
+            result = a == EOF ? EOF : 1;
+            break;
+        }
+    }
+    if (result == 1 && in->pos < in->len){
+        in->pos++;
+    }
+    *matchedp = i;
+    return result;
+}
+
+static _Thread_local int old_file_line_count = 1;
+static _Thread_local int new_file_line_count = 1;
+static _Thread_local int hunk_err = 0;
+
+// copy at most REPORT_EXCERPT bytes of a line, up to and including its newline
+static int take_excerpt(unsigned char *to, const unsigned char *p, const unsigned char *end){
+    int n = 0;
+    while (p < end && n < REPORT_EXCERPT){
+        *(to + n++) = *p;
+        if (*(p++) == '\n'){
+            break;
+        }
+    }
+    return n;
+}
+
+/*
+ * Record where a run of deleted characters stopped matching the input:
+ * matched characters of the run at span did match, starting at the
+ * given column of the line.  Only the input still buffered is quoted.
+ * diff is NULL if the run is not taken from a diff being read.
+ */
+static void record_mismatch(HUNK_FAILURE *f, STREAM *in, STREAM *diff, const unsigned char *span,
+                            long n, long matched, long long column, int result){
+    f->error = result == EOF ? "input_ended" : "mismatch";
+    f->message = result == EOF ? "the input ended within a line to be deleted"
+                               : "a line to be deleted does not match the input";
+    f->line = old_file_line_count;
+    f->column = column + matched + 1;
+    if (diff != NULL && span >= diff->buf && span < diff->buf + diff->len){
+        f->diff_offset = diff->offset + (span - diff->buf) + matched;
+    }
+
+    // the bytes before the mismatch are the same in both excerpts
+    long back = matched < REPORT_CONTEXT ? matched : REPORT_CONTEXT;
+    if (result == EOF){
+        f->input_offset = stream_tell(in);
+    }
+    else{
+        f->input_offset = stream_tell(in) - 1;
+        if ((long) in->pos - 1 < back){
+            back = in->pos - 1;
+        }
+        f->actual_len = take_excerpt(f->actual, in->buf + in->pos - 1 - back, in->buf + in->len);
+    }
+    f->excerpt_column = f->column - back;
+    f->expected_len = take_excerpt(f->expected, span + matched - back, span + n);
+}
+
+/*
+ * Copy count lines of the input that the diff leaves alone, returning
+ * EOF if the input ended first.  With a line index, the lines up to
+ * the last indexed one among them are copied as one block of bytes
+ * (or skipped over, when no output is written) without looking for
+ * their newlines; only the rest are scanned.
+ */
+PATCH_INLINE int copy_lines(STREAM *in, STREAM *out, long count, long mode){
+    if (count > 0 && in->index != NULL){
+        long long line;
+        long long at = line_index_lookup(in->index, old_file_line_count + count, &line);
+        long lines = line - old_file_line_count;
+        // an index that does not fit the file after all is dropped, and the lines scanned
+        if (lines > 0 && !line_index_check(fileno(in->file), at)){
+            line_index_free(in->index);
+            in->index = NULL;
+            lines = 0;
+        }
+        if (lines > 0 && at >= stream_tell(in) &&
+            stream_copy(in, (mode & NO_PATCH_OPTION) ? NULL : out,
+                        at - stream_tell(in)) == 0){
+            old_file_line_count += lines;
+            new_file_line_count += lines;
+            count -= lines;
+            input_file_new_line_flag = 1;
+        }
+    }
+    while (count-- > 0){
+        if (copy_line(in, out, mode) == EOF){
+            return EOF;
+        }
+        new_file_line_count++;
+        old_file_line_count++;
+    }
+    return 0;
+}
+
+/*
+ * Attach the cached line index of an input file that is read from its
+ * start, returning 1 if one was attached, to be freed by detach_index().
+ */
+static int attach_index(STREAM *s){
+    if (line_index_dir == NULL || s->index != NULL || s->file == NULL || s->writing ||
+        s->codec != STREAM_PLAIN || s->offset != 0 || s->pos != 0 ||
+        ftello(s->file) != (long long) s->len){
+        return 0;
+    }
+    s->index = line_index_load(fileno(s->file), line_index_dir);
+    return s->index != NULL;
+}
+
+static void detach_index(STREAM *s, int attached){
+    if (attached){
+        line_index_free(s->index);
+        s->index = NULL;
+    }
+}
 int patch(FILE *in, FILE *out, FILE *diff) {
 
     // if any file is null pointer than return -1
@@ -800,26 +1294,54 @@ int patch(FILE *in, FILE *out, FILE *diff) {
         return -1;
     }
 
+    STREAM *in_stream = stream_open_reader(in);
+    STREAM *diff_stream = stream_open_reader(diff);
+    STREAM *out_stream = stream_open_writer(out, output_codec, output_level, output_threads);
+
+    int result = -1;
+    if (in_stream != NULL && diff_stream != NULL && out_stream != NULL){
+        result = patch_stream(in_stream, out_stream, diff_stream, global_options);
+    }
+    // a read or write error means the output cannot be trusted
+    if (stream_close(out_stream) || in_stream == NULL || in_stream->error ||
+        diff_stream == NULL || diff_stream->error){
+        result = -1;
+    }
+    stream_close(in_stream);
+    stream_close(diff_stream);
+    return result;
+}
+
+/*
+ * The body of patch_stream(), for the options in mode.  Options that are
+ * not in mode, such as QUIET_OPTION, are taken from patch_options.
+ */
+PATCH_INLINE int patch_kernel(STREAM *in, STREAM *out, STREAM *diff, long mode) {
     HUNK hunk;
     hunk.serial = 0;
-    int hunk_result = hunk_next(&hunk, diff);
+    hunk.type = HUNK_NO_TYPE;
+    hunk_reset();
+    // filled in only when something goes wrong
+    HUNK_FAILURE failure;
+    report_init(&failure);
+    long long column = 0;  // characters of the current deleted line matched so far
+    int hunk_result = hunk_next_stream(&hunk, diff);
     while (hunk_result == 0){
 
         // printf("hunk.serial: %d\n", hunk.serial);
 
-        char c = hunk_getc(&hunk, diff);
-
-        // printf("hunk_getc result: %c\n", c);
+        // the hunk data is taken a line (or a buffer) at a time
+        const unsigned char *span;
+        long n = hunk_getspan(&hunk, diff, &span);
 
         int EOS_flag = 0;
         int parse_success_flag = 0;
 
         int run = 1;
         while (run){
-            // printf("\n%c\t\t%d\n", c, c);
 
             // if we have EOS, ERR, then we successfully parse the hunk
-            if (c - ERR == 0){
+            if (n == ERR){
                 // printf("ERROR\n");
                 if (EOS_flag){
                     parse_success_flag = 1;
@@ -828,13 +1350,12 @@ int patch(FILE *in, FILE *out, FILE *diff) {
             }
 
             // skip EOS
-            if (c - EOS == 0){
+            if (n == EOS){
                 EOS_flag = 1;
-                c = hunk_getc(&hunk, diff);
+                n = hunk_getspan(&hunk, diff, &span);
                 continue;
             }
-            // add c to the buffer according to CAT
-            // printf("CHAR: %c, CAT: %c, old_file_line_count %d, new_file_line_count: %d\n", c, CAT, old_file_line_count, new_file_line_count);
+            int eol = *(span + n - 1) == '\n';
             switch(CAT){
             case 'a':
                 // modify output file under append action type
@@ -842,27 +1363,27 @@ int patch(FILE *in, FILE *out, FILE *diff) {
                 if (change_type_flag){
                     // in change type, do not consider "skip line" scenario
                     // we also do not need to copy current line
-                    if (!(global_options == 2 || global_options == 6)){
-                        fprintf(out, "%c", c);
+                    if (!(mode & NO_PATCH_OPTION)){
+                        stream_write(span, n, out);
                     }
                 }
                 else{
                     // in append type, we need to consider "skip line" scenario
                     // then copy the hunk.old_start line
-                    while (old_file_line_count <= hunk.old_start){
-                        copy_line(in, out);
-                        new_file_line_count++;
-                        old_file_line_count++;
+                    if (copy_lines(in, out, hunk.old_start + 1 - old_file_line_count, mode) == EOF){
+                        failure.error = "input_ended";
+                        failure.message = "the input ended before the line to append after";
+                        run = 0;
                     }
                     // now old_file_line_count = hunk.old_start + 1
 
                     // copy the new line not in old file
-                    if (!(global_options == 2 || global_options == 6)){
-                        fprintf(out, "%c", c);
+                    if (!(mode & NO_PATCH_OPTION)){
+                        stream_write(span, n, out);
                     }
 
                 }
-                if (c == '\n'){
+                if (eol){
                     new_file_line_count++;
                 }
 
@@ -870,38 +1391,34 @@ int patch(FILE *in, FILE *out, FILE *diff) {
             case 'd':
 
                 // modify output file under deletion action type
-                while (old_file_line_count < hunk.old_start){
-                    copy_line(in, out);
-                    new_file_line_count++;
-                    old_file_line_count++;
-                }
-                char c2 = fgetc(in);
-                if (c2 - EOF == 0 && !input_file_new_line_flag){
-                    c2 = '\n';
-                }
-                if (c2 != c){
-                    // printf("%c,%c DOES NOT MATCH\n", c, c2);
-                    // printf("%d,%d DOES NOT MATCH\n", c, c2);
+                if (copy_lines(in, out, hunk.old_start - old_file_line_count, mode) == EOF){
+                    failure.error = "input_ended";
+                    failure.message = "the input ended before the lines to delete";
                     run = 0;
                 }
-
-                if (c2 == '\n'){
-                    input_file_new_line_flag = 1;
+                if (!run){
+                    break;
                 }
-                else{
-                    input_file_new_line_flag = 0;
+                long matched;
+                int matches = (mode & IGNORE_OPTIONS) ? match_span_loose(in, span, n, &matched, mode)
+                                                      : match_span(in, span, n, &matched);
+                if (matches){
+                    record_mismatch(&failure, in, diff, span, n, matched, column, matches);
+                    run = 0;
+                    break;
                 }
-                if (c == '\n'){
+                column += n;
+                if (eol){
                     old_file_line_count++;
+                    column = 0;
                 }
 
-
                 break;
             }
 
 
             if (run){
-                c = hunk_getc(&hunk, diff);
+                n = hunk_getspan(&hunk, diff, &span);
             }
 
 
@@ -915,29 +1432,233 @@ int patch(FILE *in, FILE *out, FILE *diff) {
             !parse_success_flag){
             hunk_err = 1;
 
-            if (global_options < 4){
-                hunk_show(&hunk, stderr);
+            failure.hunk = hunk;
+            failure.has_hunk = 1;
+            if (failure.error == NULL && !parse_success_flag){
+                failure.error = "ill_formed_hunk";
+                failure.message = "the data of the hunk is ill-formed";
+                failure.diff_offset = stream_tell(diff);
+            }
+            else if (failure.error == NULL){
+                failure.error = "count_mismatch";
+                failure.message = "the line numbers of the hunk do not match its data";
+            }
+            if (failure.line == 0){
+                failure.line = old_file_line_count;
+            }
+            if (failure.input_offset < 0){
+                failure.input_offset = stream_tell(in);
+            }
+            if (!(patch_options & QUIET_OPTION)){
+                if (error_format == ERROR_FORMAT_JSON){
+                    report_write(&failure, stderr);
+                }
+                else{
+                    hunk_show(&hunk, stderr);
+                }
             }
             break;
         }
-        hunk_result = hunk_next(&hunk, diff);
+        // the output up to the end of this hunk is now known to be right
+        if (!(mode & NO_PATCH_OPTION) && (patch_options & TRANSACTION_HUNK_OPTION)){
+            stream_commit(out);
+        }
+        hunk_result = hunk_next_stream(&hunk, diff);
 
 
 
     }
     if (hunk_result != EOF){
+        long long offset;
+        const char *why = hunk_error(&offset);
+        if (why != NULL && !hunk_err && !(patch_options & QUIET_OPTION)){
+            if (error_format == ERROR_FORMAT_JSON){
+                failure.error = "ill_formed_header";
+                failure.message = why;
+                failure.hunk = hunk;
+                failure.diff_offset = offset;
+                report_write(&failure, stderr);
+            }
+            else{
+                fprintf(stderr, "hunk %d header is ill-formed at byte %lld: %s\n", hunk.serial, offset, why);
+            }
+        }
         return -1;
     }
     if (!hunk_err){
-        char c_in = fgetc(in);
-        while (c_in - EOF != 0){
-            if (!(global_options == 2 || global_options == 6)){
-                fprintf(out, "%c", c_in);
+        // the rest of the input is copied a buffer at a time
+        while (stream_getc(in) != EOF){
+            if (!(mode & NO_PATCH_OPTION)){
+                stream_write(in->buf + in->pos - 1, in->len - in->pos + 1, out);
             }
-            c_in = fgetc(in);
+            in->pos = in->len;
         }
     }
 
 
     return hunk_err ? -1 : 0;
 }
+
+/*
+ * The body of patch_hunks(), for the options in mode: patch_kernel()
+ * with the hunks taken from memory rather than parsed.  The hunks were
+ * checked by diff_read(), so each deleted and added line is whole.
+ */
+PATCH_INLINE int hunks_kernel(STREAM *in, STREAM *out, DIFF *dp, HUNK_FAILURE *failure, long mode) {
+    for (int i = 0; i < dp->hunk_count; i++){
+        DIFF_HUNK *hp = dp->hunks + i;
+        HUNK *hunk = &hp->header;
+
+        if (hunk->type == HUNK_APPEND_TYPE){
+            if (copy_lines(in, out, hunk->old_start + 1 - old_file_line_count, mode) == EOF){
+                failure->error = "input_ended";
+                failure->message = "the input ended before the line to append after";
+            }
+        }
+        else if (copy_lines(in, out, hunk->old_start - old_file_line_count, mode) == EOF){
+            failure->error = "input_ended";
+            failure->message = "the input ended before the lines to delete";
+        }
+
+        for (int k = hp->deletions; failure->error == NULL && k < hp->deletions + hp->deletion_count; k++){
+            const unsigned char *line = (const unsigned char *) DIFF_LINE_TEXT(dp, k);
+            long n = DIFF_LINE_LENGTH(dp, k);
+            long matched;
+            int matches = (mode & IGNORE_OPTIONS) ? match_span_loose(in, line, n, &matched, mode)
+                                                  : match_span(in, line, n, &matched);
+            if (matches){
+                record_mismatch(failure, in, NULL, line, n, matched, 0, matches);
+                break;
+            }
+            old_file_line_count++;
+        }
+
+        if (failure->error == NULL){
+            for (int k = hp->additions; k < hp->additions + hp->addition_count; k++){
+                if (!(mode & NO_PATCH_OPTION)){
+                    stream_write(DIFF_LINE_TEXT(dp, k), DIFF_LINE_LENGTH(dp, k), out);
+                }
+                new_file_line_count++;
+            }
+        }
+
+        if (failure->error != NULL ||
+            old_file_line_count != hunk->old_end + 1 ||
+            new_file_line_count != hunk->new_end + 1){
+            failure->hunk = *hunk;
+            failure->has_hunk = 1;
+            if (failure->error == NULL){
+                failure->error = "count_mismatch";
+                failure->message = "the line numbers of the hunk do not match its data";
+            }
+            if (failure->line == 0){
+                failure->line = old_file_line_count;
+            }
+            if (failure->input_offset < 0){
+                failure->input_offset = stream_tell(in);
+            }
+            return -1;
+        }
+    }
+
+    // the rest of the input is copied a buffer at a time
+    while (stream_getc(in) != EOF){
+        if (!(mode & NO_PATCH_OPTION)){
+            stream_write(in->buf + in->pos - 1, in->len - in->pos + 1, out);
+        }
+        in->pos = in->len;
+    }
+    return 0;
+}
+
+/*
+ * The kernels.  The whitespace options are reduced to the one that
+ * takes precedence (see ignorable() and match_span_loose()), so each
+ * kernel tests at most one of them.
+ */
+#define PATCH_KERNEL(name, mode) \
+    static int name(STREAM *in, STREAM *out, STREAM *diff) { \
+        return patch_kernel(in, out, diff, (mode)); \
+    } \
+    static int name##_hunks(STREAM *in, STREAM *out, DIFF *dp, HUNK_FAILURE *failure) { \
+        return hunks_kernel(in, out, dp, failure, (mode)); \
+    }
+
+PATCH_KERNEL(patch_exact, 0)
+PATCH_KERNEL(patch_cr, IGNORE_CR_OPTION)
+PATCH_KERNEL(patch_trailing_ws, IGNORE_TRAILING_WS_OPTION)
+PATCH_KERNEL(patch_all_ws, IGNORE_ALL_WS_OPTION)
+PATCH_KERNEL(patch_exact_no_output, NO_PATCH_OPTION)
+PATCH_KERNEL(patch_cr_no_output, NO_PATCH_OPTION | IGNORE_CR_OPTION)
+PATCH_KERNEL(patch_trailing_ws_no_output, NO_PATCH_OPTION | IGNORE_TRAILING_WS_OPTION)
+PATCH_KERNEL(patch_all_ws_no_output, NO_PATCH_OPTION | IGNORE_ALL_WS_OPTION)
+
+#define PATCH_MODES 4          // exact, and the three whitespace options
+
+static int (*const patch_kernels[2][PATCH_MODES])(STREAM *, STREAM *, STREAM *) = {
+    { patch_exact, patch_cr, patch_trailing_ws, patch_all_ws },
+    { patch_exact_no_output, patch_cr_no_output, patch_trailing_ws_no_output, patch_all_ws_no_output }
+};
+
+static int (*const hunks_kernels[2][PATCH_MODES])(STREAM *, STREAM *, DIFF *, HUNK_FAILURE *) = {
+    { patch_exact_hunks, patch_cr_hunks, patch_trailing_ws_hunks, patch_all_ws_hunks },
+    { patch_exact_no_output_hunks, patch_cr_no_output_hunks, patch_trailing_ws_no_output_hunks,
+      patch_all_ws_no_output_hunks }
+};
+
+// reset the state of patching, and return the index of the kernel for the options
+static int patch_start(long options) {
+    patch_options = options;
+    old_file_line_count = 1;
+    new_file_line_count = 1;
+    hunk_err = 0;
+    input_file_new_line_flag = 0;
+    line_tail = 0;
+
+    // the kernel is chosen once for the whole diff
+    return (options & IGNORE_ALL_WS_OPTION) ? 3
+         : (options & IGNORE_TRAILING_WS_OPTION) ? 2
+         : (options & IGNORE_CR_OPTION) ? 1 : 0;
+}
+
+int patch_stream(STREAM *in, STREAM *out, STREAM *diff, long options) {
+    int mode = patch_start(options);
+    // with a transaction, the output is held back until it is known to be right
+    int held = !(options & NO_PATCH_OPTION) && (options & TRANSACTION_OPTIONS) &&
+               out->writing && out->file != NULL;
+    if (held && stream_hold(out)){
+        return -1;
+    }
+    int attached = attach_index(in);
+    int result = (*(*(patch_kernels + ((options & NO_PATCH_OPTION) != 0)) + mode))(in, out, diff);
+    detach_index(in, attached);
+    if (held && result == 0){
+        stream_release(out);
+    }
+    else if (held){
+        stream_rollback(out);
+    }
+    return result;
+}
+
+/**
+ * @brief  Patch an input with a diff held in memory.
+ * @details  This is patch_stream() without the parsing: the diff is
+ * only read, so any number of threads may apply the same one at the
+ * same time.  Nothing is reported; if a hunk does not apply, failure
+ * describes it instead, with no diff_offset.
+ *
+ * @param dp  A diff read with diff_read().
+ * @param out  Where the result is written; not used with NO_PATCH_OPTION.
+ * @param options  As for patch_stream(), except that QUIET_OPTION and the
+ * TRANSACTION_OPTIONS have no effect.
+ * @param failure  Initialized with report_init(); filled in on failure.
+ * @return  0 on success, -1 if a hunk does not apply.
+ */
+int patch_hunks(STREAM *in, STREAM *out, DIFF *dp, long options, HUNK_FAILURE *failure) {
+    int mode = patch_start(options);
+    int attached = attach_index(in);
+    int result = (*(*(hunks_kernels + ((options & NO_PATCH_OPTION) != 0)) + mode))(in, out, dp, failure);
+    detach_index(in, attached);
+    return result;
+}
@@ -0,0 +1,114 @@
+#include "hash.h"
+
+/*
+ * SHA-256 (FIPS 180-4).  See hash.h.
+ */
+
+static const unsigned int round_constants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void compress(HASH *h, const unsigned char *p) {
+    unsigned int w[64];
+    for (int i = 0; i < 16; i++)
+        *(w + i) = (unsigned int) *(p + 4 * i) << 24 | (unsigned int) *(p + 4 * i + 1) << 16 |
+                   (unsigned int) *(p + 4 * i + 2) << 8 | *(p + 4 * i + 3);
+    for (int i = 16; i < 64; i++){
+        unsigned int a = *(w + i - 15);
+        unsigned int b = *(w + i - 2);
+        unsigned int s0 = ROTR(a, 7) ^ ROTR(a, 18) ^ (a >> 3);
+        unsigned int s1 = ROTR(b, 17) ^ ROTR(b, 19) ^ (b >> 10);
+        *(w + i) = *(w + i - 16) + s0 + *(w + i - 7) + s1;
+    }
+
+    unsigned int a = *(h->state), b = *(h->state + 1), c = *(h->state + 2), d = *(h->state + 3);
+    unsigned int e = *(h->state + 4), f = *(h->state + 5), g = *(h->state + 6), k = *(h->state + 7);
+    for (int i = 0; i < 64; i++){
+        unsigned int t1 = k + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) +
+                          *(round_constants + i) + *(w + i);
+        unsigned int t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        k = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    *(h->state) += a;
+    *(h->state + 1) += b;
+    *(h->state + 2) += c;
+    *(h->state + 3) += d;
+    *(h->state + 4) += e;
+    *(h->state + 5) += f;
+    *(h->state + 6) += g;
+    *(h->state + 7) += k;
+}
+
+void hash_init(HASH *h) {
+    static const unsigned int initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    for (int i = 0; i < 8; i++)
+        *(h->state + i) = *(initial + i);
+    h->length = 0;
+    h->used = 0;
+}
+
+void hash_update(HASH *h, const void *data, size_t n) {
+    const unsigned char *p = data;
+    h->length += n;
+    if (h->used > 0){
+        while (n > 0 && h->used < 64){
+            *(h->block + h->used++) = *(p++);
+            n--;
+        }
+        if (h->used < 64)
+            return;
+        compress(h, h->block);
+        h->used = 0;
+    }
+    // whole blocks are hashed where they lie
+    while (n >= 64){
+        compress(h, p);
+        p += 64;
+        n -= 64;
+    }
+    while (n-- > 0)
+        *(h->block + h->used++) = *(p++);
+}
+
+/**
+ * @brief  Finish a hash and store its HASH_SIZE-byte digest.
+ */
+void hash_final(HASH *h, unsigned char *digest) {
+    unsigned long long bits = h->length * 8;
+    *(h->block + h->used++) = 0x80;
+    if (h->used > 56){
+        while (h->used < 64)
+            *(h->block + h->used++) = 0;
+        compress(h, h->block);
+        h->used = 0;
+    }
+    while (h->used < 56)
+        *(h->block + h->used++) = 0;
+    for (int i = 0; i < 8; i++)
+        *(h->block + 56 + i) = bits >> (56 - 8 * i);
+    compress(h, h->block);
+    for (int i = 0; i < 8; i++){
+        *(digest + 4 * i) = *(h->state + i) >> 24;
+        *(digest + 4 * i + 1) = *(h->state + i) >> 16;
+        *(digest + 4 * i + 2) = *(h->state + i) >> 8;
+        *(digest + 4 * i + 3) = *(h->state + i);
+    }
+}
@@ -0,0 +1,24 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+
+/*
+ * SHA-256, computed incrementally, so that data can be hashed as it
+ * streams past on its way somewhere else.
+ */
+
+#define HASH_SIZE 32           // bytes in a digest
+
+typedef struct hash {
+    unsigned int state[8];
+    unsigned long long length; // bytes hashed so far
+    unsigned char block[64];   // bytes not yet making up a whole block
+    size_t used;
+} HASH;
+
+void hash_init(HASH *h);
+void hash_update(HASH *h, const void *data, size_t n);
+void hash_final(HASH *h, unsigned char *digest);
+
+#endif
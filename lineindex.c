@@ -0,0 +1,309 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "lineindex.h"
+#include "budget.h"
+
+/*
+ * Building, caching and looking up line-offset indexes.  See
+ * lineindex.h.
+ */
+
+#define SCAN_BLOCK (1 << 20)   // bytes read at a time while building
+#define SCAN_BLOCK_MIN (1 << 14)   // smallest block, when memory is short
+
+typedef struct index_header {
+    long long magic;
+    long long dev;
+    long long ino;
+    long long size;
+    long long mtime_sec;
+    long long mtime_nsec;
+    long long ctime_sec;       // changes on any write, even one that restores the mtime
+    long long ctime_nsec;
+    long long stride;
+    long long lines;
+    long long count;
+} INDEX_HEADER;
+
+#define ONES 0x0101010101010101ULL
+#define LOW7 0x7f7f7f7f7f7f7f7fULL
+
+/*
+ * Mask with the high bit set in exactly those bytes of w that are
+ * newlines.  Unlike the usual has-zero-byte test, this one gives no
+ * false positives, so the bits can be used to locate the newlines.
+ */
+static unsigned long long newline_mask(unsigned long long w) {
+    unsigned long long t = w ^ (ONES * '\n');
+    return ~(((t & LOW7) + LOW7) | t | LOW7);
+}
+
+// index within a word of the byte whose high bit is the lowest set bit of m
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define FIRST_BYTE(m) (__builtin_clzll(m) >> 3)
+#define DROP_FIRST(m) ((m) & ~(0x8000000000000000ULL >> __builtin_clzll(m)))
+#else
+#define FIRST_BYTE(m) (__builtin_ctzll(m) >> 3)
+#define DROP_FIRST(m) ((m) & ((m) - 1))
+#endif
+
+static int index_add(LINE_INDEX *ix, long long *size, long long offset) {
+    if (ix->count == *size){
+        long long n = *size ? *size * 2 : 1024;
+        long long *p = budget_realloc(ix->offsets, n * sizeof(long long));
+        if (p == NULL)
+            return -1;
+        ix->offsets = p;
+        *size = n;
+    }
+    *(ix->offsets + ix->count++) = offset;
+    return 0;
+}
+
+/**
+ * @brief  Build the line-offset index of a file.
+ * @details  The file is read with positional reads, so the file offset
+ * of fd is left alone.  Newlines are located a word at a time.
+ *
+ * @param fd  Descriptor of the file, which must support pread().
+ * @param size  Size of the file.
+ * @return  The index, or NULL on a read error or if out of memory.
+ */
+LINE_INDEX *line_index_build(int fd, long long size) {
+    LINE_INDEX *ix = budget_calloc(1, sizeof(LINE_INDEX));
+    // when memory is short, smaller blocks will do
+    size_t block_size = SCAN_BLOCK;
+    unsigned long long *block;
+    while ((block = budget_malloc(block_size)) == NULL && block_size > SCAN_BLOCK_MIN)
+        block_size /= 2;
+    long long capacity = 0;
+    if (ix == NULL || block == NULL || (size > 0 && index_add(ix, &capacity, 0))){
+        budget_free(block);
+        line_index_free(ix);
+        return NULL;
+    }
+
+    long long newlines = 0;
+    long long pos = 0;
+    while (pos < size){
+        ssize_t got = pread(fd, block, block_size, pos);
+        if (got <= 0){
+            budget_free(block);
+            line_index_free(ix);
+            return NULL;
+        }
+        long long words = got / 8;
+        for (long long i = 0; i <= words; i++){
+            unsigned long long m;
+            if (i < words){
+                m = newline_mask(*(block + i));
+                if (m == 0)
+                    continue;
+            }
+            else{
+                // the bytes after the last whole word
+                m = 0;
+                unsigned char *tail = (unsigned char *) (block + i);
+                for (long long b = 0; b < got - words * 8; b++)
+                    if (*(tail + b) == '\n')
+                        m |= 0x80ULL << (8 * b);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+                m = __builtin_bswap64(m);
+#endif
+            }
+            while (m != 0){
+                long long at = pos + i * 8 + FIRST_BYTE(m);
+                m = DROP_FIRST(m);
+                // the line after this newline is indexed if it exists
+                if (++newlines % LINE_INDEX_STRIDE == 0 && at + 1 < size &&
+                    index_add(ix, &capacity, at + 1)){
+                    budget_free(block);
+                    line_index_free(ix);
+                    return NULL;
+                }
+            }
+        }
+        pos += got;
+    }
+    budget_free(block);
+
+    ix->size = size;
+    // a final line without a newline still counts
+    ix->lines = newlines;
+    if (size > 0){
+        unsigned char last;
+        if (pread(fd, &last, 1, size - 1) == 1 && last != '\n')
+            ix->lines++;
+    }
+    return ix;
+}
+
+static char *cache_path(const char *dir, struct stat *st, const char *suffix) {
+    size_t n = 0;
+    while (*(dir + n) != 0)
+        n++;
+    // room for the suffix, and for the process id and count added to that of a temporary file
+    size_t size = n + 96;
+    char *path = malloc(size);
+    if (path != NULL)
+        snprintf(path, size, "%s/%llx-%llx.idx%s", dir, (unsigned long long) st->st_dev,
+                 (unsigned long long) st->st_ino, suffix);
+    return path;
+}
+
+static void header_of(INDEX_HEADER *h, struct stat *st) {
+    h->magic = LINE_INDEX_MAGIC;
+    h->dev = st->st_dev;
+    h->ino = st->st_ino;
+    h->size = st->st_size;
+    h->mtime_sec = st->st_mtim.tv_sec;
+    h->mtime_nsec = st->st_mtim.tv_nsec;
+    h->ctime_sec = st->st_ctim.tv_sec;
+    h->ctime_nsec = st->st_ctim.tv_nsec;
+    h->stride = LINE_INDEX_STRIDE;
+}
+
+/*
+ * Whether an index read from the cache could have been built from a
+ * file of its size: the first line starts at 0, and each indexed line
+ * after it starts later than the one before, but within the file.  A
+ * corrupt index would otherwise send the patch to seek anywhere.
+ */
+static int offsets_valid(LINE_INDEX *ix) {
+    if (ix->lines < 0 || ix->lines > ix->size || (ix->count > 0 && *ix->offsets != 0) ||
+        ix->count > ix->lines / LINE_INDEX_STRIDE + 1)
+        return 0;
+    for (long long i = 1; i < ix->count; i++)
+        if (*(ix->offsets + i) <= *(ix->offsets + i - 1) || *(ix->offsets + i) >= ix->size)
+            return 0;
+    return 1;
+}
+
+static LINE_INDEX *cache_read(const char *path, INDEX_HEADER *want) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return NULL;
+    INDEX_HEADER h;
+    LINE_INDEX *ix = NULL;
+    if (fread(&h, sizeof(h), 1, f) == 1 && h.magic == want->magic && h.dev == want->dev &&
+        h.ino == want->ino && h.size == want->size && h.mtime_sec == want->mtime_sec &&
+        h.mtime_nsec == want->mtime_nsec && h.ctime_sec == want->ctime_sec &&
+        h.ctime_nsec == want->ctime_nsec && h.stride == want->stride &&
+        h.count >= 0 && h.count <= h.size + 1){
+        ix = budget_calloc(1, sizeof(LINE_INDEX));
+        if (ix != NULL){
+            ix->size = h.size;
+            ix->lines = h.lines;
+            ix->count = h.count;
+            ix->offsets = budget_malloc((h.count + 1) * sizeof(long long));
+            if (ix->offsets == NULL ||
+                fread(ix->offsets, sizeof(long long), h.count, f) != (size_t) h.count ||
+                !offsets_valid(ix)){
+                line_index_free(ix);
+                ix = NULL;
+            }
+        }
+    }
+    fclose(f);
+    return ix;
+}
+
+// store an index, writing a temporary file and renaming it into place
+static void cache_write(const char *path, const char *tmp, INDEX_HEADER *h, LINE_INDEX *ix) {
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL)
+        return;
+    h->lines = ix->lines;
+    h->count = ix->count;
+    int ok = fwrite(h, sizeof(*h), 1, f) == 1 &&
+             (ix->count == 0 ||
+              fwrite(ix->offsets, sizeof(long long), ix->count, f) == (size_t) ix->count);
+    if (fclose(f) || !ok || rename(tmp, path))
+        unlink(tmp);
+}
+
+/**
+ * @brief  Get the line-offset index of a file, from the cache if possible.
+ * @details  If the cache directory has no valid index for the file, one
+ * is built and stored there for next time.  Failure to store it is not
+ * an error.
+ *
+ * @param fd  Descriptor of the file, which must be a regular file.
+ * @param dir  Cache directory.
+ * @return  The index, or NULL if there is none to be had.
+ */
+LINE_INDEX *line_index_load(int fd, const char *dir) {
+    // a file that is no longer linked, such as a temporary one, will not be seen again
+    struct stat st;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_nlink == 0)
+        return NULL;
+
+    INDEX_HEADER h;
+    header_of(&h, &st);
+    char *path = cache_path(dir, &st, "");
+    if (path == NULL)
+        return NULL;
+    LINE_INDEX *ix = cache_read(path, &h);
+    if (ix == NULL){
+        ix = line_index_build(fd, st.st_size);
+        char *tmp = cache_path(dir, &st, ".tmp");
+        if (ix != NULL && tmp != NULL){
+            // a process id and a count of builds keep concurrent builders apart
+            static int builds = 0;
+            char *p = tmp;
+            while (*p != 0)
+                p++;
+            snprintf(p, 24, "%d.%d", (int) getpid(), __atomic_fetch_add(&builds, 1, __ATOMIC_RELAXED));
+            cache_write(path, tmp, &h, ix);
+        }
+        free(tmp);
+    }
+    free(path);
+    return ix;
+}
+
+void line_index_free(LINE_INDEX *ix) {
+    if (ix == NULL)
+        return;
+    budget_free(ix->offsets);
+    budget_free(ix);
+}
+
+/**
+ * @brief  Check that an offset found in an index is the start of a line.
+ * @details  A single byte is read, the one before the offset, which must
+ * be a newline.  This catches an index that no longer fits its file
+ * even though the file's time stamps and size say it should.
+ *
+ * @param fd  Descriptor of the indexed file, which must support pread().
+ * @return  1 if the offset starts a line, 0 if not.
+ */
+int line_index_check(int fd, long long offset) {
+    unsigned char c;
+    return offset == 0 || (pread(fd, &c, 1, offset - 1) == 1 && c == '\n');
+}
+
+/**
+ * @brief  Find the nearest indexed line at or before a given line.
+ *
+ * @param line  Line number, counting from 1.
+ * @param linep  Where to store the number of the indexed line.
+ * @return  Byte offset of the start of the indexed line.
+ */
+long long line_index_lookup(LINE_INDEX *ix, long long line, long long *linep) {
+    if (line > ix->lines)
+        line = ix->lines;
+    if (line < 1 || ix->count == 0){
+        *linep = 1;
+        return 0;
+    }
+    long long k = (line - 1) / LINE_INDEX_STRIDE;
+    if (k >= ix->count)
+        k = ix->count - 1;
+    *linep = 1 + k * LINE_INDEX_STRIDE;
+    return *(ix->offsets + k);
+}
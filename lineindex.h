@@ -0,0 +1,33 @@
+#ifndef LINEINDEX_H
+#define LINEINDEX_H
+
+/*
+ * Line-offset index of a file: the byte offset at which every
+ * LINE_INDEX_STRIDE-th line starts.  With it, the start of any line
+ * can be found by seeking to the nearest indexed line before it and
+ * scanning at most LINE_INDEX_STRIDE - 1 lines.
+ *
+ * Indexes are kept in a cache directory, one file per indexed file,
+ * named after its device and inode numbers.  A cached index is used
+ * only if the size, modification time and status change time recorded
+ * in it still match the file; otherwise it is rebuilt.  Even then,
+ * each offset is checked with line_index_check() before it is used.
+ */
+
+#define LINE_INDEX_STRIDE 64
+#define LINE_INDEX_MAGIC 0x3258444931464c46LL   // "FLF1IDX2" stored little-endian
+
+typedef struct line_index {
+    long long size;            // size of the indexed file
+    long long lines;           // number of lines that start in it
+    long long count;           // number of offsets
+    long long *offsets;        // offsets of lines 1, 1 + stride, 1 + 2 * stride, ...
+} LINE_INDEX;
+
+LINE_INDEX *line_index_load(int fd, const char *dir);
+LINE_INDEX *line_index_build(int fd, long long size);
+void line_index_free(LINE_INDEX *ix);
+long long line_index_lookup(LINE_INDEX *ix, long long line, long long *linep);
+int line_index_check(int fd, long long offset);
+
+#endif
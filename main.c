@@ -4,6 +4,16 @@
 #include "fliki.h"
 #include "global.h"
 #include "debug.h"
+#include "options.h"
+#include "compose.h"
+#include "daemon.h"
+#include "check.h"
+#include "cache.h"
+#include "budget.h"
+#include "merge.h"
+#include "stat.h"
+#include "output.h"
+#include "fanout.h"
 
 #ifdef _STRING_H
 #error "Do not #include <string.h>. You will get a ZERO."
@@ -33,18 +43,103 @@ int main(int argc, char **argv)
 
     // printf("\nGLOBAL OPTIONS: %ld", global_options);
 
+    budget_set((long long) mem_limit << 20);
 
 
-    FILE *diff_file = fopen(diff_filename, "r");
 
+    if (daemon_socket != NULL){
+        daemon_run(daemon_socket, daemon_workers);
+        return EXIT_FAILURE;
+    }
+
+    // the files after the diff are not diffs, but the files to patch with it
+    if (fanout_option){
+        FILE *diff = fopen(*diff_filenames, "r");
+        int d = fan_out(diff, diff_filenames + 1, diff_count - 1, fanout_dir, daemon_workers);
+        if (diff != NULL){
+            fclose(diff);
+        }
+        return d == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    FILE **diff_files = calloc(diff_count, sizeof(FILE *));
+    if (diff_files == NULL){
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < diff_count; i++){
+        *(diff_files + i) = fopen(*(diff_filenames + i), "r");
+    }
 
+    // with -o, the result goes to a new file that replaces the target only once complete
+    FILE *out = stdout;
+    OUTPUT output;
+    if (output_path != NULL){
+        long long size = 0;
+        if (output_codec == STREAM_PLAIN && diff_count == 1 && *diff_files != NULL &&
+            !stat_option && !compose_option){
+            size = output_estimate(stdin, *diff_files);
+        }
+        if (output_open(&output, output_path, size)){
+            if (!(global_options & QUIET_OPTION)){
+                perror(output_path);
+            }
+            output_path = NULL;
+            out = NULL;
+        }
+        else{
+            out = output.file;
+        }
+    }
 
-    int d = patch(stdin, stdout, diff_file);
+    int d;
+    if (out == NULL){
+        d = -1;
+    }
+    else if (stat_option){
+        d = diff_stat(*diff_files, out, stat_format);
+    }
+    else if (compose_option){
+        d = compose(diff_files, diff_count, out);
+    }
+    else if (merge_option){
+        d = patch_merge(stdin, out, *diff_files, *(diff_files + 1), *diff_filenames,
+                        *(diff_filenames + 1));
+    }
+    else if (verify_option){
+        d = patch_verify(stdin, out, *diff_files);
+    }
+    else if (cache_dir != NULL && diff_count == 1){
+        d = patch_cached(stdin, out, *diff_files, cache_dir, (long long) cache_size << 20);
+    }
+    else{
+        d = patch_chain(stdin, out, diff_files, diff_count);
+    }
     // printf("patch result: %d\n", d);
 
+    if (output_path != NULL){
+        // a merge with conflicts still has a result, with the conflicts marked
+        int done = d == 0 || (merge_option && d == MERGE_CONFLICT);
+        if (done && !(global_options & NO_PATCH_OPTION)){
+            if (output_publish(&output)){
+                if (!(global_options & QUIET_OPTION)){
+                    perror(output_path);
+                }
+                d = -1;
+            }
+        }
+        else{
+            output_discard(&output);
+        }
+    }
+
 
 
-    fclose(diff_file);
+    for (int i = 0; i < diff_count; i++){
+        if (*(diff_files + i) != NULL){
+            fclose(*(diff_files + i));
+        }
+    }
+    free(diff_files);
 
     if (d == 0){
         return EXIT_SUCCESS;
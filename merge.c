@@ -0,0 +1,556 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "fliki.h"
+#include "global.h"
+#include "debug.h"
+#include "options.h"
+#include "merge.h"
+#include "report.h"
+#include "budget.h"
+
+/*
+ * Positions in the original file are doubled, so that lines and the
+ * gaps between them can share one number line: line i is at 2i, and
+ * the gap after it at 2i + 1.  A hunk deleting lines s..e covers
+ * [2s, 2e], and one appending after line k covers [2k + 1, 2k + 1].
+ * Two hunks conflict if their closed ranges meet.
+ */
+
+typedef struct interval {
+    long lo;
+    long hi;
+} INTERVAL;
+
+/*
+ * An interval tree over ranges sorted by their low ends.  The tree is
+ * implicit in the sorted array: the root of the subtree over v[a..b)
+ * is v[(a + b) / 2], and max_hi of that index is the greatest high
+ * end in the subtree.
+ */
+typedef struct interval_tree {
+    INTERVAL *v;
+    long *max_hi;
+    int count;
+} INTERVAL_TREE;
+
+// a pair of conflicting hunks, one from each diff
+typedef struct overlap {
+    int ours;
+    int theirs;
+} OVERLAP;
+
+typedef struct merger {
+    DIFF *diffs[2];
+    INTERVAL *ranges[2];
+    int *parent;               // union-find over the hunks of both diffs, ours first
+    int *size;                 // number of hunks in the group of each root
+    OVERLAP *overlaps;
+    int overlap_count;
+    int overlap_size;
+} MERGER;
+
+static INTERVAL hunk_range(HUNK *hp) {
+    INTERVAL r;
+    if (hp->type == HUNK_APPEND_TYPE){
+        r.lo = r.hi = 2L * hp->old_start + 1;
+    }
+    else{
+        r.lo = 2L * hp->old_start;
+        r.hi = 2L * hp->old_end;
+    }
+    return r;
+}
+
+static long tree_build(INTERVAL_TREE *t, int a, int b) {
+    if (a >= b)
+        return -1;
+    int mid = a + (b - a) / 2;
+    long hi = (t->v + mid)->hi;
+    long left = tree_build(t, a, mid);
+    long right = tree_build(t, mid + 1, b);
+    if (left > hi)
+        hi = left;
+    if (right > hi)
+        hi = right;
+    *(t->max_hi + mid) = hi;
+    return hi;
+}
+
+static int find(MERGER *mp, int i) {
+    while (*(mp->parent + i) != i){
+        *(mp->parent + i) = *(mp->parent + *(mp->parent + i));
+        i = *(mp->parent + i);
+    }
+    return i;
+}
+
+static void join(MERGER *mp, int i, int j) {
+    i = find(mp, i);
+    j = find(mp, j);
+    // the root of a group is its hunk with the smallest index
+    if (i < j)
+        *(mp->parent + j) = i;
+    else
+        *(mp->parent + i) = j;
+}
+
+static int overlap_add(MERGER *mp, int ours, int theirs) {
+    if (mp->overlap_count == mp->overlap_size){
+        int size = mp->overlap_size ? mp->overlap_size * 2 : 64;
+        OVERLAP *v = budget_realloc(mp->overlaps, size * sizeof(OVERLAP));
+        if (v == NULL)
+            return -1;
+        mp->overlaps = v;
+        mp->overlap_size = size;
+    }
+    OVERLAP *op = mp->overlaps + mp->overlap_count++;
+    op->ours = ours;
+    op->theirs = theirs;
+    return 0;
+}
+
+// record every range in the subtree over v[a..b) that meets r as overlapping hunk ours
+static int tree_query(INTERVAL_TREE *t, int a, int b, INTERVAL r, MERGER *mp, int ours) {
+    if (a >= b)
+        return 0;
+    int mid = a + (b - a) / 2;
+    if (*(t->max_hi + mid) < r.lo)
+        return 0;
+    if (tree_query(t, a, mid, r, mp, ours))
+        return -1;
+    INTERVAL *vp = t->v + mid;
+    if (vp->lo > r.hi)
+        return 0;
+    if (vp->hi >= r.lo){
+        if (overlap_add(mp, ours, mid))
+            return -1;
+        join(mp, ours, mp->diffs[0]->hunk_count + mid);
+    }
+    return tree_query(t, mid + 1, b, r, mp, ours);
+}
+
+/*
+ * The ranges of the hunks of a diff.  If they are not in order and
+ * disjoint, NULL is returned and the serial number of the first hunk
+ * out of order is stored in errp; if memory runs out, ERR is.
+ */
+static INTERVAL *diff_ranges(DIFF *dp, int *errp) {
+    INTERVAL *v = budget_malloc((dp->hunk_count + 1) * sizeof(INTERVAL));
+    if (v == NULL){
+        *errp = ERR;
+        return NULL;
+    }
+    for (int i = 0; i < dp->hunk_count; i++){
+        *(v + i) = hunk_range(&(dp->hunks + i)->header);
+        if (i > 0 && (v + i)->lo <= (v + i - 1)->hi){
+            budget_free(v);
+            *errp = i + 1;
+            return NULL;
+        }
+    }
+    return v;
+}
+
+static int same_lines(DIFF *a, int i, DIFF *b, int j, int count) {
+    for (int k = 0; k < count; k++){
+        size_t n = DIFF_LINE_LENGTH(a, i + k);
+        if (n != DIFF_LINE_LENGTH(b, j + k))
+            return 0;
+        const char *p = DIFF_LINE_TEXT(a, i + k);
+        const char *q = DIFF_LINE_TEXT(b, j + k);
+        for (size_t c = 0; c < n; c++)
+            if (*(p + c) != *(q + c))
+                return 0;
+    }
+    return 1;
+}
+
+// whether two hunks make the same change
+static int same_hunk(DIFF *a, DIFF_HUNK *hp, DIFF *b, DIFF_HUNK *kp) {
+    return hp->header.type == kp->header.type && hp->header.old_start == kp->header.old_start &&
+           hp->header.old_end == kp->header.old_end &&
+           hp->deletion_count == kp->deletion_count && hp->addition_count == kp->addition_count &&
+           same_lines(a, hp->deletions, b, kp->deletions, hp->deletion_count) &&
+           same_lines(a, hp->additions, b, kp->additions, hp->addition_count);
+}
+
+static int copy_line(DIFF *result, DIFF *dp, int i) {
+    return diff_add_line(result, DIFF_LINE_TEXT(dp, i), DIFF_LINE_LENGTH(dp, i)) < 0 ? -1 : 0;
+}
+
+static int copy_lines(DIFF *result, DIFF *dp, int first, int count) {
+    for (int i = first; i < first + count; i++)
+        if (copy_line(result, dp, i))
+            return -1;
+    return 0;
+}
+
+/*
+ * Fill in the header of the hunk last added to the result, whose lines
+ * are in place, replacing lines old_start..old_end of the original (or
+ * appending after old_start if it deletes nothing).  delta is the
+ * number of lines by which the hunks before it have grown the file.
+ */
+static void finish_hunk(DIFF *result, int old_start, int old_end, long *deltap) {
+    DIFF_HUNK *hp = result->hunks + result->hunk_count - 1;
+    HUNK *h = &hp->header;
+    int del = hp->deletion_count, add = hp->addition_count;
+    h->old_start = old_start;
+    h->old_end = del == 0 ? old_start : old_end;
+    if (del == 0){
+        h->type = HUNK_APPEND_TYPE;
+        h->new_start = old_start + *deltap + 1;
+        h->new_end = h->new_start + add - 1;
+    }
+    else if (add == 0){
+        h->type = HUNK_DELETE_TYPE;
+        h->new_start = h->new_end = old_start - 1 + *deltap;
+    }
+    else{
+        h->type = HUNK_CHANGE_TYPE;
+        h->new_start = old_start + *deltap;
+        h->new_end = h->new_start + add - 1;
+    }
+    *deltap += add - del;
+}
+
+static int take_hunk(DIFF *result, DIFF *dp, DIFF_HUNK *kp, long *deltap) {
+    DIFF_HUNK *hp = diff_add_hunk(result);
+    if (hp == NULL || copy_lines(result, dp, kp->deletions, kp->deletion_count))
+        return -1;
+    hp->deletion_count = kp->deletion_count;
+    hp->additions = result->line_count;
+    if (copy_lines(result, dp, kp->additions, kp->addition_count))
+        return -1;
+    hp->addition_count = kp->addition_count;
+    finish_hunk(result, kp->header.old_start, kp->header.old_end, deltap);
+    return 0;
+}
+
+/*
+ * A group of conflicting hunks: hunks first[d]..last[d]-1 of each diff,
+ * together covering lines lo..hi of the original (none if hi < lo,
+ * when they all append after line hi).
+ */
+typedef struct conflict {
+    int first[2];
+    int last[2];
+    int lo;
+    int hi;
+} CONFLICT;
+
+// add the text of original line n, which some hunk of the group deletes
+static int add_original(DIFF *result, MERGER *mp, CONFLICT *cp, int n) {
+    for (int d = 0; d < 2; d++){
+        DIFF *dp = mp->diffs[d];
+        for (int i = cp->first[d]; i < cp->last[d]; i++){
+            DIFF_HUNK *kp = dp->hunks + i;
+            if (kp->header.type != HUNK_APPEND_TYPE && kp->header.old_start <= n &&
+                n <= kp->header.old_end)
+                return copy_line(result, dp, kp->deletions + n - kp->header.old_start);
+        }
+    }
+    return -1;
+}
+
+// add the lines of the group's range as diff d leaves them
+static int add_side(DIFF *result, MERGER *mp, CONFLICT *cp, int d, int *countp) {
+    DIFF *dp = mp->diffs[d];
+    int i = cp->first[d];
+    int n = cp->lo;
+    while (1){
+        DIFF_HUNK *kp = dp->hunks + i;
+        if (i < cp->last[d] && kp->header.type == HUNK_APPEND_TYPE &&
+            kp->header.old_start == n - 1){
+            if (copy_lines(result, dp, kp->additions, kp->addition_count))
+                return -1;
+            *countp += kp->addition_count;
+            i++;
+            continue;
+        }
+        if (n > cp->hi)
+            break;
+        if (i < cp->last[d] && kp->header.type != HUNK_APPEND_TYPE && kp->header.old_start == n){
+            if (copy_lines(result, dp, kp->additions, kp->addition_count))
+                return -1;
+            *countp += kp->addition_count;
+            n = kp->header.old_end + 1;
+            i++;
+        }
+        else{
+            if (add_original(result, mp, cp, n))
+                return -1;
+            (*countp)++;
+            n++;
+        }
+    }
+    return 0;
+}
+
+static int add_marker(DIFF *result, const char *marker, const char *name) {
+    char line[1100];
+    int n = name == NULL ? snprintf(line, sizeof(line), "%s\n", marker)
+                         : snprintf(line, sizeof(line), "%s %.1024s\n", marker, name);
+    return n < 0 || diff_add_line(result, line, n) < 0 ? -1 : 0;
+}
+
+static int take_conflict(DIFF *result, MERGER *mp, CONFLICT *cp, const char *our_name,
+                         const char *their_name, long *deltap) {
+    DIFF_HUNK *hp = diff_add_hunk(result);
+    if (hp == NULL)
+        return -1;
+    for (int n = cp->lo; n <= cp->hi; n++){
+        if (add_original(result, mp, cp, n))
+            return -1;
+        hp->deletion_count++;
+    }
+    hp->additions = result->line_count;
+    int count = 3;
+    if (add_marker(result, "<<<<<<<", our_name) || add_side(result, mp, cp, 0, &count) ||
+        add_marker(result, "=======", NULL) || add_side(result, mp, cp, 1, &count) ||
+        add_marker(result, ">>>>>>>", their_name))
+        return -1;
+    hp->addition_count = count;
+    finish_hunk(result, cp->hi < cp->lo ? cp->hi : cp->lo, cp->hi, deltap);
+    return 0;
+}
+
+static void put_header(HUNK *hp, char *buf, size_t size) {
+    STREAM *s = stream_open_buffer();
+    size_t len = 0;
+    if (s != NULL){
+        diff_write_header(hp, s);
+        unsigned char *bytes = stream_contents(s, &len);
+        if (len >= size)
+            len = size - 1;
+        for (size_t i = 0; i < len; i++)
+            *(buf + i) = *(bytes + i);
+    }
+    *(buf + len) = 0;
+    stream_close(s);
+}
+
+// report that two hunks conflict, at the first line of their group
+static void report_overlap(MERGER *mp, OVERLAP *op, int line) {
+    HUNK *ours = &(mp->diffs[0]->hunks + op->ours)->header;
+    HUNK *theirs = &(mp->diffs[1]->hunks + op->theirs)->header;
+    char ours_text[64], theirs_text[64], message[256];
+    put_header(ours, ours_text, sizeof(ours_text));
+    put_header(theirs, theirs_text, sizeof(theirs_text));
+    snprintf(message, sizeof(message), "hunk %d (%s) of diff 1 conflicts with hunk %d (%s) of diff 2",
+             ours->serial, ours_text, theirs->serial, theirs_text);
+    if (error_format == ERROR_FORMAT_JSON){
+        HUNK_FAILURE f;
+        report_init(&f);
+        f.error = "conflict";
+        f.message = message;
+        f.hunk = *ours;
+        f.has_hunk = 1;
+        f.line = line;
+        report_write(&f, stderr);
+    }
+    else{
+        fprintf(stderr, "%s\n", message);
+    }
+}
+
+/**
+ * @brief  Merge two diffs made against the same original.
+ * @details  See merge.h.  Unless quiet mode is in effect, each pair of
+ * conflicting hunks is reported on stderr, in the format given by
+ * --error-format.
+ *
+ * @param ours  The first diff.
+ * @param theirs  The second diff.
+ * @param our_name  Name shown after the marker opening a conflict.
+ * @param their_name  Name shown after the marker closing a conflict.
+ * @param result  An initialized DIFF, to which the merged diff is added.
+ * @return  0 if the diffs were merged without conflicts, MERGE_CONFLICT
+ * if there were conflicts, ERR if memory ran out, or -(65536 * d + s)
+ * if hunk s of diff d is out of order, so that the diff cannot apply.
+ */
+int merge_diffs(DIFF *ours, DIFF *theirs, const char *our_name, const char *their_name,
+                DIFF *result) {
+    MERGER m;
+    m.diffs[0] = ours;
+    m.diffs[1] = theirs;
+    m.overlaps = NULL;
+    m.overlap_count = m.overlap_size = 0;
+    int total = ours->hunk_count + theirs->hunk_count;
+    int err = 0;
+    m.ranges[0] = diff_ranges(ours, &err);
+    if (err != 0)
+        return err == ERR ? ERR : -(65536 + err);
+    m.ranges[1] = diff_ranges(theirs, &err);
+    if (err != 0){
+        budget_free(m.ranges[0]);
+        return err == ERR ? ERR : -(2 * 65536 + err);
+    }
+    INTERVAL_TREE tree;
+    tree.v = m.ranges[1];
+    tree.count = theirs->hunk_count;
+    tree.max_hi = budget_malloc((tree.count + 1) * sizeof(long));
+    m.parent = budget_malloc((total + 1) * sizeof(int));
+    m.size = budget_calloc(total + 1, sizeof(int));
+    if (tree.max_hi == NULL || m.parent == NULL || m.size == NULL)
+        err = ERR;
+
+    if (!err){
+        for (int i = 0; i < total; i++)
+            *(m.parent + i) = i;
+        tree_build(&tree, 0, tree.count);
+        for (int i = 0; i < ours->hunk_count && !err; i++)
+            if (tree_query(&tree, 0, tree.count, *(m.ranges[0] + i), &m, i))
+                err = ERR;
+        for (int i = 0; i < total; i++)
+            (*(m.size + find(&m, i)))++;
+    }
+
+    // take hunks and groups of conflicting hunks in order of position
+    long delta = 0;
+    int i = 0, j = 0;
+    int conflicts = 0;
+    int k = 0;                 // next overlap to report
+    while (!err && (i < ours->hunk_count || j < theirs->hunk_count)){
+        int d = j >= theirs->hunk_count ||
+                (i < ours->hunk_count && (m.ranges[0] + i)->lo <= (m.ranges[1] + j)->lo) ? 0 : 1;
+        int root = find(&m, d == 0 ? i : ours->hunk_count + j);
+        if (*(m.size + root) == 1){
+            // a hunk that conflicts with nothing
+            if (d == 0)
+                err = take_hunk(result, ours, ours->hunks + i++, &delta);
+            else
+                err = take_hunk(result, theirs, theirs->hunks + j++, &delta);
+            continue;
+        }
+
+        // the group is the hunks of each diff from here on that have the same root
+        CONFLICT c;
+        c.first[0] = i;
+        c.first[1] = j;
+        while (i < ours->hunk_count && find(&m, i) == root)
+            i++;
+        while (j < theirs->hunk_count && find(&m, ours->hunk_count + j) == root)
+            j++;
+        c.last[0] = i;
+        c.last[1] = j;
+        long lo = (m.ranges[d] + c.first[d])->lo;
+        long hi = lo;
+        for (int e = 0; e < 2; e++)
+            for (int h = c.first[e]; h < c.last[e]; h++)
+                if ((m.ranges[e] + h)->hi > hi)
+                    hi = (m.ranges[e] + h)->hi;
+        c.lo = (lo + 1) / 2;
+        c.hi = hi / 2;
+
+        // a change made by both diffs alike is taken once
+        if (c.last[0] - c.first[0] == 1 && c.last[1] - c.first[1] == 1 &&
+            same_hunk(ours, ours->hunks + c.first[0], theirs, theirs->hunks + c.first[1])){
+            err = take_hunk(result, ours, ours->hunks + c.first[0], &delta);
+            while (k < m.overlap_count && (m.overlaps + k)->ours < i)
+                k++;
+            continue;
+        }
+
+        conflicts++;
+        if (!(global_options & QUIET_OPTION))
+            for (; k < m.overlap_count && (m.overlaps + k)->ours < i; k++)
+                report_overlap(&m, m.overlaps + k, c.hi < c.lo ? c.hi + 1 : c.lo);
+        err = take_conflict(result, &m, &c, our_name, their_name, &delta);
+    }
+
+    budget_free(m.ranges[0]);
+    budget_free(m.ranges[1]);
+    budget_free(tree.max_hi);
+    budget_free(m.parent);
+    budget_free(m.size);
+    budget_free(m.overlaps);
+    if (err)
+        return ERR;
+    return conflicts ? MERGE_CONFLICT : 0;
+}
+
+// read diff k (counting from 1), returning 0, -1 if it is ill-formed, or ERR if memory ran out
+static int read_diff(FILE *f, int k, DIFF *dp) {
+    long refused = budget_refusals();
+    STREAM *s = stream_open_reader(f);
+    int err = 0;
+    if (s == NULL || diff_read(dp, s) || s->error){
+        if (budget_refusals() != refused){
+            err = ERR;
+        }
+        else{
+            long long offset;
+            const char *why = hunk_error(&offset);
+            if (!(global_options & QUIET_OPTION)){
+                if (why != NULL)
+                    fprintf(stderr, "diff %d is ill-formed at byte %lld: %s\n", k, offset, why);
+                else
+                    fprintf(stderr, "diff %d is ill-formed at hunk %d\n", k, dp->hunk_count);
+            }
+            err = -1;
+        }
+    }
+    stream_close(s);
+    return err;
+}
+
+/**
+ * @brief  Patch a file with the merge of two diffs made against it.
+ * @details  The diffs are merged in memory with merge_diffs(), and the
+ * merged diff is applied to the input in a single pass.  Conflicting
+ * hunks leave both versions of the lines they change in the output,
+ * between conflict markers.
+ *
+ * @return  0 on success, MERGE_CONFLICT if the output was written but
+ * has conflicts, -1 if there were errors.
+ */
+int patch_merge(FILE *in, FILE *out, FILE *ours, FILE *theirs, const char *our_name,
+                const char *their_name) {
+    if (in == NULL || out == NULL || ours == NULL || theirs == NULL)
+        return -1;
+    DIFF diffs[2], merged;
+    diff_init(diffs);
+    diff_init(diffs + 1);
+    diff_init(&merged);
+    int result = read_diff(ours, 1, diffs);
+    if (result == 0)
+        result = read_diff(theirs, 2, diffs + 1);
+    if (result == 0){
+        result = merge_diffs(diffs, diffs + 1, our_name, their_name, &merged);
+        if (result < 0 && result != ERR && !(global_options & QUIET_OPTION))
+            fprintf(stderr, "hunk %d of diff %d is out of order\n", -result % 65536, -result / 65536);
+    }
+    if (result == ERR && !(global_options & QUIET_OPTION))
+        fprintf(stderr, "out of memory while merging diffs\n");
+    diff_free(diffs);
+    diff_free(diffs + 1);
+
+    STREAM *text = NULL;
+    if (result >= 0){
+        STREAM *buffer = stream_open_buffer();
+        if (buffer != NULL && diff_write(&merged, buffer) == 0){
+            size_t len;
+            unsigned char *data = stream_contents(buffer, &len);
+            text = stream_open_memory(data, len);
+        }
+        stream_close(buffer);
+    }
+    diff_free(&merged);
+    if (result < 0 || text == NULL){
+        stream_close(text);
+        return -1;
+    }
+
+    STREAM *in_stream = stream_open_reader(in);
+    STREAM *out_stream = stream_open_writer(out, output_codec, output_level, output_threads);
+    int patched = -1;
+    if (in_stream != NULL && out_stream != NULL)
+        patched = patch_stream(in_stream, out_stream, text, global_options);
+    if (stream_close(out_stream) || in_stream == NULL || in_stream->error)
+        patched = -1;
+    stream_close(in_stream);
+    stream_close(text);
+    return patched ? -1 : result;
+}
@@ -0,0 +1,37 @@
+#ifndef MERGE_H
+#define MERGE_H
+
+#include <stdio.h>
+
+#include "diff.h"
+
+/*
+ * Three-way merge of two diffs made against the same original file.
+ *
+ * The hunks of each diff cover a range of the original: the lines
+ * they delete, or for an append the gap after a line.  Hunks of the
+ * two diffs whose ranges overlap conflict; all others are taken from
+ * whichever diff they belong to, a hunk made by both diffs alike being
+ * taken once.  The result is a single diff, applied to the original
+ * in one pass.  Each group of conflicting hunks becomes one hunk of
+ * the result that replaces the lines of the original they cover with
+ * both versions of them between conflict markers:
+ *
+ *   <<<<<<< first diff
+ *   the lines as the first diff leaves them
+ *   =======
+ *   the lines as the second diff leaves them
+ *   >>>>>>> second diff
+ *
+ * To find the overlaps, the ranges of the second diff are put in an
+ * interval tree, and queried with each range of the first.
+ */
+
+#define MERGE_CONFLICT 1       // returned when conflicts were found
+
+int merge_diffs(DIFF *ours, DIFF *theirs, const char *our_name, const char *their_name,
+                DIFF *result);
+int patch_merge(FILE *in, FILE *out, FILE *ours, FILE *theirs, const char *our_name,
+                const char *their_name);
+
+#endif
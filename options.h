@@ -0,0 +1,64 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+/*
+ * Program options that take a value, and so do not fit in the bits
+ * of global_options.  They are given as long options of the form
+ * "--name" or "--name=value", set by validargs(), and keep their
+ * default values if not specified.
+ */
+
+extern int output_codec;     // STREAM_CODEC used to compress the output
+extern int output_level;     // compression level, 0 for the codec's default
+extern int output_threads;   // compression worker threads, 0 for none
+
+/*
+ * More than one diff file may be given, in which case they are taken
+ * to form a chain, each applying to the output of the one before it.
+ * diff_filename is the first of them.
+ */
+extern char **diff_filenames;
+extern char *output_path;    // replace this file with the result (see output.h), or NULL for stdout
+extern int diff_count;
+extern int compose_option;   // write the composed chain instead of patching
+extern int merge_option;     // the two diffs are made against the input, to be merged
+extern int stat_option;      // write statistics of the diff instead of patching
+extern int stat_format;      // STAT_FORMAT of the statistics
+
+extern int fanout_option;    // the first file is a diff to apply to each of the rest
+extern char *fanout_dir;     // write the results of fan-out here, or NULL to replace the files
+
+extern char *daemon_socket;  // serve requests on this socket instead (no diff file)
+extern int daemon_workers;   // worker threads for the service or fan-out, 0 for the default
+
+extern char *line_index_dir; // cache line-offset indexes of the input here, or NULL
+extern int verify_option;    // check the engine against the reference implementation
+extern int error_format;     // ERROR_FORMAT in which patch failures are reported
+
+/*
+ * Further bits of global_options (and of the options passed to
+ * patch_stream()), beyond those in global.h.  They make the lines
+ * being deleted match the input even when the two differ in the given
+ * ways.
+ */
+#define IGNORE_CR_OPTION 0x10           // carriage returns at the end of a line
+#define IGNORE_TRAILING_WS_OPTION 0x20  // spaces, tabs and carriage returns at the end of a line
+#define IGNORE_ALL_WS_OPTION 0x40       // spaces, tabs and carriage returns anywhere
+#define IGNORE_OPTIONS (IGNORE_CR_OPTION | IGNORE_TRAILING_WS_OPTION | IGNORE_ALL_WS_OPTION)
+
+/*
+ * More bits, which hold back the output of patch_stream() (see
+ * stream_hold()) so that what is written is never the partial result
+ * of a hunk that failed: until each hunk has applied, or until the
+ * whole diff has.
+ */
+#define TRANSACTION_HUNK_OPTION 0x80
+#define TRANSACTION_ALL_OPTION 0x100
+#define TRANSACTION_OPTIONS (TRANSACTION_HUNK_OPTION | TRANSACTION_ALL_OPTION)
+
+extern char *cache_dir;      // keep results of patching here for reuse, or NULL
+extern int cache_size;       // megabytes the cached results may take up
+
+extern int mem_limit;        // megabytes of memory budget (see budget.h), 0 for no limit
+
+#endif
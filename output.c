@@ -0,0 +1,269 @@
+#define _GNU_SOURCE            // O_TMPFILE, fallocate(), sync_file_range()
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "fliki.h"
+#include "global.h"
+#include "debug.h"
+#include "output.h"
+
+/*
+ * Atomic output files.  See output.h.
+ */
+
+#define OUTPUT_TEMP_TRIES 100  // names tried for a temporary file
+
+static long temp_serial = 0;
+
+// a thread waiting for its file to be flushed
+typedef struct sync_waiter {
+    int fd;
+    int done;                  // set, under sync_lock, once result is known
+    int result;
+    int flushed;               // fdatasync() was called on fd by the leader of the batch
+    dev_t dev;                 // the file, to find it asked for twice in a batch
+    ino_t ino;
+    struct sync_waiter *next;
+} SYNC_WAITER;
+
+static SYNC_WAITER *sync_pending = NULL;
+static int sync_busy = 0;
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_done = PTHREAD_COND_INITIALIZER;
+
+/**
+ * @brief  Estimate the size of the result of patching.
+ * @details  The estimate is the size of the rest of the input plus that
+ * of the rest of the diff, which is more than the diff can add.  Nothing
+ * is read: the space reserved but not used is given back when the
+ * result is published, so it is better to overestimate than to make a
+ * second pass over the diff.
+ *
+ * @return  The estimate in bytes, or 0 if the input is not a regular file.
+ */
+long long output_estimate(FILE *in, FILE *diff) {
+    struct stat st;
+    if (fstat(fileno(in), &st) || !S_ISREG(st.st_mode))
+        return 0;
+    long long at = lseek(fileno(in), 0, SEEK_CUR);
+    long long size = st.st_size - (at > 0 ? at : 0);
+
+    long long diff_at = ftello(diff);
+    if (diff_at >= 0 && fstat(fileno(diff), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > diff_at)
+        size += st.st_size - diff_at;
+    return size > 0 ? size : 0;
+}
+
+// create a hidden temporary file in the target's directory, recording its name
+static int open_temp(OUTPUT *op, mode_t mode) {
+    for (int i = 0; i < OUTPUT_TEMP_TRIES; i++){
+        snprintf(op->temp, sizeof(op->temp), ".%.200s.%ld.%ld", op->name, (long) getpid(),
+                 __atomic_add_fetch(&temp_serial, 1, __ATOMIC_RELAXED));
+        int fd = openat(op->dir, op->temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+        if (fd >= 0 || errno != EEXIST){
+            if (fd < 0)
+                *op->temp = 0;
+            return fd;
+        }
+    }
+    *op->temp = 0;
+    return -1;
+}
+
+/**
+ * @brief  Start writing a file that is to replace the target.
+ * @details  The new file has the permissions of the target if it
+ * exists, otherwise those of a newly created file.
+ *
+ * @param op  Where to keep track of the file.
+ * @param target  Path of the file to be replaced or created.
+ * @param size  Bytes of space to reserve for the result, or 0.
+ * @return  0 on success, with the file to write in op->file, or -1.
+ */
+int output_open(OUTPUT *op, const char *target, long long size) {
+    op->file = NULL;
+    op->dir = -1;
+    *op->temp = 0;
+    op->reserved = 0;
+
+    const char *slash = NULL;
+    for (const char *p = target; *p != 0; p++)
+        if (*p == '/')
+            slash = p;
+    op->name = slash == NULL ? target : slash + 1;
+    if (*op->name == 0 || (slash != NULL && slash - target >= OUTPUT_PATH_MAX))
+        return -1;
+    char dir[OUTPUT_PATH_MAX];
+    if (slash == NULL){
+        *dir = '.';
+        *(dir + 1) = 0;
+    }
+    else{
+        long n = slash == target ? 1 : slash - target;
+        for (long i = 0; i < n; i++)
+            *(dir + i) = *(target + i);
+        *(dir + n) = 0;
+    }
+    op->dir = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (op->dir < 0)
+        return -1;
+
+    struct stat st;
+    int exists = fstatat(op->dir, op->name, &st, 0) == 0;
+    mode_t mode = exists ? st.st_mode & 07777 : 0666;
+    int fd = openat(op->dir, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, mode);
+    if (fd < 0)
+        fd = open_temp(op, mode);
+    // the umask applied on creation did not apply to the file being replaced
+    if (fd >= 0 && exists)
+        fchmod(fd, mode);
+    if (fd >= 0 && size > 0 && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) == 0)
+        op->reserved = size;
+    op->file = fd < 0 ? NULL : fdopen(fd, "w");
+    if (op->file == NULL){
+        if (fd >= 0)
+            close(fd);
+        output_discard(op);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Flush the files of a batch of waiters.  Writeback of every regular
+ * file is started first, so that the device gets the whole batch at
+ * once, and only then is each one waited for with fdatasync().  The
+ * same file or directory asked for more than once, as the directory
+ * of several results usually is, is flushed once.
+ */
+static void sync_batch(SYNC_WAITER *batch) {
+    for (SYNC_WAITER *w = batch; w != NULL; w = w->next){
+        struct stat st;
+        w->flushed = 0;
+        w->result = fstat(w->fd, &st) ? -1 : 0;
+        w->dev = st.st_dev;
+        w->ino = st.st_ino;
+        if (w->result == 0 && S_ISREG(st.st_mode))
+            sync_file_range(w->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+    }
+    for (SYNC_WAITER *w = batch; w != NULL; w = w->next){
+        if (w->result)
+            continue;
+        SYNC_WAITER *v = batch;
+        while (v != w && !(v->flushed && v->dev == w->dev && v->ino == w->ino))
+            v = v->next;
+        if (v != w){
+            w->result = v->result;
+            continue;
+        }
+        w->result = fdatasync(w->fd) ? -1 : 0;
+        w->flushed = 1;
+    }
+}
+
+/**
+ * @brief  Flush a file (or directory) to disk.
+ * @details  Threads flushing at the same time share the work: see
+ * output.h.
+ *
+ * @return  0 on success, -1 on failure.
+ */
+int output_sync(int fd) {
+    SYNC_WAITER self;
+    self.fd = fd;
+    self.done = 0;
+    self.result = 0;
+    pthread_mutex_lock(&sync_lock);
+    self.next = sync_pending;
+    sync_pending = &self;
+    while (!self.done){
+        if (sync_busy){
+            pthread_cond_wait(&sync_done, &sync_lock);
+            continue;
+        }
+        // flush everything that is waiting, including this file
+        sync_busy = 1;
+        SYNC_WAITER *batch = sync_pending;
+        sync_pending = NULL;
+        pthread_mutex_unlock(&sync_lock);
+        sync_batch(batch);
+        pthread_mutex_lock(&sync_lock);
+        for (SYNC_WAITER *w = batch; w != NULL; w = w->next)
+            w->done = 1;
+        sync_busy = 0;
+        pthread_cond_broadcast(&sync_done);
+    }
+    pthread_mutex_unlock(&sync_lock);
+    return self.result;
+}
+
+// give an unnamed file the target's name
+static int link_unnamed(OUTPUT *op, int fd) {
+    char proc[64];
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+    if (linkat(AT_FDCWD, proc, op->dir, op->name, AT_SYMLINK_FOLLOW) == 0)
+        return 0;
+    if (errno != EEXIST)
+        return -1;
+    // the target exists: link under a temporary name, and rename that over it
+    for (int i = 0; i < OUTPUT_TEMP_TRIES; i++){
+        snprintf(op->temp, sizeof(op->temp), ".%.200s.%ld.%ld", op->name, (long) getpid(),
+                 __atomic_add_fetch(&temp_serial, 1, __ATOMIC_RELAXED));
+        if (linkat(AT_FDCWD, proc, op->dir, op->temp, AT_SYMLINK_FOLLOW) == 0)
+            return renameat(op->dir, op->temp, op->dir, op->name) ? -1 : 0;
+        if (errno != EEXIST)
+            break;
+    }
+    *op->temp = 0;
+    return -1;
+}
+
+/**
+ * @brief  Replace the target with the file written.
+ * @details  The file is flushed to disk before it takes the target's
+ * name, and the directory after.  Either way, op is finished with.
+ *
+ * @return  0 on success, -1 on failure, in which case the target is
+ * left as it was.
+ */
+int output_publish(OUTPUT *op) {
+    int fd = fileno(op->file);
+    int result = fflush(op->file) || ferror(op->file) ? -1 : 0;
+    // give back the reserved space not used
+    struct stat st;
+    if (result == 0 && op->reserved > 0 &&
+        (fstat(fd, &st) || (st.st_size < op->reserved && ftruncate(fd, st.st_size))))
+        result = -1;
+    if (result == 0)
+        result = output_sync(fd);
+    if (result == 0)
+        result = *op->temp != 0 ? (renameat(op->dir, op->temp, op->dir, op->name) ? -1 : 0)
+                                : link_unnamed(op, fd);
+    if (result == 0){
+        *op->temp = 0;
+        result = output_sync(op->dir);
+    }
+    output_discard(op);
+    return result;
+}
+
+/**
+ * @brief  Abandon the file written, leaving the target as it was.
+ */
+void output_discard(OUTPUT *op) {
+    if (op->file != NULL)
+        fclose(op->file);
+    if (*op->temp != 0)
+        unlinkat(op->dir, op->temp, 0);
+    if (op->dir >= 0)
+        close(op->dir);
+    op->file = NULL;
+    op->dir = -1;
+    *op->temp = 0;
+}
@@ -0,0 +1,43 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdio.h>
+
+/*
+ * Atomic replacement of an output file.
+ *
+ * The result is written to a file in the same directory as the
+ * target: an unnamed O_TMPFILE where the file system supports it,
+ * otherwise a hidden temporary file.  Space for the expected size is
+ * reserved up front.  Only once the result is complete is it flushed
+ * to disk and given the target's name, with linkat() or rename(), so
+ * the target is at all times either the old file or the whole new
+ * one.  If patching fails, the target is left alone.
+ *
+ * Flushing to disk is shared between threads: a thread that asks for
+ * a flush while another is in progress waits for it to finish, and
+ * the files of all the threads that asked meanwhile are then flushed
+ * as one batch.  Writeback of all of them is started before any is
+ * waited for with fdatasync(), so their data goes to the device
+ * together, and a directory that several of them were published in is
+ * flushed only once.  Only those files are flushed, never the rest of
+ * the file system.
+ */
+
+#define OUTPUT_PATH_MAX 4096
+
+typedef struct output {
+    FILE *file;                // the result is written here
+    int dir;                   // the directory of the target
+    const char *name;          // the last component of the target
+    char temp[256];            // name of the temporary file in dir, empty if unnamed
+    long long reserved;        // bytes of space reserved
+} OUTPUT;
+
+long long output_estimate(FILE *in, FILE *diff);
+int output_open(OUTPUT *op, const char *target, long long size);
+int output_publish(OUTPUT *op);
+void output_discard(OUTPUT *op);
+int output_sync(int fd);
+
+#endif
@@ -0,0 +1,318 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+
+#include "fliki.h"
+#include "global.h"
+#include "debug.h"
+#include "reference.h"
+
+/*
+ * The reference implementation.  See reference.h.
+ */
+
+void reference_init(REFERENCE *r, const unsigned char *diff, size_t len) {
+    r->diff = diff;
+    r->diff_len = len;
+    r->diff_pos = 0;
+    r->fresh = 1;
+    r->bol = 0;
+    r->cat = 'n';
+    r->expected = 'n';
+    r->last = 0;
+    r->newline_made_up = 0;
+    r->eos_pending = 0;
+}
+
+// the byte k bytes ahead in the diff, or EOF
+static int peek(REFERENCE *r, size_t k) {
+    return r->diff_pos + k < r->diff_len ? *(r->diff + r->diff_pos + k) : EOF;
+}
+
+// the next byte of a header that starts at start, or ERR if the header is too long
+static int header_peek(REFERENCE *r, size_t start) {
+    if (r->diff_pos - start >= HUNK_HEADER_MAX)
+        return ERR;
+    return peek(r, 0);
+}
+
+// read one number of a header; returns 0, or EOF or ERR
+static int header_num(REFERENCE *r, size_t start, int *nump) {
+    long long num = 0;
+    int digits = 0;
+    int c;
+    while ((c = header_peek(r, start)) >= '0' && c <= '9'){
+        num = num * 10 + (c - '0');
+        if (num > INT_MAX)
+            return ERR;
+        digits++;
+        r->diff_pos++;
+    }
+    if (digits == 0)
+        return c == EOF ? EOF : ERR;
+    *nump = num;
+    return 0;
+}
+
+// read a range "n" or "n,m" of a header; returns 0, or EOF or ERR
+static int header_range(REFERENCE *r, size_t start, int *startp, int *endp) {
+    int result = header_num(r, start, startp);
+    if (result)
+        return result;
+    *endp = *startp;
+    if (header_peek(r, start) == ','){
+        r->diff_pos++;
+        return header_num(r, start, endp);
+    }
+    return 0;
+}
+
+/**
+ * @brief  Reference version of hunk_next().
+ * @details  The rest of the current hunk is skipped by reading it with
+ * reference_hunk_getc() up to the first ERR, and the header that
+ * follows is parsed.
+ */
+int reference_hunk_next(REFERENCE *r, HUNK *hp) {
+    while (reference_hunk_getc(r, hp) != ERR)
+        ;
+    r->fresh = 1;
+    hp->serial++;
+
+    size_t start = r->diff_pos;
+    int result = header_range(r, start, &hp->old_start, &hp->old_end);
+    if (result)
+        return result;
+    switch (header_peek(r, start)){
+        case 'a':
+            hp->type = HUNK_APPEND_TYPE;
+            break;
+        case 'd':
+            hp->type = HUNK_DELETE_TYPE;
+            break;
+        case 'c':
+            hp->type = HUNK_CHANGE_TYPE;
+            break;
+        case EOF:
+            return EOF;
+        default:
+            return ERR;
+    }
+    r->diff_pos++;
+    result = header_range(r, start, &hp->new_start, &hp->new_end);
+    if (result)
+        return result;
+    if (header_peek(r, start) != '\n')
+        return ERR;
+    r->diff_pos++;
+    if (hp->old_end < hp->old_start || hp->new_end < hp->new_start)
+        return ERR;
+    return 0;
+}
+
+static int next_char(REFERENCE *r, HUNK *hp) {
+    if (r->fresh){
+        r->fresh = 0;
+        r->bol = 1;
+        r->expected = 'n';
+        r->cat = 'n';
+    }
+    if (r->expected == 'n'){
+        if (hp->type == HUNK_APPEND_TYPE)
+            r->expected = 'a';
+        else if (hp->type == HUNK_DELETE_TYPE || hp->type == HUNK_CHANGE_TYPE)
+            r->expected = 'd';
+        else
+            return ERR;
+    }
+
+    while (r->bol){
+        r->bol = 0;
+        int c1 = peek(r, 0);
+        int c2 = peek(r, 1);
+        if (c1 == '<'){
+            if (c2 != ' ')
+                return ERR;
+            r->diff_pos += 2;
+            if (r->expected != 'd')
+                return ERR;
+            if (r->cat == 'a'){
+                r->cat = 'd';
+                return EOS;
+            }
+            r->cat = 'd';
+        }
+        else if (c1 == '>'){
+            if (r->expected != 'a'){
+                r->diff_pos += c2 == EOF ? 1 : 2;
+                return ERR;
+            }
+            if (c2 != ' ')
+                return ERR;
+            r->diff_pos += 2;
+            if (r->cat == 'd'){
+                r->cat = 'a';
+                return EOS;
+            }
+            r->cat = 'a';
+        }
+        else if (c1 == '-'){
+            if (c2 != '-' || peek(r, 2) != '-' || peek(r, 3) != '\n')
+                return ERR;
+            r->diff_pos += 4;
+            if (hp->type != HUNK_CHANGE_TYPE)
+                return ERR;
+            r->expected = 'a';
+            r->bol = 1;
+        }
+        else{
+            // the end of the hunk
+            r->bol = 1;
+            if (r->cat != 'n'){
+                r->cat = 'n';
+                return EOS;
+            }
+            return ERR;
+        }
+    }
+
+    if (r->diff_pos == r->diff_len){
+        // a diff that does not end in a newline is given one, once
+        if (r->last != '\n' && !r->newline_made_up){
+            r->newline_made_up = 1;
+            r->eos_pending = 1;
+            return '\n';
+        }
+        if (r->eos_pending){
+            r->eos_pending = 0;
+            return EOS;
+        }
+        return ERR;
+    }
+    int c = *(r->diff + r->diff_pos++);
+    if (c == '\n')
+        r->bol = 1;
+    return c;
+}
+
+/**
+ * @brief  Reference version of hunk_getc().
+ */
+int reference_hunk_getc(REFERENCE *r, HUNK *hp) {
+    r->last = next_char(r, hp);
+    return r->last;
+}
+
+typedef struct ref_input {
+    const unsigned char *data;
+    size_t len;
+    size_t pos;
+    int at_newline;            // the last byte copied or matched was a newline
+    STREAM *out;
+} REF_INPUT;
+
+// copy a line of the input; returns 0, or EOF if the input ended first
+static int copy_line(REF_INPUT *in) {
+    while (in->pos < in->len){
+        int c = *(in->data + in->pos++);
+        stream_putc(c, in->out);
+        if (c == '\n'){
+            in->at_newline = 1;
+            return 0;
+        }
+    }
+    return EOF;
+}
+
+// match a deleted character against the input; returns 0 if it matches
+static int match(REF_INPUT *in, int c) {
+    if (in->pos == in->len){
+        // an input that lacks a final newline matches the one it would have had
+        if (c == '\n' && !in->at_newline){
+            in->at_newline = 1;
+            return 0;
+        }
+        return -1;
+    }
+    if (*(in->data + in->pos++) != c)
+        return -1;
+    in->at_newline = c == '\n';
+    return 0;
+}
+
+/**
+ * @brief  Reference version of patch().
+ * @details  The output is always written; there are no options.
+ *
+ * @return  0 if the diff applies, -1 if not.
+ */
+int reference_patch(const unsigned char *in_data, size_t in_len,
+                    const unsigned char *diff, size_t diff_len, STREAM *out) {
+    REFERENCE r;
+    reference_init(&r, diff, diff_len);
+    REF_INPUT in = { in_data, in_len, 0, 0, out };
+    int old_line = 1;
+    int new_line = 1;
+
+    HUNK hunk;
+    hunk.serial = 0;
+    hunk.type = HUNK_NO_TYPE;
+    int result;
+    while ((result = reference_hunk_next(&r, &hunk)) == 0){
+        int change = hunk.type == HUNK_CHANGE_TYPE;
+        int seen_eos = 0;
+        int complete = 0;
+        while (1){
+            int c = reference_hunk_getc(&r, &hunk);
+            if (c == ERR){
+                // the data of a hunk ends with EOS, then ERR
+                complete = seen_eos;
+                break;
+            }
+            if (c == EOS){
+                seen_eos = 1;
+                continue;
+            }
+            int stop = 0;
+            if (r.cat == 'a'){
+                // lines up to and including old_start come before an append
+                while (!change && old_line <= hunk.old_start){
+                    if (copy_line(&in) == EOF){
+                        stop = 1;
+                        break;
+                    }
+                    old_line++;
+                    new_line++;
+                }
+                stream_putc(c, out);
+                if (c == '\n')
+                    new_line++;
+            }
+            else if (r.cat == 'd'){
+                // lines before old_start come before a deletion
+                while (old_line < hunk.old_start){
+                    if (copy_line(&in) == EOF){
+                        stop = 1;
+                        break;
+                    }
+                    old_line++;
+                    new_line++;
+                }
+                if (!stop && match(&in, c))
+                    stop = 1;
+                if (!stop && c == '\n')
+                    old_line++;
+            }
+            if (stop)
+                break;
+        }
+        if (!complete || old_line != hunk.old_end + 1 || new_line != hunk.new_end + 1)
+            return -1;
+    }
+    if (result != EOF)
+        return -1;
+
+    while (in.pos < in.len)
+        stream_putc(*(in.data + in.pos++), out);
+    return 0;
+}
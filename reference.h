@@ -0,0 +1,40 @@
+#ifndef REFERENCE_H
+#define REFERENCE_H
+
+#include <stddef.h>
+
+#include "fliki.h"
+#include "stream.h"
+
+/*
+ * Reference implementation of hunk_next(), hunk_getc() and patch().
+ *
+ * It reads the diff and the input from memory a byte at a time and
+ * follows the rules of the original engine as directly as it can:
+ * no buffering, spans, line indexes or word-at-a-time scanning.  Its
+ * only purpose is to be compared against the real engine (see
+ * check.h), so it is written to be obviously right rather than fast.
+ * All of its state is in a REFERENCE, so runs cannot affect each
+ * other.
+ */
+
+typedef struct reference {
+    const unsigned char *diff;
+    size_t diff_len;
+    size_t diff_pos;
+    int fresh;                 // a header was just read, or none yet
+    int bol;                   // at the start of a line of hunk data
+    char cat;                  // 'd' or 'a' for the current section, 'n' for none
+    char expected;             // 'd' or 'a' for the section allowed next, 'n' if not known
+    int last;                  // last value returned by reference_hunk_getc()
+    int newline_made_up;       // a missing final newline has been supplied
+    int eos_pending;           // EOS is owed after the made-up newline
+} REFERENCE;
+
+void reference_init(REFERENCE *r, const unsigned char *diff, size_t len);
+int reference_hunk_next(REFERENCE *r, HUNK *hp);
+int reference_hunk_getc(REFERENCE *r, HUNK *hp);
+int reference_patch(const unsigned char *in, size_t in_len,
+                    const unsigned char *diff, size_t diff_len, STREAM *out);
+
+#endif
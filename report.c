@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "fliki.h"
+#include "global.h"
+#include "debug.h"
+#include "diff.h"
+#include "report.h"
+
+/*
+ * Rendering of failure reports.  See report.h for the format.
+ */
+
+void report_init(HUNK_FAILURE *f) {
+    f->target = NULL;
+    f->error = NULL;
+    f->message = NULL;
+    f->hunk.serial = 0;
+    f->has_hunk = 0;
+    f->line = f->column = 0;
+    f->input_offset = f->diff_offset = -1;
+    f->excerpt_column = 0;
+    f->expected_len = f->actual_len = -1;
+}
+
+static void put_text(const char *s, STREAM *out) {
+    while (*s != 0)
+        stream_putc(*(s++), out);
+}
+
+static void put_number(long long n, STREAM *out) {
+    char digits[24];
+    int i = 0;
+    unsigned long long u = n < 0 ? -(unsigned long long) n : (unsigned long long) n;
+    do {
+        *(digits + i++) = '0' + u % 10;
+        u /= 10;
+    } while (u > 0);
+    if (n < 0)
+        stream_putc('-', out);
+    while (i > 0)
+        stream_putc(*(digits + --i), out);
+}
+
+// a JSON string; bytes outside printable ASCII are escaped as \u00XX
+static void put_string(const unsigned char *s, long n, STREAM *out) {
+    static const char hex[] = "0123456789abcdef";
+    stream_putc('"', out);
+    for (long i = 0; i < n; i++){
+        int c = *(s + i);
+        if (c == '"' || c == '\\'){
+            stream_putc('\\', out);
+            stream_putc(c, out);
+        }
+        else if (c == '\n'){
+            put_text("\\n", out);
+        }
+        else if (c == '\t'){
+            put_text("\\t", out);
+        }
+        else if (c < 0x20 || c >= 0x7f){
+            put_text("\\u00", out);
+            stream_putc(*(hex + c / 16), out);
+            stream_putc(*(hex + c % 16), out);
+        }
+        else{
+            stream_putc(c, out);
+        }
+    }
+    stream_putc('"', out);
+}
+
+static void put_cstring(const char *s, STREAM *out) {
+    long n = 0;
+    while (*(s + n) != 0)
+        n++;
+    put_string((const unsigned char *) s, n, out);
+}
+
+static void put_field(const char *name, STREAM *out) {
+    put_text(",\"", out);
+    put_text(name, out);
+    put_text("\":", out);
+}
+
+static void put_number_field(const char *name, long long n, STREAM *out) {
+    put_field(name, out);
+    put_number(n, out);
+}
+
+/**
+ * @brief  Write the report of a failure as one line of JSON.
+ * @details  The report is built in memory and then written with a
+ * single call, so that reports from concurrent processes sharing a
+ * file do not interleave.
+ *
+ * @return  0 on success, EOF if the report could not be written.
+ */
+int report_write(HUNK_FAILURE *f, FILE *out) {
+    if (f->error == NULL && f->target == NULL)
+        return 0;
+    STREAM *s = stream_open_buffer();
+    if (s == NULL)
+        return EOF;
+
+    stream_putc('{', s);
+    if (f->target != NULL){
+        put_text("\"target\":", s);
+        put_cstring(f->target, s);
+        if (f->error != NULL)
+            stream_putc(',', s);
+    }
+    if (f->error != NULL){
+        put_text("\"error\":", s);
+        put_cstring(f->error, s);
+    }
+    if (f->message != NULL){
+        put_field("message", s);
+        put_cstring(f->message, s);
+    }
+    if (f->hunk.serial > 0)
+        put_number_field("serial", f->hunk.serial, s);
+    if (f->has_hunk){
+        put_field("header", s);
+        stream_putc('"', s);
+        diff_write_header(&f->hunk, s);
+        stream_putc('"', s);
+    }
+    if (f->line > 0)
+        put_number_field("line", f->line, s);
+    if (f->column > 0)
+        put_number_field("column", f->column, s);
+    if (f->input_offset >= 0)
+        put_number_field("input_offset", f->input_offset, s);
+    if (f->diff_offset >= 0)
+        put_number_field("diff_offset", f->diff_offset, s);
+    if (f->expected_len >= 0 || f->actual_len >= 0)
+        put_number_field("excerpt_column", f->excerpt_column, s);
+    if (f->expected_len >= 0){
+        put_field("expected", s);
+        put_string(f->expected, f->expected_len, s);
+    }
+    if (f->actual_len >= 0){
+        put_field("actual", s);
+        put_string(f->actual, f->actual_len, s);
+    }
+    put_text("}\n", s);
+
+    size_t len;
+    unsigned char *bytes = stream_contents(s, &len);
+    int result = s->error || fwrite(bytes, 1, len, out) != len || fflush(out) ? EOF : 0;
+    stream_close(s);
+    return result;
+}
@@ -0,0 +1,66 @@
+#ifndef REPORT_H
+#define REPORT_H
+
+#include <stdio.h>
+
+#include "fliki.h"
+#include "stream.h"
+
+/*
+ * Machine-readable reports of why a diff did not apply.
+ *
+ * While patching, nothing is recorded unless a hunk fails; the few
+ * facts needed are then copied into a HUNK_FAILURE, and the report is
+ * rendered from it only if it is to be shown.  A report is a single
+ * line holding one JSON object:
+ *
+ *   {"error":"mismatch","message":"...","serial":2,"header":"2c2",
+ *    "line":2,"column":3,"input_offset":10,"diff_offset":14,
+ *    "excerpt_column":1,"expected":"abc\n","actual":"abd\n"}
+ *
+ * error is one of "mismatch", "input_ended", "count_mismatch",
+ * "ill_formed_hunk" and "ill_formed_header", or "conflict" for the
+ * overlapping hunks of two diffs being merged (see merge.h).  line
+ * and column locate the failure in the input, counting from 1;
+ * offsets are byte offsets in the (decompressed) input and diff.
+ * expected and actual are excerpts of at most REPORT_EXCERPT bytes of
+ * the deleted line and of the input line, both starting at column
+ * excerpt_column.  Fields that do not apply to an error are left out.
+ *
+ * When one diff is applied to several files (see fanout.h), each
+ * report starts with a "target" field naming the file, and the error
+ * may also be "io_error", for a file that could not be read or
+ * written.  The report of a file that was patched has no error field:
+ *
+ *   {"target":"replica/a.conf"}
+ */
+
+#define REPORT_EXCERPT 80      // bytes of each line excerpt
+#define REPORT_CONTEXT 32      // bytes before a mismatch kept in an excerpt
+
+typedef enum {
+    ERROR_FORMAT_TEXT,
+    ERROR_FORMAT_JSON
+} ERROR_FORMAT;
+
+typedef struct hunk_failure {
+    const char *target;        // the file patched, or NULL if there is only one
+    const char *error;         // NULL if nothing has failed
+    const char *message;
+    HUNK hunk;                 // serial is 0 if no hunk was reached
+    int has_hunk;              // the header was read
+    long long line;            // 0 if not known
+    long long column;          // 0 if not known
+    long long input_offset;    // -1 if not known
+    long long diff_offset;
+    long long excerpt_column;
+    unsigned char expected[REPORT_EXCERPT];
+    int expected_len;          // -1 if there is no excerpt
+    unsigned char actual[REPORT_EXCERPT];
+    int actual_len;
+} HUNK_FAILURE;
+
+void report_init(HUNK_FAILURE *f);
+int report_write(HUNK_FAILURE *f, FILE *out);
+
+#endif
@@ -0,0 +1,163 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "fliki.h"
+#include "global.h"
+#include "debug.h"
+#include "stat.h"
+
+/*
+ * Statistics of a diff, gathered in a single pass over it.  See stat.h.
+ */
+
+void stat_init(DIFF_STAT *sp) {
+    sp->hunks = 0;
+    for (int i = 0; i < 4; i++)
+        *(sp->hunks_by_type + i) = 0;
+    HUNK_SIZE zero = { 0, 0, 0, 0 };
+    sp->added = sp->deleted = sp->changed = zero;
+    sp->largest = 0;
+    for (int i = 0; i < STAT_BUCKETS; i++)
+        *(sp->histogram + i) = 0;
+}
+
+static void stat_add(DIFF_STAT *sp, HUNK *hp, HUNK_SIZE *size) {
+    sp->hunks++;
+    (*(sp->hunks_by_type + hp->type))++;
+    HUNK_SIZE *to = hp->type == HUNK_APPEND_TYPE ? &sp->added
+                  : hp->type == HUNK_DELETE_TYPE ? &sp->deleted : &sp->changed;
+    to->deleted_lines += size->deleted_lines;
+    to->deleted_bytes += size->deleted_bytes;
+    to->added_lines += size->added_lines;
+    to->added_bytes += size->added_bytes;
+
+    long long lines = size->deleted_lines + size->added_lines;
+    if (lines > sp->largest)
+        sp->largest = lines;
+    int bucket = lines > 0 ? 63 - __builtin_clzll((unsigned long long) lines) : 0;
+    if (bucket >= STAT_BUCKETS)
+        bucket = STAT_BUCKETS - 1;
+    (*(sp->histogram + bucket))++;
+}
+
+/**
+ * @brief  Gather the statistics of a diff.
+ * @details  The diff is checked for the same errors as by diff_read().
+ *
+ * @param sp  An initialized DIFF_STAT, to which the hunks are added.
+ * @param in  The stream from which the diff is read.
+ * @return  0 if the whole diff was read, ERR if it is ill-formed, in
+ * which case the last hunk counted in sp is the one before the
+ * offending hunk.
+ */
+int stat_read(DIFF_STAT *sp, STREAM *in) {
+    HUNK hunk;
+    hunk.serial = 0;
+    hunk.type = HUNK_NO_TYPE;
+    hunk_reset();
+
+    int result;
+    while ((result = hunk_next_stream(&hunk, in)) == 0){
+        HUNK_SIZE size;
+        if (hunk_skip(&hunk, in, &size))
+            return ERR;
+        stat_add(sp, &hunk, &size);
+    }
+    return result == EOF ? 0 : ERR;
+}
+
+static void put_size(const char *what, long long lines, long long bytes, FILE *out) {
+    fprintf(out, "%s %lld line%s (%lld byte%s)", what, lines, lines == 1 ? "" : "s", bytes,
+            bytes == 1 ? "" : "s");
+}
+
+/**
+ * @brief  Write the statistics of a diff.
+ * @details  In text form, they are written as a few lines for people
+ * to read; in JSON form, as one line holding an object:
+ *
+ *   {"hunks":3,"append_hunks":1,"delete_hunks":1,"change_hunks":1,
+ *    "added_lines":2,"added_bytes":8,"deleted_lines":1,"deleted_bytes":4,
+ *    "changed_old_lines":1,"changed_old_bytes":4,"changed_new_lines":1,
+ *    "changed_new_bytes":5,"largest_hunk":2,"histogram":[2,1]}
+ *
+ * where histogram[k] is the number of hunks with 2^k to 2^(k+1)-1
+ * lines, up to the last nonzero count.
+ *
+ * @param format  A STAT_FORMAT.
+ * @return  0 on success, EOF if there was an error writing.
+ */
+int stat_write(DIFF_STAT *sp, int format, FILE *out) {
+    int buckets = STAT_BUCKETS;
+    while (buckets > 0 && *(sp->histogram + buckets - 1) == 0)
+        buckets--;
+
+    if (format == STAT_FORMAT_JSON){
+        fprintf(out, "{\"hunks\":%lld,\"append_hunks\":%lld,\"delete_hunks\":%lld,\"change_hunks\":%lld,",
+                sp->hunks, *(sp->hunks_by_type + HUNK_APPEND_TYPE),
+                *(sp->hunks_by_type + HUNK_DELETE_TYPE), *(sp->hunks_by_type + HUNK_CHANGE_TYPE));
+        fprintf(out, "\"added_lines\":%lld,\"added_bytes\":%lld,\"deleted_lines\":%lld,\"deleted_bytes\":%lld,",
+                sp->added.added_lines, sp->added.added_bytes, sp->deleted.deleted_lines,
+                sp->deleted.deleted_bytes);
+        fprintf(out, "\"changed_old_lines\":%lld,\"changed_old_bytes\":%lld,"
+                "\"changed_new_lines\":%lld,\"changed_new_bytes\":%lld,",
+                sp->changed.deleted_lines, sp->changed.deleted_bytes, sp->changed.added_lines,
+                sp->changed.added_bytes);
+        fprintf(out, "\"largest_hunk\":%lld,\"histogram\":[", sp->largest);
+        for (int i = 0; i < buckets; i++)
+            fprintf(out, i == 0 ? "%lld" : ",%lld", *(sp->histogram + i));
+        fprintf(out, "]}\n");
+    }
+    else{
+        fprintf(out, "%lld hunk%s: %lld append, %lld delete, %lld change\n", sp->hunks,
+                sp->hunks == 1 ? "" : "s", *(sp->hunks_by_type + HUNK_APPEND_TYPE),
+                *(sp->hunks_by_type + HUNK_DELETE_TYPE), *(sp->hunks_by_type + HUNK_CHANGE_TYPE));
+        put_size("added", sp->added.added_lines, sp->added.added_bytes, out);
+        fprintf(out, "\n");
+        put_size("deleted", sp->deleted.deleted_lines, sp->deleted.deleted_bytes, out);
+        fprintf(out, "\n");
+        put_size("changed", sp->changed.deleted_lines, sp->changed.deleted_bytes, out);
+        put_size(" into", sp->changed.added_lines, sp->changed.added_bytes, out);
+        fprintf(out, "\n");
+        fprintf(out, "largest hunk: %lld line%s\n", sp->largest, sp->largest == 1 ? "" : "s");
+        for (int i = 0; i < buckets; i++){
+            long long low = 1LL << i;
+            if (low == 1)
+                fprintf(out, "%12lld        ", low);
+            else
+                fprintf(out, "%12lld-%-7lld", low, 2 * low - 1);
+            fprintf(out, " %lld\n", *(sp->histogram + i));
+        }
+    }
+    return ferror(out) || fflush(out) ? EOF : 0;
+}
+
+/**
+ * @brief  Write the statistics of a diff, without patching anything.
+ *
+ * @param format  A STAT_FORMAT.
+ * @return  0 on success, -1 if the diff is ill-formed or could not
+ * be read, in which case a report is printed to stderr unless quiet
+ * mode is in effect.
+ */
+int diff_stat(FILE *diff, FILE *out, int format) {
+    STREAM *s = stream_open_reader(diff);
+    if (s == NULL)
+        return -1;
+    DIFF_STAT stat;
+    stat_init(&stat);
+    int result = stat_read(&stat, s);
+    if (result || s->error){
+        if (!(global_options & QUIET_OPTION)){
+            long long offset;
+            const char *why = hunk_error(&offset);
+            if (why != NULL)
+                fprintf(stderr, "diff is ill-formed at byte %lld: %s\n", offset, why);
+            else
+                fprintf(stderr, "diff is ill-formed at hunk %lld\n", stat.hunks + 1);
+        }
+        result = -1;
+    }
+    stream_close(s);
+    return result ? -1 : stat_write(&stat, format, out);
+}
@@ -0,0 +1,59 @@
+#ifndef STAT_H
+#define STAT_H
+
+#include <stdio.h>
+
+#include "fliki.h"
+#include "stream.h"
+
+/*
+ * Summary statistics of a diff, gathered without a file to patch.
+ *
+ * The hunk headers are parsed by hunk_next(), and the data portion of
+ * each hunk is skipped with hunk_skip(), which measures the runs of
+ * characters found by hunk_getspan() but does not store them or hand
+ * them out one at a time.  Memory use does not depend on the size of
+ * the diff.
+ *
+ * Lines are counted by the kind of hunk they belong to: lines of
+ * append hunks are added, lines of delete hunks are deleted, and the
+ * lines of change hunks are changed, from the lines they delete into
+ * the lines they add.  Bytes are those of the lines themselves,
+ * without the "< " or "> " prefix and including the newline.  The
+ * size of a hunk is the number of lines it deletes and adds; the
+ * histogram counts the hunks whose sizes are in each range
+ * [2^k, 2^(k+1)).
+ */
+
+#define STAT_BUCKETS 32
+
+typedef enum {
+    STAT_FORMAT_TEXT,
+    STAT_FORMAT_JSON
+} STAT_FORMAT;
+
+// the lines and bytes of one hunk
+typedef struct hunk_size {
+    long long deleted_lines;
+    long long deleted_bytes;
+    long long added_lines;
+    long long added_bytes;
+} HUNK_SIZE;
+
+typedef struct diff_stat {
+    long long hunks;
+    long long hunks_by_type[4];    // indexed by HUNK_TYPE
+    HUNK_SIZE added;               // only added_lines and added_bytes are used
+    HUNK_SIZE deleted;             // only deleted_lines and deleted_bytes are used
+    HUNK_SIZE changed;
+    long long largest;             // size of the largest hunk
+    long long histogram[STAT_BUCKETS];
+} DIFF_STAT;
+
+int hunk_skip(HUNK *hp, STREAM *in, HUNK_SIZE *sp);
+void stat_init(DIFF_STAT *sp);
+int stat_read(DIFF_STAT *sp, STREAM *in);
+int stat_write(DIFF_STAT *sp, int format, FILE *out);
+int diff_stat(FILE *diff, FILE *out, int format);
+
+#endif
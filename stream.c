@@ -0,0 +1,967 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#ifdef FLIKI_ZLIB
+#include <zlib.h>
+#endif
+#ifdef FLIKI_ZSTD
+#include <zstd.h>
+#endif
+
+#include "stream.h"
+#include "hash.h"
+#include "budget.h"
+
+/*
+ * Implementation of the buffered, optionally compressed streams that
+ * the patch engine reads the input and diff from and writes the output
+ * to.  See stream.h for the interface.
+ */
+
+static void copy_bytes(unsigned char *dst, const unsigned char *src, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        *(dst + i) = *(src + i);
+}
+
+static STREAM *stream_alloc(FILE *file, int writing) {
+    STREAM *s = budget_calloc(1, sizeof(STREAM));
+    if (s == NULL)
+        return NULL;
+    s->file = file;
+    s->writing = writing;
+    // when memory is short, smaller blocks will do
+    size_t block = STREAM_BUFSIZE;
+    while ((s->buf = budget_malloc(writing ? block : STREAM_PUSHBACK + block)) == NULL &&
+           block > STREAM_MINBLOCK)
+        block /= 2;
+    if (s->buf == NULL){
+        budget_free(s);
+        return NULL;
+    }
+    s->size = writing ? block : STREAM_PUSHBACK + block;
+    return s;
+}
+
+// bytes of data in a block of the stream, not counting room for pushing back
+#define BLOCK_SIZE(s) ((s)->writing ? (s)->size : (s)->size - STREAM_PUSHBACK)
+
+static int stream_alloc_zbuf(STREAM *s) {
+    if (s->zbuf == NULL){
+        s->zsize = BLOCK_SIZE(s);
+        s->zbuf = budget_malloc(s->zsize);
+    }
+    return s->zbuf == NULL ? -1 : 0;
+}
+
+#ifdef FLIKI_ZLIB
+// zlib allocates its state from the budget too
+static voidpf zlib_alloc(voidpf opaque, uInt items, uInt size) {
+    (void) opaque;
+    return budget_calloc(items, size);
+}
+
+static void zlib_free(voidpf opaque, voidpf p) {
+    (void) opaque;
+    budget_free(p);
+}
+
+static z_stream *zlib_state(void) {
+    z_stream *z = budget_calloc(1, sizeof(z_stream));
+    if (z != NULL){
+        z->zalloc = zlib_alloc;
+        z->zfree = zlib_free;
+    }
+    return z;
+}
+#endif
+
+#if defined(FLIKI_ZLIB) || defined(FLIKI_ZSTD)
+/*
+ * Read compressed bytes from the file into zbuf, keeping those that
+ * have not yet been consumed by the decoder.  Returns the number of
+ * unconsumed bytes afterwards.
+ */
+static size_t stream_read_raw(STREAM *s) {
+    if (s->zpos > 0){
+        copy_bytes(s->zbuf, s->zbuf + s->zpos, s->zlen - s->zpos);
+        s->zlen -= s->zpos;
+        s->zpos = 0;
+    }
+    if (s->zlen < s->zsize && !feof(s->file) && !ferror(s->file))
+        s->zlen += fread(s->zbuf + s->zlen, 1, s->zsize - s->zlen, s->file);
+    if (ferror(s->file))
+        s->error = 1;
+    return s->zlen - s->zpos;
+}
+#endif
+
+/*
+ * Decoders.  Each one stores up to n decoded bytes at dst and returns
+ * the number stored, 0 meaning end of data (or an error, which is
+ * recorded in the stream).
+ */
+
+static size_t decode_plain(STREAM *s, unsigned char *dst, size_t n) {
+    size_t got = fread(dst, 1, n, s->file);
+    if (got == 0 && ferror(s->file))
+        s->error = 1;
+    return got;
+}
+
+#ifdef FLIKI_ZLIB
+static size_t decode_gzip(STREAM *s, unsigned char *dst, size_t n) {
+    z_stream *z = s->codec_state;
+    z->next_out = dst;
+    z->avail_out = n;
+    while (z->avail_out == n){
+        if (s->zpos == s->zlen && stream_read_raw(s) == 0){
+            // the input was cut short inside a member
+            if (s->midframe)
+                s->error = 1;
+            break;
+        }
+        z->next_in = s->zbuf + s->zpos;
+        z->avail_in = s->zlen - s->zpos;
+        int r = inflate(z, Z_NO_FLUSH);
+        s->zpos = s->zlen - z->avail_in;
+        s->midframe = r != Z_STREAM_END;
+        if (r == Z_STREAM_END){
+            // concatenated gzip members decode as one stream
+            inflateReset(z);
+        }
+        else if (r != Z_OK && r != Z_BUF_ERROR){
+            s->error = 1;
+            break;
+        }
+    }
+    return n - z->avail_out;
+}
+#endif
+
+#ifdef FLIKI_ZSTD
+static size_t decode_zstd(STREAM *s, unsigned char *dst, size_t n) {
+    ZSTD_outBuffer out = { dst, n, 0 };
+    while (out.pos == 0){
+        if (s->zpos == s->zlen && stream_read_raw(s) == 0){
+            // the input was cut short inside a frame
+            if (s->midframe)
+                s->error = 1;
+            break;
+        }
+        ZSTD_inBuffer in = { s->zbuf, s->zlen, s->zpos };
+        size_t r = ZSTD_decompressStream(s->codec_state, &out, &in);
+        s->zpos = in.pos;
+        if (ZSTD_isError(r)){
+            s->error = 1;
+            break;
+        }
+        // 0 once a frame is complete and all of it has been returned
+        s->midframe = r != 0;
+    }
+    return out.pos;
+}
+#endif
+
+static size_t stream_decode(STREAM *s, unsigned char *dst, size_t n) {
+    size_t got;
+    switch (s->codec){
+#ifdef FLIKI_ZLIB
+        case STREAM_GZIP:
+            got = decode_gzip(s, dst, n);
+            break;
+#endif
+#ifdef FLIKI_ZSTD
+        case STREAM_ZSTD:
+            got = decode_zstd(s, dst, n);
+            break;
+#endif
+        default:
+            got = decode_plain(s, dst, n);
+            break;
+    }
+    if (s->hash != NULL)
+        hash_update(s->hash, dst, got);
+    return got;
+}
+
+/*
+ * Decide which codec the data at the start of the stream uses.  The
+ * first block has already been read into buf; if it turns out to be
+ * compressed, it becomes the first block of compressed input instead.
+ */
+static int stream_detect(STREAM *s) {
+    unsigned char *p = s->buf;
+    size_t n = s->len;
+    STREAM_CODEC codec = STREAM_PLAIN;
+
+#ifdef FLIKI_ZLIB
+    if (n >= 2 && *p == 0x1f && *(p + 1) == 0x8b)
+        codec = STREAM_GZIP;
+#endif
+#ifdef FLIKI_ZSTD
+    if (n >= 4 && *p == 0x28 && *(p + 1) == 0xb5 && *(p + 2) == 0x2f && *(p + 3) == 0xfd)
+        codec = STREAM_ZSTD;
+#endif
+    if (codec == STREAM_PLAIN)
+        return 0;
+
+    if (stream_alloc_zbuf(s))
+        return -1;
+    copy_bytes(s->zbuf, p, n);
+    s->zlen = n;
+    s->zpos = 0;
+    s->len = 0;
+    s->codec = codec;
+
+#ifdef FLIKI_ZLIB
+    if (codec == STREAM_GZIP){
+        z_stream *z = zlib_state();
+        // 15 + 32: maximum window, zlib or gzip header detected automatically
+        if (z == NULL || inflateInit2(z, 15 + 32) != Z_OK){
+            budget_free(z);
+            return -1;
+        }
+        s->codec_state = z;
+    }
+#endif
+#ifdef FLIKI_ZSTD
+    if (codec == STREAM_ZSTD){
+        s->codec_state = ZSTD_createDCtx();
+        if (s->codec_state == NULL)
+            return -1;
+    }
+#endif
+    s->len = stream_decode(s, s->buf, s->size);
+    return 0;
+}
+
+// read the first block of a reading stream's file, and find out its codec
+static int reader_start(STREAM *s) {
+    // no more than fits in zbuf, in case the data turns out to be compressed
+    s->len = decode_plain(s, s->buf, BLOCK_SIZE(s));
+    return stream_detect(s);
+}
+
+/**
+ * @brief  Open a stream for reading from a file.
+ * @details  The first block of the file is read immediately to find
+ * out whether the data is compressed.  Bytes that are read ahead stay
+ * buffered in the stream, so the file should not be read directly
+ * while the stream is open.
+ *
+ * @param file  File to read from.
+ * @return  The new stream, or NULL if file is NULL or memory could
+ * not be allocated.
+ */
+STREAM *stream_open_reader(FILE *file) {
+    if (file == NULL)
+        return NULL;
+    STREAM *s = stream_alloc(file, 0);
+    if (s == NULL)
+        return NULL;
+    if (reader_start(s)){
+        stream_close(s);
+        return NULL;
+    }
+    return s;
+}
+
+// set up the codec of a writing stream; its state is freed by stream_detach() even on failure
+static int writer_start(STREAM *s, STREAM_CODEC codec, int level, int threads) {
+#ifdef FLIKI_ZLIB
+    if (codec == STREAM_GZIP){
+        z_stream *z = zlib_state();
+        // 15 + 16: maximum window, gzip header; memory level 1 if 8 does not fit
+        if (z == NULL || stream_alloc_zbuf(s) ||
+            (deflateInit2(z, level ? level : Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                          15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK &&
+             deflateInit2(z, level ? level : Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                          15 + 16, 1, Z_DEFAULT_STRATEGY) != Z_OK)){
+            budget_free(z);
+            return -1;
+        }
+        s->codec_state = z;
+        s->codec = STREAM_GZIP;
+    }
+#endif
+#ifdef FLIKI_ZSTD
+    if (codec == STREAM_ZSTD){
+        ZSTD_CCtx *cctx = ZSTD_createCCtx();
+        if (cctx == NULL || stream_alloc_zbuf(s)){
+            ZSTD_freeCCtx(cctx);
+            return -1;
+        }
+        s->codec_state = cctx;
+        s->codec = STREAM_ZSTD;
+        if (level && ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level)))
+            return -1;
+        // fails harmlessly on a libzstd built without thread support
+        if (threads > 0)
+            ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, threads);
+    }
+#endif
+    (void) level;
+    (void) threads;
+    return s->codec == codec ? 0 : -1;
+}
+
+
+/**
+ * @brief  Open a stream for writing to a file.
+ *
+ * @param file  File to write to.
+ * @param codec  Compression applied to the bytes written.
+ * @param level  Compression level, or 0 for the codec's default.
+ * @param threads  Number of compression worker threads (zstd only);
+ * 0 compresses on the calling thread.
+ * @return  The new stream, or NULL on failure, including a codec that
+ * has not been compiled in or a level it does not accept.
+ */
+STREAM *stream_open_writer(FILE *file, STREAM_CODEC codec, int level, int threads) {
+    if (file == NULL)
+        return NULL;
+    STREAM *s = stream_alloc(file, 1);
+    if (s == NULL)
+        return NULL;
+    if (writer_start(s, codec, level, threads)){
+        stream_close(s);
+        return NULL;
+    }
+    return s;
+}
+
+/**
+ * @brief  Find out how far a codec's compression level goes.
+ *
+ * @return  The highest level the codec accepts, 0 for STREAM_PLAIN,
+ * or -1 if the codec has not been compiled in.
+ */
+int stream_max_level(STREAM_CODEC codec) {
+    switch (codec){
+        case STREAM_PLAIN:
+            return 0;
+#ifdef FLIKI_ZLIB
+        case STREAM_GZIP:
+            return Z_BEST_COMPRESSION;
+#endif
+#ifdef FLIKI_ZSTD
+        case STREAM_ZSTD:
+            return ZSTD_maxCLevel();
+#endif
+        default:
+            return -1;
+    }
+}
+
+/**
+ * @brief  Open a stream for reading from a block of memory.
+ * @details  The stream reads from its own copy of the data.
+ *
+ * @return  The new stream, or NULL if memory could not be allocated.
+ */
+STREAM *stream_open_memory(const void *data, size_t len) {
+    STREAM *s = budget_calloc(1, sizeof(STREAM));
+    if (s == NULL)
+        return NULL;
+    s->size = len > 0 ? len : 1;
+    s->buf = budget_malloc(s->size);
+    if (s->buf == NULL){
+        budget_free(s);
+        return NULL;
+    }
+    copy_bytes(s->buf, data, len);
+    s->len = len;
+    return s;
+}
+
+/**
+ * @brief  Allocate a stream that is not yet attached to a file.
+ * @details  For a caller that opens one file after another, such as
+ * a worker thread: each file is attached with stream_rebind() and
+ * detached again with stream_detach().
+ *
+ * @param writing  Nonzero for a writing stream, zero for a reading one.
+ * @return  The new stream, or NULL if memory could not be allocated.
+ */
+STREAM *stream_open_unbound(int writing) {
+    return stream_alloc(NULL, writing);
+}
+
+/**
+ * @brief  Open a stream for writing to a block of memory.
+ * @details  The memory grows as needed to hold everything written.
+ * It can be retrieved with stream_contents() before the stream is
+ * closed.
+ *
+ * @return  The new stream, or NULL if memory could not be allocated.
+ */
+STREAM *stream_open_buffer(void) {
+    return stream_alloc(NULL, 1);
+}
+
+/**
+ * @brief  Get the bytes written so far to a stream opened with
+ * stream_open_buffer().
+ *
+ * @param lenp  Where to store the number of bytes.
+ * @return  The bytes, which remain owned by the stream.
+ */
+unsigned char *stream_contents(STREAM *s, size_t *lenp) {
+    *lenp = s->len;
+    return s->buf;
+}
+
+// make room in a memory stream by doubling its size
+static void stream_grow(STREAM *s) {
+    unsigned char *p = budget_realloc(s->buf, s->size * 2);
+    if (p == NULL){
+        // drop what was written, so that writes can go on until the error is noticed
+        s->error = 1;
+        s->offset += s->len;
+        s->len = 0;
+        return;
+    }
+    s->buf = p;
+    s->size *= 2;
+}
+
+/*
+ * Encoders.  Each one consumes all the pending bytes in buf, writing
+ * whatever compressed output is ready to the file.  With finish set,
+ * the compressed stream is also terminated.
+ */
+
+static void encode_plain(STREAM *s) {
+    if (s->len > 0 && fwrite(s->buf, 1, s->len, s->file) != s->len)
+        s->error = 1;
+    // a failure to copy shows up as an error on the tee file itself
+    if (s->tee != NULL && s->len > 0)
+        fwrite(s->buf, 1, s->len, s->tee);
+}
+
+#ifdef FLIKI_ZLIB
+static void encode_gzip(STREAM *s, int finish) {
+    z_stream *z = s->codec_state;
+    z->next_in = s->buf;
+    z->avail_in = s->len;
+    int r;
+    do {
+        z->next_out = s->zbuf;
+        z->avail_out = s->zsize;
+        r = deflate(z, finish ? Z_FINISH : Z_NO_FLUSH);
+        size_t n = s->zsize - z->avail_out;
+        if (r == Z_STREAM_ERROR || (n > 0 && fwrite(s->zbuf, 1, n, s->file) != n)){
+            s->error = 1;
+            return;
+        }
+    } while (z->avail_in > 0 || (finish && r != Z_STREAM_END));
+}
+#endif
+
+#ifdef FLIKI_ZSTD
+static void encode_zstd(STREAM *s, int finish) {
+    ZSTD_inBuffer in = { s->buf, s->len, 0 };
+    size_t remaining;
+    do {
+        ZSTD_outBuffer out = { s->zbuf, s->zsize, 0 };
+        remaining = ZSTD_compressStream2(s->codec_state, &out, &in,
+                                         finish ? ZSTD_e_end : ZSTD_e_continue);
+        if (ZSTD_isError(remaining) ||
+            (out.pos > 0 && fwrite(s->zbuf, 1, out.pos, s->file) != out.pos)){
+            s->error = 1;
+            return;
+        }
+    } while (in.pos < in.size || (finish && remaining != 0));
+}
+#endif
+
+// pass the pending bytes in buf to the encoder
+static void stream_encode(STREAM *s, int finish) {
+    switch (s->codec){
+#ifdef FLIKI_ZLIB
+        case STREAM_GZIP:
+            encode_gzip(s, finish);
+            break;
+#endif
+#ifdef FLIKI_ZSTD
+        case STREAM_ZSTD:
+            encode_zstd(s, finish);
+            break;
+#endif
+        default:
+            encode_plain(s);
+            break;
+    }
+#if !defined(FLIKI_ZLIB) && !defined(FLIKI_ZSTD)
+    (void) finish;
+#endif
+}
+
+static void spill_put(STREAM *s, const unsigned char *p, size_t n);
+
+static void stream_drain(STREAM *s, int finish) {
+    if (s->file == NULL){
+        if (!finish)
+            stream_grow(s);
+        return;
+    }
+    if (s->spill != NULL && !finish)
+        spill_put(s, s->buf, s->len);
+    else
+        stream_encode(s, finish);
+    s->offset += s->len;
+    s->len = 0;
+}
+
+/**
+ * @brief  Refill the buffer of a reading stream and return its next byte.
+ * @details  This is the slow path of stream_getc().  The last few bytes
+ * already read are kept at the front of the buffer, so that up to
+ * STREAM_PUSHBACK bytes can always be pushed back with stream_ungetc().
+ *
+ * @param s  The stream.
+ * @return  The next byte, or EOF if there are no more.
+ */
+int stream_fill(STREAM *s) {
+    if (s->pos < s->len)
+        return *(s->buf + s->pos++);
+    if (s->eof || s->writing || s->file == NULL)
+        return EOF;
+
+    size_t keep = s->pos < STREAM_PUSHBACK ? s->pos : STREAM_PUSHBACK;
+    copy_bytes(s->buf, s->buf + s->pos - keep, keep);
+    s->offset += s->pos - keep;
+    s->pos = keep;
+    s->len = keep + stream_decode(s, s->buf + keep, s->size - keep);
+    if (s->pos == s->len){
+        s->eof = 1;
+        return EOF;
+    }
+    return *(s->buf + s->pos++);
+}
+
+/**
+ * @brief  Make at least n unread bytes of a reading stream available
+ * in its buffer, if the stream has that many left.
+ * @details  Unlike stream_fill(), this reads more even if some bytes
+ * remain unread, moving those to the front of the buffer first, so
+ * that a few bytes can be looked at before deciding whether to take
+ * them.  n must be small compared with STREAM_BUFSIZE.
+ *
+ * @return  The number of unread bytes in the buffer, which is less
+ * than n only at the end of the data.
+ */
+size_t stream_peek(STREAM *s, size_t n) {
+    if (s->len - s->pos >= n || s->eof || s->writing || s->file == NULL)
+        return s->len - s->pos;
+    size_t keep = s->pos < STREAM_PUSHBACK ? s->pos : STREAM_PUSHBACK;
+    size_t drop = s->pos - keep;
+    copy_bytes(s->buf, s->buf + drop, s->len - drop);
+    s->offset += drop;
+    s->pos -= drop;
+    s->len -= drop;
+    while (s->len - s->pos < n){
+        size_t got = stream_decode(s, s->buf + s->len, s->size - s->len);
+        if (got == 0){
+            s->eof = 1;
+            break;
+        }
+        s->len += got;
+    }
+    return s->len - s->pos;
+}
+
+// a word that may be loaded from memory holding bytes of any type
+typedef unsigned long long __attribute__((may_alias)) SCAN_WORD;
+
+#define SCAN_ONES 0x0101010101010101ULL
+#define SCAN_HIGH 0x8080808080808080ULL
+
+/**
+ * @brief  Find the first newline in a run of bytes.
+ * @details  The bytes are looked at a word at a time, testing all of
+ * a word's bytes for a newline at once, so that long lines are
+ * scanned at close to memory speed.
+ *
+ * @param p  Start of the bytes.
+ * @param end  End of the bytes.
+ * @return  A pointer to the first newline, or end if there is none.
+ */
+const unsigned char *stream_scan(const unsigned char *p, const unsigned char *end) {
+    // up to a word boundary a byte at a time
+    while (p < end && ((unsigned long) p & (sizeof(SCAN_WORD) - 1)) != 0){
+        if (*p == '\n')
+            return p;
+        p++;
+    }
+    while (end - p >= (long) sizeof(SCAN_WORD)){
+        SCAN_WORD w = *(const SCAN_WORD *) p ^ (SCAN_ONES * '\n');
+        // nonzero if (and only if) some byte of w is zero
+        if (((w - SCAN_ONES) & ~w & SCAN_HIGH) != 0)
+            break;
+        p += sizeof(SCAN_WORD);
+    }
+    while (p < end && *p != '\n')
+        p++;
+    return p;
+}
+
+/**
+ * @brief  Push a byte back onto a reading stream.
+ * @details  As with ungetc(), pushing back EOF has no effect.  Pushing
+ * back bytes other than those most recently read is allowed, as long
+ * as no more than STREAM_PUSHBACK bytes are pushed back in a row.
+ *
+ * @return  The byte pushed back, or EOF if it could not be.
+ */
+int stream_ungetc(int c, STREAM *s) {
+    if (c == EOF || s->pos == 0)
+        return EOF;
+    *(s->buf + --s->pos) = (unsigned char) c;
+    return (unsigned char) c;
+}
+
+/**
+ * @brief  Drain the buffer of a writing stream and then store a byte.
+ * @details  This is the slow path of stream_putc().
+ *
+ * @return  The byte written, or EOF if an error has occurred.
+ */
+int stream_flushc(int c, STREAM *s) {
+    stream_drain(s, 0);
+    *(s->buf + s->len++) = (unsigned char) c;
+    return s->error ? EOF : (unsigned char) c;
+}
+
+size_t stream_write(const void *data, size_t n, STREAM *s) {
+    const unsigned char *p = data;
+    size_t left = n;
+    while (left > 0){
+        if (s->len == s->size)
+            stream_drain(s, 0);
+        size_t room = s->size - s->len;
+        size_t k = left < room ? left : room;
+        copy_bytes(s->buf + s->len, p, k);
+        s->len += k;
+        p += k;
+        left -= k;
+    }
+    return s->error ? 0 : n;
+}
+
+/**
+ * @brief  Pass all bytes written so far down to the underlying file.
+ * @details  A compressed stream is not terminated by this, so more
+ * data can still be written afterwards.
+ *
+ * @return  0 on success, EOF if an error has occurred on the stream.
+ */
+int stream_flush(STREAM *s) {
+    if (s->writing && s->file != NULL){
+        stream_drain(s, 0);
+        if (fflush(s->file))
+            s->error = 1;
+    }
+    return s->error ? EOF : 0;
+}
+
+/**
+ * @brief  Move a reading stream to a given offset.
+ * @details  Only plain streams on seekable files can move outside the
+ * bytes already buffered.  Bytes pushed back are forgotten.
+ *
+ * @param offset  Offset from the start of the file.
+ * @return  0 on success, -1 if the stream cannot be moved there.
+ */
+int stream_seek(STREAM *s, long long offset) {
+    if (s->writing)
+        return -1;
+    if (offset >= s->offset && offset <= s->offset + (long long) s->len){
+        s->pos = offset - s->offset;
+        return 0;
+    }
+    // bytes skipped over would be missing from the hash
+    if (s->file == NULL || s->codec != STREAM_PLAIN || s->hash != NULL ||
+        fseeko(s->file, offset, SEEK_SET))
+        return -1;
+    s->offset = offset;
+    s->pos = s->len = 0;
+    s->eof = 0;
+    return 0;
+}
+
+/**
+ * @brief  Copy bytes from one stream to another a block at a time.
+ *
+ * @param out  Stream to copy to, or NULL to skip the bytes.  Skipping
+ * seeks past them where possible instead of reading them.
+ * @param n  Number of bytes.
+ * @return  0 on success, EOF if the input ended first.
+ */
+int stream_copy(STREAM *in, STREAM *out, long long n) {
+    if (out == NULL && stream_seek(in, stream_tell(in) + n) == 0)
+        return 0;
+    while (n > 0){
+        if (stream_getc(in) == EOF)
+            return EOF;
+        in->pos--;
+        long long k = in->len - in->pos < (size_t) n ? (long long) (in->len - in->pos) : n;
+        if (out != NULL)
+            stream_write(in->buf + in->pos, k, out);
+        in->pos += k;
+        n -= k;
+    }
+    return 0;
+}
+
+/**
+ * @brief  Hash every byte read from a stream from its start onwards.
+ * @details  The bytes already buffered are hashed at once, and the
+ * rest as they are read.  While a hash is attached, the stream never
+ * seeks past bytes instead of reading them.
+ *
+ * @param h  An initialized hash, which must outlive the stream.
+ * @return  0 on success, -1 if bytes have already been dropped from
+ * the buffer, so that the hash would be incomplete.
+ */
+int stream_hash(STREAM *s, HASH *h) {
+    if (s->writing || s->offset != 0)
+        return -1;
+    hash_update(h, s->buf, s->len);
+    s->hash = h;
+    return 0;
+}
+
+/*
+ * Held bytes.  They are kept in the order written: first in mem, up
+ * to STREAM_SPILL_MEMORY bytes or as much as the memory budget allows,
+ * then in a temporary file; the bytes still pending in the buffer of
+ * the stream come after them.
+ */
+typedef struct spill {
+    unsigned char *mem;
+    size_t len;
+    size_t size;
+    FILE *file;                // NULL until mem is full
+    long long file_len;
+} SPILL;
+
+// hold back n more bytes
+static void spill_put(STREAM *s, const unsigned char *p, size_t n) {
+    SPILL *sp = s->spill;
+    if (sp->file == NULL && sp->len + n > sp->size && sp->size < STREAM_SPILL_MEMORY){
+        size_t size = sp->size > 0 ? sp->size : STREAM_BUFSIZE;
+        while (size < sp->len + n && size < STREAM_SPILL_MEMORY)
+            size *= 2;
+        unsigned char *mem = budget_realloc(sp->mem, size);
+        if (mem != NULL){
+            sp->mem = mem;
+            sp->size = size;
+        }
+    }
+    if (sp->file == NULL && sp->len + n <= sp->size){
+        copy_bytes(sp->mem + sp->len, p, n);
+        sp->len += n;
+        return;
+    }
+    if (sp->file == NULL && (sp->file = tmpfile()) == NULL){
+        s->error = 1;
+        return;
+    }
+    if (fwrite(p, 1, n, sp->file) != n)
+        s->error = 1;
+    sp->file_len += n;
+}
+
+/**
+ * @brief  Start holding back the bytes written to a stream.
+ * @details  See stream.h.  Holding a stream that is already held does
+ * nothing.
+ *
+ * @return  0 on success, -1 if the stream does not write to a file or
+ * memory could not be allocated.
+ */
+int stream_hold(STREAM *s) {
+    if (!s->writing || s->file == NULL)
+        return -1;
+    if (s->spill != NULL)
+        return 0;
+    // what was written before is not held back
+    stream_encode(s, 0);
+    s->offset += s->len;
+    s->len = 0;
+    s->spill = budget_calloc(1, sizeof(SPILL));
+    return s->spill == NULL ? -1 : 0;
+}
+
+/**
+ * @brief  Pass the bytes held back so far down to the file, and go on
+ * holding back the bytes written after them.
+ *
+ * @return  0 on success, EOF if an error has occurred on the stream.
+ */
+int stream_commit(STREAM *s) {
+    SPILL *sp = s->spill;
+    if (sp == NULL)
+        return s->error ? EOF : 0;
+    unsigned char *buf = s->buf;
+    size_t len = s->len;
+    size_t size = s->size;
+
+    // the encoder takes the held bytes from buf, a block at a time
+    if (sp->len > 0){
+        s->buf = sp->mem;
+        s->len = sp->len;
+        stream_encode(s, 0);
+    }
+    if (sp->file != NULL && sp->file_len > 0){
+        unsigned char block[STREAM_MINBLOCK];
+        s->buf = sp->size > 0 ? sp->mem : block;
+        s->size = sp->size > 0 ? sp->size : sizeof(block);
+        rewind(sp->file);
+        while (!s->error && (s->len = fread(s->buf, 1, s->size, sp->file)) > 0)
+            stream_encode(s, 0);
+        if (ferror(sp->file))
+            s->error = 1;
+        rewind(sp->file);
+        if (ftruncate(fileno(sp->file), 0))
+            s->error = 1;
+        sp->file_len = 0;
+    }
+    sp->len = 0;
+    s->buf = buf;
+    s->len = len;
+    s->size = size;
+    stream_encode(s, 0);
+    s->offset += s->len;
+    s->len = 0;
+    return s->error ? EOF : 0;
+}
+
+static void spill_free(STREAM *s) {
+    SPILL *sp = s->spill;
+    if (sp->file != NULL)
+        fclose(sp->file);
+    budget_free(sp->mem);
+    budget_free(sp);
+    s->spill = NULL;
+}
+
+/**
+ * @brief  Pass the bytes held back down to the file, and stop holding.
+ *
+ * @return  0 on success, EOF if an error has occurred on the stream.
+ */
+int stream_release(STREAM *s) {
+    if (s->spill == NULL)
+        return s->error ? EOF : 0;
+    int result = stream_commit(s);
+    spill_free(s);
+    return result;
+}
+
+/**
+ * @brief  Drop the bytes held back, and stop holding.
+ */
+void stream_rollback(STREAM *s) {
+    SPILL *sp = s->spill;
+    if (sp == NULL)
+        return;
+    s->offset -= sp->len + sp->file_len;
+    s->len = 0;
+    spill_free(s);
+}
+
+/**
+ * @brief  Detach a stream from its file, keeping its memory for reuse.
+ * @details  This finishes with the file as stream_close() does, but
+ * the stream's blocks stay allocated, so that stream_rebind() can
+ * attach it to another file without allocating anything.
+ *
+ * @return  0 on success, EOF if an error occurred at any point while
+ * the stream was attached.
+ */
+int stream_detach(STREAM *s) {
+    if (s == NULL)
+        return 0;
+    if (s->spill != NULL)
+        stream_rollback(s);
+    if (s->writing && s->file != NULL){
+        stream_drain(s, 1);
+        if (fflush(s->file))
+            s->error = 1;
+    }
+    int err = s->error;
+
+#ifdef FLIKI_ZLIB
+    if (s->codec == STREAM_GZIP && s->codec_state != NULL){
+        if (s->writing)
+            deflateEnd(s->codec_state);
+        else
+            inflateEnd(s->codec_state);
+        budget_free(s->codec_state);
+    }
+#endif
+#ifdef FLIKI_ZSTD
+    if (s->codec == STREAM_ZSTD){
+        if (s->writing)
+            ZSTD_freeCCtx(s->codec_state);
+        else
+            ZSTD_freeDCtx(s->codec_state);
+    }
+#endif
+    s->file = NULL;
+    s->codec = STREAM_PLAIN;
+    s->codec_state = NULL;
+    s->eof = s->error = s->midframe = 0;
+    s->pos = s->len = 0;
+    s->zpos = s->zlen = 0;
+    s->offset = 0;
+    s->index = NULL;
+    s->hash = NULL;
+    s->tee = NULL;
+    return err ? EOF : 0;
+}
+
+/**
+ * @brief  Attach a detached stream to a file.
+ * @details  The stream is set up as stream_open_reader() or
+ * stream_open_writer() would set up a new one, according to the
+ * direction it was opened in, but in the memory it already has.
+ *
+ * @param s  A stream opened with stream_open_unbound(), or with
+ * stream_open_reader() or stream_open_writer() and since detached.
+ * @param codec, level, threads  As for stream_open_writer(); not
+ * used for a reading stream, whose codec is detected.
+ * @return  0 on success, or -1 with the stream left detached.
+ */
+int stream_rebind(STREAM *s, FILE *file, STREAM_CODEC codec, int level, int threads) {
+    if (s == NULL || file == NULL || s->file != NULL)
+        return -1;
+    s->file = file;
+    if (s->writing ? writer_start(s, codec, level, threads) : reader_start(s)){
+        stream_detach(s);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief  Close a stream, leaving the underlying file open.
+ * @details  For a writing stream, pending bytes are written out and
+ * the compressed stream, if any, is terminated.  Bytes still held
+ * back are dropped.
+ *
+ * @return  0 on success, EOF if an error occurred at any point while
+ * the stream was open.
+ */
+int stream_close(STREAM *s) {
+    if (s == NULL)
+        return 0;
+    int err = stream_detach(s);
+    budget_free(s->zbuf);
+    budget_free(s->buf);
+    budget_free(s);
+    return err;
+}
@@ -0,0 +1,120 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdio.h>
+
+#include "fliki.h"
+
+/*
+ * Buffered byte streams used by the patch engine in place of raw
+ * FILE * access.  A stream owns its own block buffer, so single-byte
+ * reads and writes are plain memory operations, and the bytes that
+ * flow through it may be transparently compressed.
+ *
+ * Readers detect gzip and zstd data from the magic bytes at the start
+ * of the input and decode on the fly.  Writers compress with the codec
+ * they were opened with.  Codec support is compiled in with
+ * -DFLIKI_ZLIB (link with -lz) and -DFLIKI_ZSTD (link with -lzstd);
+ * without them every stream read is plain, and a writer cannot be
+ * opened with a codec that is missing.
+ */
+
+#define STREAM_BUFSIZE 65536   // decoded bytes held by a stream
+#define STREAM_PUSHBACK 8      // bytes that can always be pushed back
+#define STREAM_MINBLOCK 4096   // smallest block a stream falls back to when memory is short
+#define STREAM_SPILL_MEMORY (16 << 20)  // bytes held back in memory before a temporary file is used
+
+typedef enum {
+    STREAM_PLAIN,
+    STREAM_GZIP,
+    STREAM_ZSTD
+} STREAM_CODEC;
+
+typedef struct stream {
+    FILE *file;                // underlying file (never closed by us), NULL for memory
+    STREAM_CODEC codec;
+    int writing;
+    int eof;                   // no more data can be read
+    int error;                 // read, decode, write or encode failure
+    int midframe;              // compressed input is inside a gzip member or zstd frame
+    unsigned char *buf;        // decoded bytes (read) or pending bytes (write)
+    size_t pos;                // next byte to read
+    size_t len;                // end of valid data in buf
+    size_t size;               // capacity of buf
+    unsigned char *zbuf;       // compressed bytes on their way in or out
+    size_t zpos;
+    size_t zlen;
+    size_t zsize;
+    void *codec_state;
+    long long offset;          // stream offset of buf[0]
+    struct line_index *index;  // line offsets of the input file, or NULL
+    struct hash *hash;         // hashes every byte read, or NULL
+    FILE *tee;                 // gets a copy of every byte written (plain only), or NULL
+    struct spill *spill;       // bytes written but held back (see stream_hold()), or NULL
+} STREAM;
+
+STREAM *stream_open_reader(FILE *file);
+STREAM *stream_open_writer(FILE *file, STREAM_CODEC codec, int level, int threads);
+int stream_max_level(STREAM_CODEC codec);
+STREAM *stream_open_memory(const void *data, size_t len);
+STREAM *stream_open_buffer(void);
+STREAM *stream_open_unbound(int writing);
+unsigned char *stream_contents(STREAM *s, size_t *lenp);
+int stream_rebind(STREAM *s, FILE *file, STREAM_CODEC codec, int level, int threads);
+int stream_detach(STREAM *s);
+int stream_close(STREAM *s);
+
+int stream_fill(STREAM *s);
+size_t stream_peek(STREAM *s, size_t n);
+const unsigned char *stream_scan(const unsigned char *p, const unsigned char *end);
+int stream_ungetc(int c, STREAM *s);
+int stream_flushc(int c, STREAM *s);
+size_t stream_write(const void *data, size_t n, STREAM *s);
+int stream_flush(STREAM *s);
+int stream_seek(STREAM *s, long long offset);
+int stream_copy(STREAM *in, STREAM *out, long long n);
+int stream_hash(STREAM *s, struct hash *h);
+
+/*
+ * Holding back output.  While a writing stream is held, the bytes
+ * written to it are kept, first in memory and then in a temporary
+ * file, instead of being passed down to its file.  They are passed
+ * down only when committed, and can instead be rolled back, so that
+ * the file never sees them.  Bytes still held when the stream is
+ * closed are dropped.
+ */
+int stream_hold(STREAM *s);
+int stream_commit(STREAM *s);
+int stream_release(STREAM *s);
+void stream_rollback(STREAM *s);
+
+/*
+ * Single-byte access.  These are macros so that the common case is
+ * an index check and a load or store; the slow paths refill or drain
+ * the buffer.  stream_getc() returns the byte as an unsigned char
+ * converted to int, or EOF.
+ */
+#define stream_getc(s) \
+    ((s)->pos < (s)->len ? (int) (s)->buf[(s)->pos++] : stream_fill(s))
+#define stream_putc(c, s) \
+    ((s)->len < (s)->size ? (int) ((s)->buf[(s)->len++] = (unsigned char) (c)) \
+                          : stream_flushc((c), (s)))
+
+// Offset of the next byte to be read from (or written to) the stream.
+#define stream_tell(s) ((s)->offset + (long long) ((s)->writing ? (s)->len : (s)->pos))
+
+/*
+ * Stream-based variants of the fliki.c entry points.  The FILE *
+ * versions wrap their arguments in streams and call these.
+ */
+#define HUNK_HEADER_MAX 64     // longer hunk headers are ill-formed
+
+void hunk_reset(void);
+void hunk_use_buffers(char *deletions, char *additions);
+int hunk_next_stream(HUNK *hp, STREAM *in);
+const char *hunk_error(long long *offsetp);
+int hunk_getc_stream(HUNK *hp, STREAM *in);
+long hunk_getspan(HUNK *hp, STREAM *in, const unsigned char **spanp);
+int patch_stream(STREAM *in, STREAM *out, STREAM *diff, long options);
+
+#endif
@@ -3,6 +3,180 @@
 #include "fliki.h"
 #include "global.h"
 #include "debug.h"
+#include "options.h"
+#include "stream.h"
+#include "report.h"
+#include "stat.h"
+
+int output_codec = STREAM_PLAIN;
+int output_level = 0;
+int output_threads = 0;
+char **diff_filenames = NULL;
+int diff_count = 0;
+int compose_option = 0;
+char *daemon_socket = NULL;
+int daemon_workers = 0;
+char *line_index_dir = NULL;
+char *output_path = NULL;
+int merge_option = 0;
+int stat_option = 0;
+int stat_format = STAT_FORMAT_TEXT;
+int fanout_option = 0;
+char *fanout_dir = NULL;
+int verify_option = 0;
+int error_format = ERROR_FORMAT_TEXT;
+char *cache_dir = NULL;
+int cache_size = 1024;
+int mem_limit = 0;
+
+/*
+ * If arg is the long option name (without its leading "--"), return a
+ * pointer to its value: the text after '=', or an empty string if
+ * there is none.  Otherwise return NULL.
+ */
+static char *match_option(char *arg, char *name) {
+    while (*name != 0){
+        if (*arg != *name)
+            return NULL;
+        arg++;
+        name++;
+    }
+    if (*arg == '=')
+        return arg + 1;
+    if (*arg == 0)
+        return arg;
+    return NULL;
+}
+
+static int same_string(char *a, char *b) {
+    while (*a != 0 && *a == *b){
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+// return a non-negative number, or -1 if s is not one
+static int parse_count(char *s) {
+    int num = 0;
+    if (*s == 0)
+        return -1;
+    while (*s != 0){
+        if (*s < '0' || *s > '9' || num > 100000)
+            return -1;
+        num = num * 10 + (*s - '0');
+        s++;
+    }
+    return num;
+}
+
+// handle one "--name[=value]" argument, returning 0 if it is valid
+static int long_option(char *arg) {
+    char *value;
+    if ((value = match_option(arg, "compress")) != NULL){
+        if (same_string(value, "gzip"))
+            output_codec = STREAM_GZIP;
+        else if (same_string(value, "zstd"))
+            output_codec = STREAM_ZSTD;
+        else if (same_string(value, "none"))
+            output_codec = STREAM_PLAIN;
+        else
+            return -1;
+        // only codecs that were compiled in
+        return stream_max_level(output_codec) < 0 ? -1 : 0;
+    }
+    if ((value = match_option(arg, "level")) != NULL){
+        output_level = parse_count(value);
+        return output_level < 0 ? -1 : 0;
+    }
+    if ((value = match_option(arg, "threads")) != NULL){
+        output_threads = parse_count(value);
+        return output_threads < 0 ? -1 : 0;
+    }
+    if ((value = match_option(arg, "compose")) != NULL){
+        compose_option = 1;
+        return *value == 0 ? 0 : -1;
+    }
+    if ((value = match_option(arg, "merge")) != NULL){
+        merge_option = 1;
+        return *value == 0 ? 0 : -1;
+    }
+    if ((value = match_option(arg, "stat")) != NULL){
+        stat_option = 1;
+        if (*value == 0 || same_string(value, "text"))
+            stat_format = STAT_FORMAT_TEXT;
+        else if (same_string(value, "json"))
+            stat_format = STAT_FORMAT_JSON;
+        else
+            return -1;
+        return 0;
+    }
+    if ((value = match_option(arg, "fan-out")) != NULL){
+        fanout_option = 1;
+        fanout_dir = *value == 0 ? NULL : value;
+        return 0;
+    }
+    if ((value = match_option(arg, "daemon")) != NULL){
+        daemon_socket = value;
+        return *value == 0 ? -1 : 0;
+    }
+    if ((value = match_option(arg, "workers")) != NULL){
+        daemon_workers = parse_count(value);
+        return daemon_workers < 0 ? -1 : 0;
+    }
+    if ((value = match_option(arg, "verify")) != NULL){
+        verify_option = 1;
+        return *value == 0 ? 0 : -1;
+    }
+    if ((value = match_option(arg, "ignore-cr")) != NULL){
+        global_options |= IGNORE_CR_OPTION;
+        return *value == 0 ? 0 : -1;
+    }
+    if ((value = match_option(arg, "ignore-trailing-ws")) != NULL){
+        global_options |= IGNORE_TRAILING_WS_OPTION;
+        return *value == 0 ? 0 : -1;
+    }
+    if ((value = match_option(arg, "ignore-all-ws")) != NULL){
+        global_options |= IGNORE_ALL_WS_OPTION;
+        return *value == 0 ? 0 : -1;
+    }
+    if ((value = match_option(arg, "transaction")) != NULL){
+        global_options &= ~TRANSACTION_OPTIONS;
+        if (*value == 0 || same_string(value, "hunk"))
+            global_options |= TRANSACTION_HUNK_OPTION;
+        else if (same_string(value, "all"))
+            global_options |= TRANSACTION_ALL_OPTION;
+        else
+            return -1;
+        return 0;
+    }
+    if ((value = match_option(arg, "error-format")) != NULL){
+        if (same_string(value, "text"))
+            error_format = ERROR_FORMAT_TEXT;
+        else if (same_string(value, "json"))
+            error_format = ERROR_FORMAT_JSON;
+        else
+            return -1;
+        return 0;
+    }
+    if ((value = match_option(arg, "cache")) != NULL){
+        cache_dir = value;
+        return *value == 0 ? -1 : 0;
+    }
+    if ((value = match_option(arg, "cache-size")) != NULL){
+        cache_size = parse_count(value);
+        return cache_size <= 0 ? -1 : 0;
+    }
+    if ((value = match_option(arg, "mem-limit")) != NULL){
+        mem_limit = parse_count(value);
+        return mem_limit <= 0 ? -1 : 0;
+    }
+    if ((value = match_option(arg, "line-index")) != NULL){
+        line_index_dir = value;
+        return *value == 0 ? -1 : 0;
+    }
+    return -1;
+}
 
 /**
  * @brief Validates command line arguments passed to the program.
@@ -20,6 +194,9 @@
  * of the selected program options.
  * @modifies global variable "diff_filename" to point to the name of the file
  * containing the diffs to be used.
+ * @modifies global variables "diff_filenames" and "diff_count" to describe
+ * all the diff files given, and the variables in options.h to hold the
+ * values of any long options.
  */
 
 int validargs(int argc, char **argv) {
@@ -45,14 +222,21 @@ int validargs(int argc, char **argv) {
         if (**argv != '-'){
             diff_filename = *argv;
             // printf("diff_filename: %s\n", *argv);
-            argc--;
+            // the remaining arguments are all diff files
+            diff_filenames = argv;
+            diff_count = 0;
+            while (argc > 0 && **argv != '-'){
+                diff_count++;
+                argv++;
+                argc--;
+            }
             fileExist = 1;
             break;
         }
         else{
             (*argv)++;
             // detect invalid command. ex. -q-n, -qq, -nn
-            if(*(*argv + 1) != 0){
+            if(**argv != '-' && *(*argv + 1) != 0){
                 // printf("INVALID COMMAND LENGTH");
                 return -1;
             }
@@ -79,6 +263,19 @@ int validargs(int argc, char **argv) {
                         global_options += 4;
                     qFlag = 1;
                     break;
+                case 'o':
+                    // the next argument is the file to write
+                    if (argc < 2 || output_path != NULL)
+                        return -1;
+                    argv++;
+                    argc--;
+                    output_path = *argv;
+                    break;
+                case '-':
+                    // long option, ex. --compress=zstd
+                    if (long_option(*argv + 1))
+                        return -1;
+                    break;
                 default:
                     // printf("INVALID FLAG");
                     return -1;
@@ -99,11 +296,42 @@ int validargs(int argc, char **argv) {
         return -1;
     }
 
+    // the level is that of the codec the output is compressed with
+    if(output_codec != STREAM_PLAIN && output_level > stream_max_level(output_codec)){
+        return -1;
+    }
+
+    // a service gets its diff files from requests
+    if(daemon_socket != NULL){
+        return fileExist || verify_option || merge_option || stat_option || fanout_option ||
+               output_path != NULL || (global_options & TRANSACTION_OPTIONS) ? -1 : 0;
+    }
+
     if(!fileExist){
         // printf("DIFF_FILE IS MISSING");
         return -1;
     }
 
+    // the reference implementation applies a single diff, and compares exactly
+    if(verify_option && (diff_count != 1 || compose_option || (global_options & IGNORE_OPTIONS))){
+        return -1;
+    }
+
+    // a merge takes exactly two diffs, both against the input
+    if(merge_option && (diff_count != 2 || compose_option || verify_option)){
+        return -1;
+    }
+
+    // statistics are of a single diff, with nothing patched
+    if(stat_option && (diff_count != 1 || compose_option || merge_option || verify_option)){
+        return -1;
+    }
+
+    // fan-out takes a diff and the files to apply it to, writing each result to its own file
+    if(fanout_option && (diff_count < 2 || compose_option || merge_option || stat_option ||
+                         verify_option || cache_dir != NULL || output_path != NULL)){
+        return -1;
+    }
     // printf("global_options: %ld\n", global_options);
     return 0;
 }